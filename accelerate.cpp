@@ -1,38 +1,51 @@
 #include "accelerate.h"
+#include "logger.h"
 
 #include <algorithm>
 #include <cmath>
+#include <numeric>
 #include <optional>
+#include <atomic>
+#include <cassert>
 
-const bool rendertoy::BBox::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, float &t, float *t_max) const
-{
-    glm::vec3 inv_direction = 1.0f / direction;
+#include <tbb/tbb.h>
 
-    glm::vec3 t1 = (_pmin - origin) * inv_direction;
-    glm::vec3 t2 = (_pmax - origin) * inv_direction;
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64)
+#include <xmmintrin.h>
+#define RENDERTOY_WIDE_BVH_SSE
+#endif
 
-    glm::vec3 tmin = glm::min(t1, t2);
-    glm::vec3 tmax = glm::max(t1, t2);
+const bool rendertoy::BBox::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, float &t, float *t_exit) const
+{
+    glm::vec3 inv_direction = 1.0f / direction;
 
-    // float t_enter = glm::max(tmin.x, glm::max(tmin.y, tmin.z));
-    // float t_exit = glm::min(tmax.x, glm::min(tmax.y, tmax.z));
-    float t_enter = glm::compMax(tmin);
-    float t_exit = glm::compMin(tmax);
+    // Planes picked by the direction sign as in IntersectSegment: a ray running within a slab plane gives 0 * inf = NaN for that plane only,
+    // and std::max / std::min return their first argument when the comparison involves NaN, which skips it.
+    float enter = -std::numeric_limits<float>::infinity();
+    float exit = std::numeric_limits<float>::infinity();
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const bool negative = inv_direction[axis] < 0.0f;
+        const float t_near = ((negative ? _pmax[axis] : _pmin[axis]) - origin[axis]) * inv_direction[axis];
+        const float t_far = ((negative ? _pmin[axis] : _pmax[axis]) - origin[axis]) * inv_direction[axis];
+        enter = std::max(enter, t_near);
+        exit = std::min(exit, t_far);
+    }
 
-    if (t_exit >= t_enter && t_exit >= 0.0f)
+    if (exit >= enter && exit >= 0.0f)
     {
-        if (t_enter < 0)
+        if (enter < 0)
         {
-            t = t_exit;
+            t = exit;
         }
         else
         {
-            t = t_enter;
+            t = enter;
         }
 
-        if(t_max)
+        if (t_exit)
         {
-            *t_max = t_exit;
+            *t_exit = exit;
         }
 
         return true;
@@ -104,3 +117,1346 @@ const glm::vec3 rendertoy::BBox::Offset(const glm::vec3 &p) const
         o.z /= _pmax.z - _pmin.z;
     return o;
 }
+
+
+void rendertoy::WideBVH::Collapse(const std::vector<LinearBVHNode> &binary, const bool quantize)
+{
+    clear();
+    if (binary.empty())
+    {
+        return;
+    }
+    _nodes.reserve(binary.size() / 2 + 1);
+    CollapseNode(binary, 0);
+    if (quantize)
+    {
+        Quantize();
+        _nodes.clear();
+    }
+    _nodes.shrink_to_fit();
+}
+
+const int rendertoy::WideBVH::CollapseNode(const std::vector<LinearBVHNode> &binary, const int binary_index)
+{
+    const int wide_index = static_cast<int>(_nodes.size());
+    _nodes.emplace_back();
+
+    // Pull grandchildren up until the node is full, always opening the interior child with the largest surface area.
+    int children[WIDE_BVH_WIDTH];
+    int n_children = 0;
+    if (binary[binary_index].n_primitives > 0)
+    {
+        children[n_children++] = binary_index;
+    }
+    else
+    {
+        children[n_children++] = binary_index + 1;
+        children[n_children++] = binary[binary_index].second_child_offset;
+    }
+    while (n_children < WIDE_BVH_WIDTH)
+    {
+        int best = -1;
+        float best_area = -std::numeric_limits<float>::infinity();
+        for (int i = 0; i < n_children; ++i)
+        {
+            const LinearBVHNode &child = binary[children[i]];
+            if (child.n_primitives == 0 && child._bbox.SurfaceArea() > best_area)
+            {
+                best = i;
+                best_area = child._bbox.SurfaceArea();
+            }
+        }
+        if (best == -1)
+        {
+            break;
+        }
+        const int opened = children[best];
+        children[best] = opened + 1;
+        children[n_children++] = binary[opened].second_child_offset;
+    }
+
+    int offset[WIDE_BVH_WIDTH];
+    uint16_t count[WIDE_BVH_WIDTH];
+    for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+    {
+        if (i >= n_children)
+        {
+            offset[i] = -1;
+            count[i] = 0;
+            continue;
+        }
+        const LinearBVHNode &child = binary[children[i]];
+        if (child.n_primitives > 0)
+        {
+            offset[i] = child.primitive_offset;
+            count[i] = child.n_primitives;
+        }
+        else
+        {
+            offset[i] = CollapseNode(binary, children[i]);
+            count[i] = 0;
+        }
+    }
+
+    WideBVHNode &node = _nodes[wide_index];
+    for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // Empty slots get inverted bounds so that they are never hit.
+            node.bounds_min[axis][i] = i < n_children ? binary[children[i]]._bbox._pmin[axis] : std::numeric_limits<float>::infinity();
+            node.bounds_max[axis][i] = i < n_children ? binary[children[i]]._bbox._pmax[axis] : -std::numeric_limits<float>::infinity();
+        }
+        node.offset[i] = offset[i];
+        node.count[i] = count[i];
+    }
+    return wide_index;
+}
+
+// Smallest grid exponent, keeping q * 2^exponent a normal float so that dequantization never rounds.
+constexpr int QUANTIZED_MIN_EXPONENT = -100;
+
+static inline float Dequantize(const float origin, const int exponent, const uint8_t q)
+{
+    return origin + static_cast<float>(q) * std::ldexp(1.0f, exponent);
+}
+
+void rendertoy::WideBVH::Quantize()
+{
+    _quantized_nodes.resize(_nodes.size());
+    for (size_t n = 0; n < _nodes.size(); ++n)
+    {
+        const WideBVHNode &node = _nodes[n];
+        QuantizedWideBVHNode &quantized = _quantized_nodes[n];
+        quantized.child_mask = 0;
+        for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+        {
+            if (node.offset[i] != -1)
+            {
+                quantized.child_mask |= 1 << i;
+            }
+            quantized.offset[i] = node.offset[i];
+            quantized.count[i] = node.count[i];
+        }
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // The grid spans the union of the child bounds with 255 steps of a power of two, so that q * 2^exponent is exact.
+            float lo = std::numeric_limits<float>::infinity();
+            float hi = -std::numeric_limits<float>::infinity();
+            for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+            {
+                if (quantized.child_mask & (1 << i))
+                {
+                    lo = std::min(lo, node.bounds_min[axis][i]);
+                    hi = std::max(hi, node.bounds_max[axis][i]);
+                }
+            }
+            int exponent;
+            std::frexp((hi - lo) / 255.0f, &exponent);
+            exponent = std::max(exponent, QUANTIZED_MIN_EXPONENT);
+            while (exponent < std::numeric_limits<int8_t>::max() && Dequantize(lo, exponent, 255) < hi)
+            {
+                ++exponent;
+            }
+            quantized.origin[axis] = lo;
+            quantized.exponent[axis] = static_cast<int8_t>(exponent);
+
+            const float step = std::ldexp(1.0f, exponent);
+            for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+            {
+                if (!(quantized.child_mask & (1 << i)))
+                {
+                    quantized.bounds_min[axis][i] = 255;
+                    quantized.bounds_max[axis][i] = 0;
+                    continue;
+                }
+                // Round outwards, then fix up the rounding of the dequantized sum, so that the grid bounds contain the exact ones.
+                int q_min = static_cast<int>(std::floor((node.bounds_min[axis][i] - lo) / step));
+                int q_max = static_cast<int>(std::ceil((node.bounds_max[axis][i] - lo) / step));
+                q_min = std::clamp(q_min, 0, 255);
+                q_max = std::clamp(q_max, 0, 255);
+                while (q_min > 0 && Dequantize(lo, exponent, static_cast<uint8_t>(q_min)) > node.bounds_min[axis][i])
+                {
+                    --q_min;
+                }
+                while (q_max < 255 && Dequantize(lo, exponent, static_cast<uint8_t>(q_max)) < node.bounds_max[axis][i])
+                {
+                    ++q_max;
+                }
+                quantized.bounds_min[axis][i] = static_cast<uint8_t>(q_min);
+                quantized.bounds_max[axis][i] = static_cast<uint8_t>(q_max);
+            }
+        }
+    }
+}
+
+void rendertoy::WideBVH::CollectLeafRanges(std::vector<std::pair<int, int>> &leaf_ranges) const
+{
+    auto collect = [&](const auto &nodes)
+    {
+        for (const auto &node : nodes)
+        {
+            for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+            {
+                if (node.count[i] > 0)
+                {
+                    leaf_ranges.emplace_back(node.offset[i], node.offset[i] + node.count[i]);
+                }
+            }
+        }
+    };
+    collect(_nodes);
+    collect(_quantized_nodes);
+}
+
+const int rendertoy::WideBVH::IntersectChildren(const QuantizedWideBVHNode &node, const glm::vec3 &origin, const glm::vec3 &inv_direction, const float t_max, float *dist)
+{
+    alignas(16) float bounds_min[3][WIDE_BVH_WIDTH];
+    alignas(16) float bounds_max[3][WIDE_BVH_WIDTH];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const float step = std::ldexp(1.0f, node.exponent[axis]);
+        for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+        {
+            bounds_min[axis][i] = node.origin[axis] + static_cast<float>(node.bounds_min[axis][i]) * step;
+            bounds_max[axis][i] = node.origin[axis] + static_cast<float>(node.bounds_max[axis][i]) * step;
+        }
+    }
+    // Empty slots dequantize to finite inverted bounds, which axis-parallel rays could still pass, so they are masked out.
+    return IntersectBounds(bounds_min, bounds_max, origin, inv_direction, t_max, dist) & node.child_mask;
+}
+
+const int rendertoy::WideBVH::IntersectBounds(const float (&bounds_min)[3][WIDE_BVH_WIDTH], const float (&bounds_max)[3][WIDE_BVH_WIDTH], const glm::vec3 &origin, const glm::vec3 &inv_direction, const float t_max, float *dist)
+{
+#ifdef RENDERTOY_WIDE_BVH_SSE
+    __m128 t_enter = _mm_setzero_ps();
+    __m128 t_exit = _mm_set1_ps(t_max);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const __m128 o = _mm_set1_ps(origin[axis]);
+        const __m128 inv_d = _mm_set1_ps(inv_direction[axis]);
+        // Near and far planes are picked by the ray direction sign, which keeps the inverted bounds of empty slots a miss.
+        const bool negative = inv_direction[axis] < 0.0f;
+        const __m128 t_near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(negative ? bounds_max[axis] : bounds_min[axis]), o), inv_d);
+        const __m128 t_far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(negative ? bounds_min[axis] : bounds_max[axis]), o), inv_d);
+        // _mm_max_ps / _mm_min_ps return the second operand for NaN, so rays running within a slab plane skip that axis.
+        t_enter = _mm_max_ps(t_near, t_enter);
+        t_exit = _mm_min_ps(t_far, t_exit);
+    }
+    const int hit_mask = _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit));
+    _mm_storeu_ps(dist, t_enter);
+    return hit_mask;
+#else
+    int hit_mask = 0;
+    for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+    {
+        float t_enter = 0.0f;
+        float t_exit = t_max;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const bool negative = inv_direction[axis] < 0.0f;
+            const float t_near = ((negative ? bounds_max[axis][i] : bounds_min[axis][i]) - origin[axis]) * inv_direction[axis];
+            const float t_far = ((negative ? bounds_min[axis][i] : bounds_max[axis][i]) - origin[axis]) * inv_direction[axis];
+            t_enter = std::max(t_enter, t_near);
+            t_exit = std::min(t_exit, t_far);
+        }
+        if (t_enter <= t_exit)
+        {
+            hit_mask |= 1 << i;
+        }
+        dist[i] = t_enter;
+    }
+    return hit_mask;
+#endif // RENDERTOY_WIDE_BVH_SSE
+}
+
+// Levels of median halving needed before count primitives fit into leaves of max_leaf_primitives.
+static const int MedianHalvingLevels(int count, const int max_leaf_primitives)
+{
+    int levels = 0;
+    for (; count > max_leaf_primitives; count -= count / 2)
+    {
+        ++levels;
+    }
+    return levels;
+}
+
+constexpr int SBVH_BINS = 32;
+constexpr int SBVH_MAX_LEAF_PRIMITIVES = 8;      // bvh::v2 leaves hold at most 15 primitives.
+constexpr int SBVH_MAX_SPLIT_DEPTH = 48;         // Deeper nodes only use object splits, so the tree stays within the traversal stack.
+constexpr float SBVH_OVERLAP_THRESHOLD = 1e-5f; // Spatial splits are only tried where object-split children overlap by this fraction of the root area.
+
+struct SpatialSplitReference
+{
+    int primitive;
+    rendertoy::BBox bounds;
+};
+
+struct SpatialSplitBuilder
+{
+    const rendertoy::PrimitiveSplitter &splitter;
+    std::vector<rendertoy::LinearBVHNode> &nodes;
+    std::vector<int> &leaf_order;
+    size_t reference_count;
+    size_t reference_budget;
+    float min_overlap_area;
+};
+
+struct SpatialSplitBin
+{
+    rendertoy::BBox bounds;
+    int count = 0; // Object bins: references binned. Spatial bins: references entering the bin.
+    int exits = 0; // Spatial bins only: references leaving the bin.
+    bool empty = true;
+
+    void Add(const rendertoy::BBox &bbox)
+    {
+        if (empty)
+        {
+            bounds = bbox;
+            empty = false;
+        }
+        else
+        {
+            bounds.Union(bbox);
+        }
+    }
+};
+
+static const bool IsValidBBox(const rendertoy::BBox &bbox)
+{
+    return bbox._pmin.x <= bbox._pmax.x && bbox._pmin.y <= bbox._pmax.y && bbox._pmin.z <= bbox._pmax.z;
+}
+
+static const float OverlapArea(const rendertoy::BBox &a, const rendertoy::BBox &b)
+{
+    const rendertoy::BBox overlap(glm::max(a._pmin, b._pmin), glm::min(a._pmax, b._pmax));
+    return IsValidBBox(overlap) ? overlap.SurfaceArea() : 0.0f;
+}
+
+static void SplitReference(const SpatialSplitBuilder &builder, const SpatialSplitReference &reference, const int axis, const float position, rendertoy::BBox &left, rendertoy::BBox &right)
+{
+    if (builder.splitter)
+    {
+        builder.splitter(reference.primitive, axis, position, reference.bounds, left, right);
+    }
+    else
+    {
+        left = reference.bounds;
+        right = reference.bounds;
+    }
+    // The splitter may return the bounds of the whole primitive, keep both halves within the reference and on their side of the plane.
+    left = rendertoy::BBox(glm::max(left._pmin, reference.bounds._pmin), glm::min(left._pmax, reference.bounds._pmax));
+    right = rendertoy::BBox(glm::max(right._pmin, reference.bounds._pmin), glm::min(right._pmax, reference.bounds._pmax));
+    left._pmax[axis] = std::min(left._pmax[axis], position);
+    right._pmin[axis] = std::max(right._pmin[axis], position);
+}
+
+static const int SpatialSplitBuild(SpatialSplitBuilder &builder, std::vector<SpatialSplitReference> &references, const int depth)
+{
+    using rendertoy::BBox;
+    const int node_index = static_cast<int>(builder.nodes.size());
+    builder.nodes.emplace_back();
+    const int reference_count = static_cast<int>(references.size());
+
+    BBox node_bbox = references[0].bounds;
+    BBox centroid_bbox(references[0].bounds.GetCenter(), references[0].bounds.GetCenter());
+    for (const SpatialSplitReference &reference : references)
+    {
+        node_bbox.Union(reference.bounds);
+        centroid_bbox.Union(reference.bounds.GetCenter());
+    }
+    builder.nodes[node_index]._bbox = node_bbox;
+
+    auto make_leaf = [&]() -> int
+    {
+        builder.nodes[node_index].primitive_offset = static_cast<int>(builder.leaf_order.size());
+        builder.nodes[node_index].n_primitives = static_cast<uint16_t>(reference_count);
+        for (const SpatialSplitReference &reference : references)
+        {
+            builder.leaf_order.push_back(reference.primitive);
+        }
+        return node_index;
+    };
+    if (reference_count == 1 || depth >= rendertoy::MAX_TRAVERSE_DEPTH - 1)
+    {
+        return make_leaf();
+    }
+    // Close to the depth cap only median halving is used, so the references are down to leaf size when the cap is reached.
+    const bool force_halving = depth + MedianHalvingLevels(reference_count, SBVH_MAX_LEAF_PRIMITIVES) >= rendertoy::MAX_TRAVERSE_DEPTH - 1;
+
+    const float node_area = node_bbox.SurfaceArea();
+
+    // Object split, binned SAH over the reference centroids on every axis.
+    float object_cost = std::numeric_limits<float>::infinity();
+    int object_axis = -1, object_bin = -1;
+    BBox object_left, object_right;
+    auto object_bin_index = [&](const SpatialSplitReference &reference, const int axis)
+    {
+        const int b = static_cast<int>(SBVH_BINS * centroid_bbox.Offset(reference.bounds.GetCenter())[axis]);
+        return std::clamp(b, 0, SBVH_BINS - 1);
+    };
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (centroid_bbox._pmax[axis] == centroid_bbox._pmin[axis])
+        {
+            continue;
+        }
+        SpatialSplitBin bins[SBVH_BINS];
+        for (const SpatialSplitReference &reference : references)
+        {
+            SpatialSplitBin &bin = bins[object_bin_index(reference, axis)];
+            bin.Add(reference.bounds);
+            ++bin.count;
+        }
+        // right_bins[i] accumulates bins [i, SBVH_BINS).
+        SpatialSplitBin right_bins[SBVH_BINS];
+        for (int i = SBVH_BINS - 1; i >= 0; --i)
+        {
+            right_bins[i] = i + 1 < SBVH_BINS ? right_bins[i + 1] : SpatialSplitBin();
+            if (!bins[i].empty)
+            {
+                right_bins[i].Add(bins[i].bounds);
+                right_bins[i].count += bins[i].count;
+            }
+        }
+        SpatialSplitBin left_bin;
+        for (int i = 0; i < SBVH_BINS - 1; ++i)
+        {
+            if (!bins[i].empty)
+            {
+                left_bin.Add(bins[i].bounds);
+                left_bin.count += bins[i].count;
+            }
+            const SpatialSplitBin &right_bin = right_bins[i + 1];
+            if (left_bin.count == 0 || right_bin.count == 0)
+            {
+                continue;
+            }
+            const float cost = left_bin.count * left_bin.bounds.SurfaceArea() + right_bin.count * right_bin.bounds.SurfaceArea();
+            if (cost < object_cost)
+            {
+                object_cost = cost;
+                object_axis = axis;
+                object_bin = i;
+                object_left = left_bin.bounds;
+                object_right = right_bin.bounds;
+            }
+        }
+    }
+
+    // Spatial split, only where the object split children overlap noticeably and while the reference budget lasts.
+    float spatial_cost = std::numeric_limits<float>::infinity();
+    int spatial_axis = -1;
+    float spatial_position = 0.0f;
+    BBox spatial_left, spatial_right;
+    int spatial_left_count = 0, spatial_right_count = 0;
+    const bool try_spatial = depth < SBVH_MAX_SPLIT_DEPTH && builder.reference_count < builder.reference_budget &&
+                             (object_axis < 0 || OverlapArea(object_left, object_right) > builder.min_overlap_area);
+    for (int axis = 0; try_spatial && axis < 3; ++axis)
+    {
+        const float extent = node_bbox._pmax[axis] - node_bbox._pmin[axis];
+        if (extent <= 0.0f)
+        {
+            continue;
+        }
+        const float bin_width = extent / SBVH_BINS;
+        auto spatial_bin_index = [&](const float p)
+        {
+            return std::clamp(static_cast<int>((p - node_bbox._pmin[axis]) / bin_width), 0, SBVH_BINS - 1);
+        };
+        SpatialSplitBin bins[SBVH_BINS];
+        for (const SpatialSplitReference &reference : references)
+        {
+            const int first_bin = spatial_bin_index(reference.bounds._pmin[axis]);
+            const int last_bin = spatial_bin_index(reference.bounds._pmax[axis]);
+            SpatialSplitReference remaining = reference;
+            for (int b = first_bin; b < last_bin; ++b)
+            {
+                BBox left, right;
+                SplitReference(builder, remaining, axis, node_bbox._pmin[axis] + (b + 1) * bin_width, left, right);
+                if (IsValidBBox(left))
+                {
+                    bins[b].Add(left);
+                }
+                remaining.bounds = right;
+                if (!IsValidBBox(right))
+                {
+                    break;
+                }
+            }
+            if (IsValidBBox(remaining.bounds))
+            {
+                bins[last_bin].Add(remaining.bounds);
+            }
+            ++bins[first_bin].count;
+            ++bins[last_bin].exits;
+        }
+        SpatialSplitBin right_bins[SBVH_BINS];
+        for (int i = SBVH_BINS - 1; i >= 0; --i)
+        {
+            right_bins[i] = i + 1 < SBVH_BINS ? right_bins[i + 1] : SpatialSplitBin();
+            if (!bins[i].empty)
+            {
+                right_bins[i].Add(bins[i].bounds);
+            }
+            right_bins[i].exits += bins[i].exits;
+        }
+        SpatialSplitBin left_bin;
+        for (int i = 0; i < SBVH_BINS - 1; ++i)
+        {
+            if (!bins[i].empty)
+            {
+                left_bin.Add(bins[i].bounds);
+            }
+            left_bin.count += bins[i].count;
+            const SpatialSplitBin &right_bin = right_bins[i + 1];
+            if (left_bin.count == 0 || right_bin.exits == 0 || left_bin.empty || right_bin.empty)
+            {
+                continue;
+            }
+            const float cost = left_bin.count * left_bin.bounds.SurfaceArea() + right_bin.exits * right_bin.bounds.SurfaceArea();
+            if (cost < spatial_cost)
+            {
+                spatial_cost = cost;
+                spatial_axis = axis;
+                spatial_position = node_bbox._pmin[axis] + (i + 1) * bin_width;
+                spatial_left = left_bin.bounds;
+                spatial_right = right_bin.bounds;
+                spatial_left_count = left_bin.count;
+                spatial_right_count = right_bin.exits;
+            }
+        }
+    }
+
+    const float leaf_cost = static_cast<float>(reference_count);
+    const float split_cost = 1.0f / 2.0f + std::min(object_cost, spatial_cost) / node_area;
+    if (reference_count <= SBVH_MAX_LEAF_PRIMITIVES && split_cost >= leaf_cost)
+    {
+        return make_leaf();
+    }
+
+    std::vector<SpatialSplitReference> left_references, right_references;
+    int split_axis = object_axis;
+    if (!force_halving && spatial_cost < object_cost)
+    {
+        split_axis = spatial_axis;
+        const float left_area = spatial_left.SurfaceArea(), right_area = spatial_right.SurfaceArea();
+        for (const SpatialSplitReference &reference : references)
+        {
+            if (reference.bounds._pmax[spatial_axis] <= spatial_position)
+            {
+                left_references.push_back(reference);
+                continue;
+            }
+            if (reference.bounds._pmin[spatial_axis] >= spatial_position)
+            {
+                right_references.push_back(reference);
+                continue;
+            }
+            BBox left, right;
+            SplitReference(builder, reference, spatial_axis, spatial_position, left, right);
+            if (!IsValidBBox(left) || !IsValidBBox(right))
+            {
+                // The primitive only touches one side within this reference, or none at all because of rounding.
+                if (IsValidBBox(left) || IsValidBBox(right))
+                {
+                    (IsValidBBox(left) ? left_references : right_references).push_back(SpatialSplitReference{reference.primitive, IsValidBBox(left) ? left : right});
+                }
+                else
+                {
+                    (reference.bounds.GetCenter()[spatial_axis] < spatial_position ? left_references : right_references).push_back(reference);
+                }
+                continue;
+            }
+            // Reference unsplitting: keep the whole reference on one side when that is cheaper than duplicating it.
+            BBox left_union = spatial_left, right_union = spatial_right;
+            left_union.Union(reference.bounds);
+            right_union.Union(reference.bounds);
+            const float duplicate_cost = spatial_left_count * left_area + spatial_right_count * right_area;
+            const float left_only_cost = spatial_left_count * left_union.SurfaceArea() + (spatial_right_count - 1) * right_area;
+            const float right_only_cost = (spatial_left_count - 1) * left_area + spatial_right_count * right_union.SurfaceArea();
+            if (left_only_cost < duplicate_cost && left_only_cost <= right_only_cost)
+            {
+                left_references.push_back(reference);
+            }
+            else if (right_only_cost < duplicate_cost)
+            {
+                right_references.push_back(reference);
+            }
+            else
+            {
+                left_references.push_back(SpatialSplitReference{reference.primitive, left});
+                right_references.push_back(SpatialSplitReference{reference.primitive, right});
+                ++builder.reference_count;
+            }
+        }
+    }
+    else if (!force_halving && object_axis >= 0)
+    {
+        for (const SpatialSplitReference &reference : references)
+        {
+            (object_bin_index(reference, object_axis) <= object_bin ? left_references : right_references).push_back(reference);
+        }
+    }
+    if (left_references.empty() || right_references.empty())
+    {
+        // No useful split plane or close to the depth cap, halve the references so that oversized leaves are avoided.
+        left_references.clear();
+        right_references.clear();
+        split_axis = centroid_bbox.GetLongestAxis();
+        std::nth_element(references.begin(), references.begin() + reference_count / 2, references.end(), [&](const SpatialSplitReference &a, const SpatialSplitReference &b)
+                         { return a.bounds.GetCenter()[split_axis] < b.bounds.GetCenter()[split_axis]; });
+        left_references.assign(references.begin(), references.begin() + reference_count / 2);
+        right_references.assign(references.begin() + reference_count / 2, references.end());
+    }
+    // The references of this node are not needed below, release them before going deeper.
+    std::vector<SpatialSplitReference>().swap(references);
+
+    SpatialSplitBuild(builder, left_references, depth + 1);
+    const int second_child = SpatialSplitBuild(builder, right_references, depth + 1);
+    builder.nodes[node_index].second_child_offset = second_child;
+    builder.nodes[node_index].n_primitives = 0;
+    builder.nodes[node_index].axis = static_cast<uint8_t>(split_axis);
+    return node_index;
+}
+
+// Builds a depth-first SBVH, leaf_order may list primitives several times.
+static void BuildSpatialSplits(const std::vector<rendertoy::BBox> &bboxes, const rendertoy::PrimitiveSplitter &splitter, const float budget,
+                               std::vector<rendertoy::LinearBVHNode> &nodes, std::vector<int> &leaf_order)
+{
+    std::vector<SpatialSplitReference> references(bboxes.size());
+    rendertoy::BBox root_bbox = bboxes[0];
+    for (size_t i = 0; i < bboxes.size(); ++i)
+    {
+        references[i] = SpatialSplitReference{static_cast<int>(i), bboxes[i]};
+        root_bbox.Union(bboxes[i]);
+    }
+    SpatialSplitBuilder builder{splitter, nodes, leaf_order, bboxes.size(),
+                                static_cast<size_t>(bboxes.size() * (1.0f + std::max(budget, 0.0f))),
+                                SBVH_OVERLAP_THRESHOLD * root_bbox.SurfaceArea()};
+    nodes.clear();
+    leaf_order.clear();
+    leaf_order.reserve(builder.reference_budget);
+    SpatialSplitBuild(builder, references, 0);
+    nodes.shrink_to_fit();
+    using namespace rendertoy;
+    INFO << "Spatial splits: " << leaf_order.size() << " references to " << bboxes.size() << " primitives, " << nodes.size() << " nodes." << std::endl;
+}
+
+#ifdef USE_EXT_BVH
+void rendertoy::IndexedBVH::Build(const std::vector<BBox> &bboxes, const std::vector<glm::vec3> &centers, std::vector<int> &leaf_order, const BVHConfig &bvh_config, const PrimitiveSplitter &splitter)
+{
+    _internal_bvh = Bvh();
+    _wide.clear();
+    _node_parent.clear();
+    _slot_leaf.clear();
+    leaf_order.clear();
+    if (bboxes.empty())
+    {
+        return;
+    }
+
+    if (bvh_config.spatial_splits)
+    {
+        std::vector<LinearBVHNode> linear;
+        BuildSpatialSplits(bboxes, splitter, bvh_config.spatial_split_budget, linear, leaf_order);
+        if (bvh_config.layout != BVHLayout::BINARY)
+        {
+            _wide.Collapse(linear, bvh_config.layout == BVHLayout::WIDE4_QUANTIZED);
+        }
+        else
+        {
+            FromLinear(linear);
+        }
+        return;
+    }
+
+    bvh::v2::ThreadPool thread_pool;
+    bvh::v2::ParallelExecutor executor(thread_pool);
+
+    std::vector<BVH_BBox> ext_bboxes(bboxes.size());
+    std::vector<Vec3> ext_centers(centers.size());
+    executor.for_each(0, bboxes.size(), [&](size_t begin, size_t end)
+                      {
+                        for (size_t i = begin; i < end; ++i) {
+                            ext_bboxes[i]  = BBoxConvert(bboxes[i]);
+                            ext_centers[i] = Vec3Convert(centers[i]);
+                        } });
+
+    typename bvh::v2::DefaultBuilder<Node>::Config config;
+    config.quality = bvh::v2::DefaultBuilder<Node>::Quality::High;
+    _internal_bvh = bvh::v2::DefaultBuilder<Node>::build(thread_pool, ext_bboxes, ext_centers, config);
+
+    // Leaves index prim_ids, which is the leaf order. The caller stores its primitives in that order, so the indirection is dropped.
+    leaf_order.assign(_internal_bvh.prim_ids.begin(), _internal_bvh.prim_ids.end());
+    _internal_bvh.prim_ids.clear();
+    _internal_bvh.prim_ids.shrink_to_fit();
+
+    if (bvh_config.layout != BVHLayout::BINARY)
+    {
+        std::vector<LinearBVHNode> linear;
+        linear.reserve(_internal_bvh.nodes.size());
+        Flatten(_internal_bvh.get_root(), linear);
+        _wide.Collapse(linear, bvh_config.layout == BVHLayout::WIDE4_QUANTIZED);
+        // The bvh::v2 nodes are not needed for traversal anymore.
+        _internal_bvh.nodes.clear();
+        _internal_bvh.nodes.shrink_to_fit();
+    }
+}
+
+void rendertoy::IndexedBVH::FromLinear(const std::vector<LinearBVHNode> &linear)
+{
+    // bvh::v2 stores the two children of an interior node next to each other, the root being node 0.
+    _internal_bvh.nodes.resize(linear.size());
+    std::vector<std::pair<int, size_t>> pending; // (linear index, bvh::v2 index)
+    pending.emplace_back(0, 0);
+    size_t next_node = 1;
+    while (!pending.empty())
+    {
+        const auto [linear_index, node_index] = pending.back();
+        pending.pop_back();
+        const LinearBVHNode &linear_node = linear[linear_index];
+        Node &node = _internal_bvh.nodes[node_index];
+        node.set_bbox(BBoxConvert(linear_node._bbox));
+        if (linear_node.n_primitives > 0)
+        {
+            // The leaf primitive count of bvh::v2 nodes is 4 bits wide.
+            assert(linear_node.n_primitives <= 15);
+            node.index = Node::Index::make_leaf(linear_node.primitive_offset, linear_node.n_primitives);
+            continue;
+        }
+        node.index = Node::Index::make_inner(next_node);
+        pending.emplace_back(linear_index + 1, next_node);
+        pending.emplace_back(linear_node.second_child_offset, next_node + 1);
+        next_node += 2;
+    }
+}
+
+const int rendertoy::IndexedBVH::Flatten(const Node &node, std::vector<LinearBVHNode> &linear) const
+{
+    const int linear_index = static_cast<int>(linear.size());
+    linear.emplace_back();
+    auto bbox = node.get_bbox();
+    linear[linear_index]._bbox = BBox(glm::vec3(bbox.min[0], bbox.min[1], bbox.min[2]), glm::vec3(bbox.max[0], bbox.max[1], bbox.max[2]));
+    if (node.is_leaf())
+    {
+        linear[linear_index].primitive_offset = static_cast<int>(node.index.first_id());
+        linear[linear_index].n_primitives = static_cast<uint16_t>(node.index.prim_count());
+        return linear_index;
+    }
+    Flatten(_internal_bvh.nodes[node.index.first_id()], linear);
+    const int second_child = Flatten(_internal_bvh.nodes[node.index.first_id() + 1], linear);
+    linear[linear_index].second_child_offset = second_child;
+    linear[linear_index].n_primitives = 0;
+    return linear_index;
+}
+#else
+constexpr int PARALLEL_BUILD_THRESHOLD = 4096;      // Subtrees with fewer primitives are built serially by the task that reached them.
+constexpr int PARALLEL_BINNING_THRESHOLD = 1 << 16; // Ranges with more primitives are reduced and binned in parallel.
+#ifdef USE_SAH
+constexpr int SAH_BUCKETS = 24;
+#endif // USE_SAH
+
+/// @brief Node of the intermediate tree of the parallel builder.
+/// @note Tasks allocate children pairs from a shared counter, so the tree is only put in depth-first order afterwards.
+struct BinnedBuildNode
+{
+    rendertoy::BBox bbox;
+    int children = -1; // First of the two consecutive children, -1 for leaves.
+    int primitive_offset = 0;
+    int primitive_count = 0;
+    int subtree_size = 1; // Number of nodes in the subtree, locates the second child in depth-first order.
+    uint8_t axis = 0;
+};
+
+struct BinnedBuildContext
+{
+    const std::vector<rendertoy::BBox> &bboxes;
+    const std::vector<glm::vec3> &centers;
+    std::vector<int> &order;
+    std::vector<BinnedBuildNode> &nodes;
+    std::atomic<int> node_count;
+};
+
+struct BinnedRangeBounds
+{
+    rendertoy::BBox bounds;
+    rendertoy::BBox centroid_bounds;
+    bool valid = false;
+
+    void Add(const rendertoy::BBox &bbox, const glm::vec3 &center)
+    {
+        if (!valid)
+        {
+            bounds = bbox;
+            centroid_bounds = rendertoy::BBox(center, center);
+            valid = true;
+            return;
+        }
+        bounds.Union(bbox);
+        centroid_bounds.Union(center);
+    }
+    void Merge(const BinnedRangeBounds &other)
+    {
+        if (!other.valid)
+        {
+            return;
+        }
+        if (!valid)
+        {
+            *this = other;
+            return;
+        }
+        bounds.Union(other.bounds);
+        centroid_bounds.Union(other.centroid_bounds);
+    }
+};
+
+static const BinnedRangeBounds ComputeRangeBounds(const BinnedBuildContext &context, const int begin, const int end)
+{
+    auto accumulate = [&](const int first, const int last, BinnedRangeBounds range_bounds)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            const int prim = context.order[i];
+            range_bounds.Add(context.bboxes[prim], context.centers[prim]);
+        }
+        return range_bounds;
+    };
+    if (end - begin <= PARALLEL_BINNING_THRESHOLD)
+    {
+        return accumulate(begin, end, BinnedRangeBounds());
+    }
+    return tbb::parallel_reduce(
+        tbb::blocked_range<int>(begin, end), BinnedRangeBounds(),
+        [&](const tbb::blocked_range<int> &r, const BinnedRangeBounds &init)
+        { return accumulate(r.begin(), r.end(), init); },
+        [](BinnedRangeBounds lhs, const BinnedRangeBounds &rhs)
+        {
+            lhs.Merge(rhs);
+            return lhs;
+        });
+}
+
+#ifdef USE_SAH
+struct BinnedBuckets
+{
+    rendertoy::BVHSplitBucket buckets[SAH_BUCKETS];
+
+    void Add(const int b, const rendertoy::BBox &bbox)
+    {
+        // Empty buckets are never unioned, a default BBox is not a valid empty box for negative coordinates.
+        if (buckets[b].count++ == 0)
+        {
+            buckets[b].bounds = bbox;
+        }
+        else
+        {
+            buckets[b].bounds.Union(bbox);
+        }
+    }
+    void Merge(const BinnedBuckets &other)
+    {
+        for (int b = 0; b < SAH_BUCKETS; ++b)
+        {
+            if (other.buckets[b].count == 0)
+            {
+                continue;
+            }
+            if (buckets[b].count == 0)
+            {
+                buckets[b].bounds = other.buckets[b].bounds;
+            }
+            else
+            {
+                buckets[b].bounds.Union(other.buckets[b].bounds);
+            }
+            buckets[b].count += other.buckets[b].count;
+        }
+    }
+};
+
+static const int GetBucketIndex(const rendertoy::BBox &centroid_bbox, const glm::vec3 &center, const int dim)
+{
+    const int b = static_cast<int>(SAH_BUCKETS * centroid_bbox.Offset(center)[dim]);
+    return std::clamp(b, 0, SAH_BUCKETS - 1);
+}
+
+static const BinnedBuckets BinPrimitives(const BinnedBuildContext &context, const int begin, const int end, const rendertoy::BBox &centroid_bbox, const int dim)
+{
+    auto accumulate = [&](const int first, const int last, BinnedBuckets buckets)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            const int prim = context.order[i];
+            buckets.Add(GetBucketIndex(centroid_bbox, context.centers[prim], dim), context.bboxes[prim]);
+        }
+        return buckets;
+    };
+    if (end - begin <= PARALLEL_BINNING_THRESHOLD)
+    {
+        return accumulate(begin, end, BinnedBuckets());
+    }
+    return tbb::parallel_reduce(
+        tbb::blocked_range<int>(begin, end), BinnedBuckets(),
+        [&](const tbb::blocked_range<int> &r, const BinnedBuckets &init)
+        { return accumulate(r.begin(), r.end(), init); },
+        [](BinnedBuckets lhs, const BinnedBuckets &rhs)
+        {
+            lhs.Merge(rhs);
+            return lhs;
+        });
+}
+#endif // USE_SAH
+
+static void BinnedBuild(BinnedBuildContext &context, const int node_index, const int begin, const int end, const int depth)
+{
+    BinnedBuildNode &node = context.nodes[node_index];
+    const int primitive_count = end - begin;
+    const BinnedRangeBounds range_bounds = ComputeRangeBounds(context, begin, end);
+    node.bbox = range_bounds.bounds;
+
+    auto make_leaf = [&]()
+    {
+        node.primitive_offset = begin;
+        node.primitive_count = primitive_count;
+    };
+    if (primitive_count == 1 || depth >= rendertoy::MAX_TRAVERSE_DEPTH - 1)
+    {
+        make_leaf();
+        return;
+    }
+
+    const rendertoy::BBox &centroid_bbox = range_bounds.centroid_bounds;
+    const int dim = centroid_bbox.GetLongestAxis();
+    auto order_begin = context.order.begin();
+    int mid = begin + primitive_count / 2;
+    auto median_split = [&]()
+    {
+        std::nth_element(order_begin + begin, order_begin + mid, order_begin + end, [&](const int a, const int b) -> bool
+                         { return context.centers[a][dim] < context.centers[b][dim]; });
+    };
+#ifdef USE_SAH
+    // Close to the depth cap only median halving is used, so the range fits into a leaf when the cap is reached.
+    if (depth + MedianHalvingLevels(primitive_count, rendertoy::MAX_LEAF_PRIMITIVES) >= rendertoy::MAX_TRAVERSE_DEPTH - 1)
+    {
+        median_split();
+    }
+    else if (centroid_bbox._pmax[dim] == centroid_bbox._pmin[dim])
+    {
+        if (primitive_count <= rendertoy::MAX_LEAF_PRIMITIVES)
+        {
+            make_leaf();
+            return;
+        }
+    }
+    else if (primitive_count > 2)
+    {
+        const BinnedBuckets binned = BinPrimitives(context, begin, end, centroid_bbox, dim);
+        const rendertoy::BVHSplitBucket *buckets = binned.buckets;
+
+        // costs[i] is the SAH cost of splitting after bucket i. Empty sides contribute nothing.
+        constexpr int N_SPLITS = SAH_BUCKETS - 1;
+        float costs[N_SPLITS] = {};
+        int count_below = 0;
+        rendertoy::BBox bound_below;
+        for (int i = 0; i < N_SPLITS; ++i)
+        {
+            if (buckets[i].count > 0)
+            {
+                if (count_below == 0)
+                {
+                    bound_below = buckets[i].bounds;
+                }
+                else
+                {
+                    bound_below.Union(buckets[i].bounds);
+                }
+                count_below += buckets[i].count;
+            }
+            costs[i] += count_below > 0 ? count_below * bound_below.SurfaceArea() : 0.0f;
+        }
+        int count_above = 0;
+        rendertoy::BBox bound_above;
+        for (int i = N_SPLITS; i >= 1; --i)
+        {
+            if (buckets[i].count > 0)
+            {
+                if (count_above == 0)
+                {
+                    bound_above = buckets[i].bounds;
+                }
+                else
+                {
+                    bound_above.Union(buckets[i].bounds);
+                }
+                count_above += buckets[i].count;
+            }
+            costs[i - 1] += count_above > 0 ? count_above * bound_above.SurfaceArea() : 0.0f;
+        }
+
+        int min_cost_split_bucket = 0;
+        float min_cost = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < N_SPLITS; ++i)
+        {
+            if (costs[i] < min_cost)
+            {
+                min_cost = costs[i];
+                min_cost_split_bucket = i;
+            }
+        }
+        const float leaf_cost = static_cast<float>(primitive_count);
+        min_cost = 1.0f / 2.0f + min_cost / node.bbox.SurfaceArea();
+        if (primitive_count <= 16 && min_cost >= leaf_cost)
+        {
+            make_leaf();
+            return;
+        }
+        mid = static_cast<int>(std::partition(order_begin + begin, order_begin + end, [&](const int prim)
+                                              { return GetBucketIndex(centroid_bbox, context.centers[prim], dim) <= min_cost_split_bucket; }) -
+                               order_begin);
+        if (mid == begin || mid == end)
+        {
+            mid = begin + primitive_count / 2;
+            median_split();
+        }
+    }
+#else
+    median_split();
+#endif // USE_SAH
+
+    const int children = context.node_count.fetch_add(2);
+    node.children = children;
+    node.axis = static_cast<uint8_t>(dim);
+    auto build_left = [&]()
+    { BinnedBuild(context, children, begin, mid, depth + 1); };
+    auto build_right = [&]()
+    { BinnedBuild(context, children + 1, mid, end, depth + 1); };
+    if (primitive_count > PARALLEL_BUILD_THRESHOLD)
+    {
+        tbb::parallel_invoke(build_left, build_right);
+    }
+    else
+    {
+        build_left();
+        build_right();
+    }
+    node.subtree_size = 1 + context.nodes[children].subtree_size + context.nodes[children + 1].subtree_size;
+}
+
+static void FlattenBinnedNode(const std::vector<BinnedBuildNode> &build_nodes, const int build_index, std::vector<rendertoy::LinearBVHNode> &linear, const int linear_index)
+{
+    const BinnedBuildNode &node = build_nodes[build_index];
+    rendertoy::LinearBVHNode &linear_node = linear[linear_index];
+    linear_node._bbox = node.bbox;
+    if (node.children < 0)
+    {
+        linear_node.primitive_offset = node.primitive_offset;
+        linear_node.n_primitives = static_cast<uint16_t>(node.primitive_count);
+        return;
+    }
+    // The left child follows its parent, the right one follows the whole left subtree.
+    const int second_child = linear_index + 1 + build_nodes[node.children].subtree_size;
+    linear_node.second_child_offset = second_child;
+    linear_node.n_primitives = 0;
+    linear_node.axis = node.axis;
+    auto flatten_left = [&]()
+    { FlattenBinnedNode(build_nodes, node.children, linear, linear_index + 1); };
+    auto flatten_right = [&]()
+    { FlattenBinnedNode(build_nodes, node.children + 1, linear, second_child); };
+    if (node.subtree_size > PARALLEL_BUILD_THRESHOLD)
+    {
+        tbb::parallel_invoke(flatten_left, flatten_right);
+    }
+    else
+    {
+        flatten_left();
+        flatten_right();
+    }
+}
+
+void rendertoy::IndexedBVH::Build(const std::vector<BBox> &bboxes, const std::vector<glm::vec3> &centers, std::vector<int> &leaf_order, const BVHConfig &bvh_config, const PrimitiveSplitter &splitter)
+{
+    _node_tree.clear();
+    _wide.clear();
+    _node_parent.clear();
+    _slot_leaf.clear();
+    leaf_order.clear();
+    if (bboxes.empty())
+    {
+        return;
+    }
+    if (bvh_config.spatial_splits)
+    {
+        BuildSpatialSplits(bboxes, splitter, bvh_config.spatial_split_budget, _node_tree, leaf_order);
+    }
+    else
+    {
+        const int primitive_count = static_cast<int>(bboxes.size());
+        _build_order.resize(primitive_count);
+        std::iota(_build_order.begin(), _build_order.end(), 0);
+
+        // A binary tree over n primitives has at most 2n - 1 nodes, so tasks never reallocate the node array.
+        std::vector<BinnedBuildNode> build_nodes(2 * static_cast<size_t>(primitive_count) - 1);
+        BinnedBuildContext context{bboxes, centers, _build_order, build_nodes, 1};
+        BinnedBuild(context, 0, 0, primitive_count, 0);
+
+        _node_tree.resize(build_nodes[0].subtree_size);
+        FlattenBinnedNode(build_nodes, 0, _node_tree, 0);
+        leaf_order.swap(_build_order);
+        _build_order.clear();
+    }
+    if (bvh_config.layout != BVHLayout::BINARY)
+    {
+        _wide.Collapse(_node_tree, bvh_config.layout == BVHLayout::WIDE4_QUANTIZED);
+        // The binary nodes are not needed for traversal anymore.
+        _node_tree.clear();
+        _node_tree.shrink_to_fit();
+    }
+}
+#endif // USE_EXT_BVH
+
+const std::vector<std::pair<int, int>> rendertoy::IndexedBVH::LeafRanges() const
+{
+    std::vector<std::pair<int, int>> leaf_ranges;
+    if (!_wide.empty())
+    {
+        _wide.CollectLeafRanges(leaf_ranges);
+        return leaf_ranges;
+    }
+#ifdef USE_EXT_BVH
+    for (const Node &node : _internal_bvh.nodes)
+    {
+        if (node.is_leaf())
+        {
+            const int first = static_cast<int>(node.index.first_id());
+            leaf_ranges.emplace_back(first, first + static_cast<int>(node.index.prim_count()));
+        }
+    }
+#else
+    for (const LinearBVHNode &node : _node_tree)
+    {
+        if (node.n_primitives > 0)
+        {
+            leaf_ranges.emplace_back(node.primitive_offset, node.primitive_offset + node.n_primitives);
+        }
+    }
+#endif // USE_EXT_BVH
+    return leaf_ranges;
+}
+
+const int rendertoy::IndexedBVH::BinaryNodeCount() const
+{
+#ifdef USE_EXT_BVH
+    return static_cast<int>(_internal_bvh.nodes.size());
+#else
+    return static_cast<int>(_node_tree.size());
+#endif // USE_EXT_BVH
+}
+
+void rendertoy::IndexedBVH::SetBinaryNodeBBox(const int index, const BBox &bbox)
+{
+#ifdef USE_EXT_BVH
+    _internal_bvh.nodes[index].set_bbox(BBoxConvert(bbox));
+#else
+    _node_tree[index]._bbox = bbox;
+#endif // USE_EXT_BVH
+}
+
+const bool rendertoy::IndexedBVH::Refit(const std::vector<int> &dirty_slots, const std::function<const BBox(const int)> &slot_bbox)
+{
+    if (!_wide.empty())
+    {
+        return false;
+    }
+    const int node_count = BinaryNodeCount();
+    if (node_count == 0 || dirty_slots.empty())
+    {
+        return true;
+    }
+    if (static_cast<int>(_node_parent.size()) != node_count)
+    {
+        _node_parent.assign(node_count, -1);
+        _slot_leaf.clear();
+        for (int i = 0; i < node_count; ++i)
+        {
+            const BinaryNode node = GetBinaryNode(i);
+            if (node.count > 0)
+            {
+                _slot_leaf.resize(std::max(_slot_leaf.size(), static_cast<size_t>(node.first + node.count)), -1);
+                std::fill(_slot_leaf.begin() + node.first, _slot_leaf.begin() + node.first + node.count, i);
+            }
+            else
+            {
+                _node_parent[node.first] = i;
+                _node_parent[node.second] = i;
+            }
+        }
+    }
+
+    std::vector<int> leaves;
+    leaves.reserve(dirty_slots.size());
+    for (const int slot : dirty_slots)
+    {
+        leaves.push_back(_slot_leaf[slot]);
+    }
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+    for (const int leaf : leaves)
+    {
+        const BinaryNode node = GetBinaryNode(leaf);
+        BBox bbox = slot_bbox(node.first);
+        for (int slot = node.first + 1; slot < node.first + node.count; ++slot)
+        {
+            bbox.Union(slot_bbox(slot));
+        }
+        SetBinaryNodeBBox(leaf, bbox);
+        // 逐层向上合并子节点, 父节点不变时更上层也不变.
+        for (int parent = _node_parent[leaf]; parent != -1; parent = _node_parent[parent])
+        {
+            const BinaryNode parent_node = GetBinaryNode(parent);
+            BBox merged = GetBinaryNode(parent_node.first)._bbox;
+            merged.Union(GetBinaryNode(parent_node.second)._bbox);
+            if (merged._pmin == parent_node._bbox._pmin && merged._pmax == parent_node._bbox._pmax)
+            {
+                break;
+            }
+            SetBinaryNodeBBox(parent, merged);
+        }
+    }
+    return true;
+}
+
+const size_t rendertoy::IndexedBVH::NodeBytes() const
+{
+#ifdef USE_EXT_BVH
+    const size_t binary_bytes = _internal_bvh.nodes.size() * sizeof(Node);
+#else
+    const size_t binary_bytes = _node_tree.size() * sizeof(LinearBVHNode);
+#endif // USE_EXT_BVH
+    return binary_bytes + _wide.node_bytes();
+}
+
+void rendertoy::IndexedBVH::SaveCache(BVHCacheWriter &writer) const
+{
+#ifdef USE_EXT_BVH
+    writer.WriteArray(_internal_bvh.nodes);
+#else
+    writer.WriteArray(_node_tree);
+#endif // USE_EXT_BVH
+    _wide.SaveCache(writer);
+}
+
+const bool rendertoy::IndexedBVH::LoadCache(BVHCacheReader &reader)
+{
+    _node_parent.clear();
+    _slot_leaf.clear();
+#ifdef USE_EXT_BVH
+    _internal_bvh = Bvh();
+    if (!reader.ReadArray(_internal_bvh.nodes))
+    {
+        return false;
+    }
+#else
+    if (!reader.ReadArray(_node_tree))
+    {
+        return false;
+    }
+#endif // USE_EXT_BVH
+    return _wide.LoadCache(reader);
+}
+
+void rendertoy::IndexedMotionBVH::Build(const std::vector<float> &segment_times, const std::vector<std::vector<BBox>> &bounds, std::vector<int> &leaf_order)
+{
+    _nodes.clear();
+    _node_bounds.clear();
+    _segment_times = segment_times;
+    const int segment_count = static_cast<int>(bounds.size());
+    const int primitive_count = segment_count > 0 ? static_cast<int>(bounds[0].size() / 2) : 0;
+    if (primitive_count == 0)
+    {
+        leaf_order.clear();
+        return;
+    }
+
+    // The topology is shared by all segments, it is partitioned on the centroids of the whole motion.
+    std::vector<glm::vec3> centers(primitive_count);
+    for (int i = 0; i < primitive_count; ++i)
+    {
+        BBox motion_bbox = bounds[0][i * 2];
+        for (int segment = 0; segment < segment_count; ++segment)
+        {
+            motion_bbox.Union(bounds[segment][i * 2]);
+            motion_bbox.Union(bounds[segment][i * 2 + 1]);
+        }
+        centers[i] = motion_bbox.GetCenter();
+    }
+    _build_order.resize(primitive_count);
+    std::iota(_build_order.begin(), _build_order.end(), 0);
+    RecursiveConstruct(_build_order.begin(), _build_order.end(), 0, centers);
+
+    // Children are always stored after their parent, so a backwards sweep refits every node from its children.
+    const int node_count = static_cast<int>(_nodes.size());
+    _node_bounds.resize(static_cast<size_t>(segment_count) * node_count * 2);
+    for (int segment = 0; segment < segment_count; ++segment)
+    {
+        BBox *segment_bounds = &_node_bounds[static_cast<size_t>(segment) * node_count * 2];
+        for (int node_index = node_count - 1; node_index >= 0; --node_index)
+        {
+            const MotionBVHNode &node = _nodes[node_index];
+            for (int end = 0; end < 2; ++end)
+            {
+                BBox &node_bbox = segment_bounds[node_index * 2 + end];
+                if (node.n_primitives > 0)
+                {
+                    node_bbox = bounds[segment][_build_order[node.offset] * 2 + end];
+                    for (int i = node.offset + 1; i < node.offset + node.n_primitives; ++i)
+                    {
+                        node_bbox.Union(bounds[segment][_build_order[i] * 2 + end]);
+                    }
+                }
+                else
+                {
+                    node_bbox = segment_bounds[(node_index + 1) * 2 + end];
+                    node_bbox.Union(segment_bounds[node.offset * 2 + end]);
+                }
+            }
+        }
+    }
+
+    leaf_order.swap(_build_order);
+    _build_order.clear();
+    _build_order.shrink_to_fit();
+}
+
+const int rendertoy::IndexedMotionBVH::RecursiveConstruct(std::vector<int>::iterator begin, std::vector<int>::iterator end, const int depth, const std::vector<glm::vec3> &centers)
+{
+    const int node_index = static_cast<int>(_nodes.size());
+    _nodes.emplace_back();
+    const int count = static_cast<int>(end - begin);
+    // The depth limit keeps the traversal stack from overflowing on degenerate inputs.
+    if (count <= MOTION_BVH_LEAF_PRIMITIVES || depth >= MAX_TRAVERSE_DEPTH - 1)
+    {
+        _nodes[node_index].offset = static_cast<int>(begin - _build_order.begin());
+        _nodes[node_index].n_primitives = static_cast<uint16_t>(count);
+        return node_index;
+    }
+
+    BBox centroid_bbox(centers[*begin], centers[*begin]);
+    for (auto it = begin + 1; it != end; ++it)
+    {
+        centroid_bbox.Union(centers[*it]);
+    }
+    const int axis = centroid_bbox.GetLongestAxis();
+    auto mid = begin + count / 2;
+    std::nth_element(begin, mid, end, [&](const int a, const int b)
+                     { return centers[a][axis] < centers[b][axis]; });
+
+    _nodes[node_index].axis = static_cast<uint8_t>(axis);
+    RecursiveConstruct(begin, mid, depth + 1, centers);
+    const int second_child = RecursiveConstruct(mid, end, depth + 1, centers);
+    _nodes[node_index].offset = second_child;
+    return node_index;
+}
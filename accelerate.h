@@ -4,12 +4,17 @@
 #include <memory>
 #include <type_traits>
 #include <algorithm>
-#include <stack>
 #include <limits>
+#include <cstdint>
+#include <utility>
+#include <functional>
+#include <bit>
+#include <unordered_map>
 
 #include "rendertoy_internal.h"
 #include "intersectinfo.h"
 #include "logger.h"
+#include "bvhcache.h"
 
 #ifdef USE_EXT_BVH
 #include <bvh/v2/bvh.h>
@@ -34,7 +39,25 @@ namespace rendertoy
     public:
         BBox(glm::vec3 pmin, glm::vec3 pmax) : _pmin(pmin), _pmax(pmax) {}
         BBox() : BBox(glm::vec3{std::numeric_limits<float>::max()}, glm::vec3{std::numeric_limits<float>::min()}) {}
-        const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, float &t, float *tmax = nullptr) const;
+        const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, float &t, float *t_exit = nullptr) const;
+        /// @brief Whether the ray enters the box within [0, t_max], t receives the entry distance clamped to 0.
+        /// @note Near and far planes are picked by the sign of the direction, as the 4-wide layout does. A ray running within a slab plane
+        /// gives NaN for that plane only, which is skipped, and inverted boxes are always missed.
+        const bool IntersectSegment(const glm::vec3 &origin, const glm::vec3 &inv_direction, const float t_max, float &t) const
+        {
+            float enter = 0.0f, exit = t_max;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const bool negative = inv_direction[axis] < 0.0f;
+                const float t_near = ((negative ? _pmax[axis] : _pmin[axis]) - origin[axis]) * inv_direction[axis];
+                const float t_far = ((negative ? _pmin[axis] : _pmax[axis]) - origin[axis]) * inv_direction[axis];
+                // std::max / std::min return their first argument when the comparison involves NaN.
+                enter = std::max(enter, t_near);
+                exit = std::min(exit, t_far);
+            }
+            t = enter;
+            return enter <= exit;
+        }
         const glm::vec3 GetCenter() const;
         void Union(const BBox &a);
         void Union(const glm::vec3 &p);
@@ -60,16 +83,24 @@ namespace rendertoy
 
 #define USE_SAH
 
-    struct BVHNode
+    /// @brief Depth-first linearized BVH node.
+    /// @note The left child of an interior node is always stored right after it, so only the second child is referenced.
+    struct alignas(32) LinearBVHNode
     {
         BBox _bbox;
-        int left = -1;
-        int right = -1;
-#ifdef USE_SAH
-        int first_primitive_offset = -1;
-        int last_primitive_offset = -1;
-#endif // USE_SAH
+        union
+        {
+            int primitive_offset;    // Leaf node
+            int second_child_offset; // Interior node
+        };
+        uint16_t n_primitives = 0; // 0 for interior nodes.
+        uint8_t axis = 0;
     };
+    static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode is expected to fit into half a cache line.");
+
+    constexpr int MAX_TRAVERSE_DEPTH = 64;
+    constexpr int MAX_LEAF_PRIMITIVES = std::numeric_limits<uint16_t>::max();
+    constexpr size_t CACHE_LINE_SIZE = 64;
 
 #ifdef USE_SAH
     struct BVHSplitBucket
@@ -79,11 +110,217 @@ namespace rendertoy
     };
 #endif // USE_SAH
 
-#ifdef USE_EXT_BVH
+    enum class BVHLayout
+    {
+        BINARY = 0,
+        WIDE4,
+        WIDE4_QUANTIZED,
+    };
 
-    template <typename AccelerableObject, std::enable_if_t<has_bounding_box<AccelerableObject>::value, bool> _ = true>
-    class BVH
+    struct BVHConfig
+    {
+        /// @brief Node layout used for traversal. WIDE4 collapses the binary tree into 4-wide nodes after building,
+        /// WIDE4_QUANTIZED additionally stores child bounds as 8-bit offsets, halving node memory for a few more instructions per node.
+        BVHLayout layout = BVHLayout::BINARY;
+        /// @brief Also renumber mesh vertices in order of first use by the leaf-ordered faces.
+        bool reorder_vertices = true;
+        /// @brief Build with spatial splits (SBVH). References to primitives straddling a split plane are duplicated into both children,
+        /// which cuts the node overlap caused by long, thin triangles. Leaf order may then list a primitive more than once.
+        bool spatial_splits = false;
+        /// @brief Extra references spatial splits may create, relative to the primitive count.
+        float spatial_split_budget = 0.5f;
+        /// @brief Let ImportMeshFromFile reuse meshes built by an earlier run from a cache file next to the source, see bvhcache.h.
+        /// @note Settings that change the built data have to be hashed in ComputeBVHCacheKey.
+        bool use_disk_cache = true;
+    };
+
+    /// @brief Bounds of the parts of a primitive on both sides of the plane p[axis] = position, within the given reference bounds.
+    /// @note Sides the primitive does not reach are returned with _pmin > _pmax.
+    using PrimitiveSplitter = std::function<void(const int primitive, const int axis, const float position, const BBox &bounds, BBox &left, BBox &right)>;
+
+    /// @brief Work done by traversals, for comparing BVH builds.
+    struct TraversalStats
+    {
+        size_t node_visits = 0; // Interior nodes whose children have been tested.
+        size_t primitive_tests = 0;
+    };
+
+    constexpr int MAX_RAY_PACKET_SIZE = 16;
+    /// @brief Packet size used by the render works for camera rays.
+    constexpr int RAY_PACKET_SIZE = 8;
+    /// @brief Subtrees reached by this many rays of a packet or fewer are traversed ray by ray.
+    constexpr int RAY_PACKET_DIVERGENCE_THRESHOLD = 2;
+
+    /// @brief Rays traced together, ray i being lane i of the lane masks used by packet traversals.
+    struct RayPacket
+    {
+        int size = 0;
+        glm::vec3 origins[MAX_RAY_PACKET_SIZE];
+        glm::vec3 directions[MAX_RAY_PACKET_SIZE];
+        float times[MAX_RAY_PACKET_SIZE] = {};
+
+        const uint32_t mask() const
+        {
+            return size >= 32 ? ~0u : (1u << size) - 1u;
+        }
+    };
+
+    constexpr int WIDE_BVH_WIDTH = 4;
+
+    /// @brief 4-wide BVH node, child bounds are stored in SoA form so that all children are slab-tested at once.
+    struct alignas(64) WideBVHNode
+    {
+        float bounds_min[3][WIDE_BVH_WIDTH];
+        float bounds_max[3][WIDE_BVH_WIDTH];
+        int offset[WIDE_BVH_WIDTH];        // Node index for interior children, primitive offset for leaf children, -1 for empty slots.
+        uint16_t count[WIDE_BVH_WIDTH];    // 0 for interior children.
+    };
+
+    /// @brief WideBVHNode with child bounds quantized to a grid over the parent bounds, 64 bytes instead of 128.
+    /// @note Child bounds dequantize to origin + q * 2^exponent, rounded outwards when building so that they always contain the exact bounds.
+    struct alignas(64) QuantizedWideBVHNode
+    {
+        float origin[3];
+        int8_t exponent[3];
+        uint8_t child_mask; // Bit i is set if slot i is used.
+        uint8_t bounds_min[3][WIDE_BVH_WIDTH];
+        uint8_t bounds_max[3][WIDE_BVH_WIDTH];
+        int offset[WIDE_BVH_WIDTH];
+        uint16_t count[WIDE_BVH_WIDTH];
+    };
+    static_assert(sizeof(QuantizedWideBVHNode) == 64, "QuantizedWideBVHNode is expected to fit into a cache line.");
+
+    /// @brief Collapsed 4-wide BVH, built from a depth-first LinearBVHNode tree.
+    class WideBVH
+    {
+    private:
+        std::vector<WideBVHNode> _nodes;
+        std::vector<QuantizedWideBVHNode> _quantized_nodes; // Replaces _nodes when collapsed with quantization.
+
+        const int CollapseNode(const std::vector<LinearBVHNode> &binary, const int binary_index);
+        void Quantize();
+        /// @brief Slab test of the four children against the ray segment [0, t_max], dist receives the entry distances.
+        static const int IntersectBounds(const float (&bounds_min)[3][WIDE_BVH_WIDTH], const float (&bounds_max)[3][WIDE_BVH_WIDTH], const glm::vec3 &origin, const glm::vec3 &inv_direction, const float t_max, float *dist);
+        static const int IntersectChildren(const WideBVHNode &node, const glm::vec3 &origin, const glm::vec3 &inv_direction, const float t_max, float *dist)
+        {
+            return IntersectBounds(node.bounds_min, node.bounds_max, origin, inv_direction, t_max, dist);
+        }
+        static const int IntersectChildren(const QuantizedWideBVHNode &node, const glm::vec3 &origin, const glm::vec3 &inv_direction, const float t_max, float *dist);
+
+        template <bool COUNT_STATS, typename NodeType, typename LeafFn>
+        static void TraverseNodes(const std::vector<NodeType> &nodes, const glm::vec3 &origin, const glm::vec3 &direction, const float &t_max, LeafFn &leaf_fn, TraversalStats *stats)
+        {
+            struct StackEntry
+            {
+                int offset;
+                int count;
+                float dist;
+            };
+            StackEntry traverse_stack[(WIDE_BVH_WIDTH - 1) * MAX_TRAVERSE_DEPTH];
+            int stack_size = 0;
+            traverse_stack[stack_size++] = StackEntry{0, 0, 0.0f};
+            const glm::vec3 inv_direction = 1.0f / direction;
+            while (stack_size > 0)
+            {
+                const StackEntry entry = traverse_stack[--stack_size];
+                // Entries pushed before a closer hit was found may lie entirely behind it now.
+                if (entry.dist > t_max)
+                {
+                    continue;
+                }
+                if (entry.count > 0)
+                {
+                    if (leaf_fn(entry.offset, entry.offset + entry.count))
+                    {
+                        return;
+                    }
+                    continue;
+                }
+                const NodeType &node = nodes[entry.offset];
+                if constexpr (COUNT_STATS)
+                {
+                    ++stats->node_visits;
+                }
+                float dist[WIDE_BVH_WIDTH];
+                const int hit_mask = IntersectChildren(node, origin, inv_direction, t_max, dist);
+                if (hit_mask == 0)
+                {
+                    continue;
+                }
+
+                // Sort hit children far to near, so that the nearest one ends up on the top of the stack.
+                int order[WIDE_BVH_WIDTH];
+                int n_hit = 0;
+                for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+                {
+                    if (hit_mask & (1 << i))
+                    {
+                        int j = n_hit++;
+                        while (j > 0 && dist[order[j - 1]] < dist[i])
+                        {
+                            order[j] = order[j - 1];
+                            --j;
+                        }
+                        order[j] = i;
+                    }
+                }
+                for (int i = 0; i < n_hit; ++i)
+                {
+                    traverse_stack[stack_size++] = StackEntry{node.offset[order[i]], node.count[order[i]], dist[order[i]]};
+                }
+            }
+        }
+
+    public:
+        /// @brief Build from a binary tree, with quantized child bounds if quantize is set.
+        void Collapse(const std::vector<LinearBVHNode> &binary, const bool quantize = false);
+        void CollectLeafRanges(std::vector<std::pair<int, int>> &leaf_ranges) const;
+        void SaveCache(BVHCacheWriter &writer) const
+        {
+            writer.WriteArray(_nodes);
+            writer.WriteArray(_quantized_nodes);
+        }
+        const bool LoadCache(BVHCacheReader &reader)
+        {
+            return reader.ReadArray(_nodes) && reader.ReadArray(_quantized_nodes);
+        }
+        const bool empty() const
+        {
+            return _nodes.empty() && _quantized_nodes.empty();
+        }
+        void clear()
+        {
+            _nodes.clear();
+            _quantized_nodes.clear();
+        }
+        const size_t node_bytes() const
+        {
+            return _nodes.size() * sizeof(WideBVHNode) + _quantized_nodes.size() * sizeof(QuantizedWideBVHNode);
+        }
+
+        /// @brief Traverse the wide BVH front to back.
+        /// @param t_max Nodes entered beyond it are skipped. It is read again at every node, so leaf_fn may lower it as it finds hits.
+        /// @param leaf_fn Called as leaf_fn(first, last) for every leaf primitive range [first, last) whose bounds are hit, returning true stops the traversal.
+        template <bool COUNT_STATS = false, typename LeafFn>
+        void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &t_max, LeafFn &&leaf_fn, TraversalStats *stats = nullptr) const
+        {
+            if (!_quantized_nodes.empty())
+            {
+                TraverseNodes<COUNT_STATS>(_quantized_nodes, origin, direction, t_max, leaf_fn, stats);
+            }
+            else if (!_nodes.empty())
+            {
+                TraverseNodes<COUNT_STATS>(_nodes, origin, direction, t_max, leaf_fn, stats);
+            }
+        }
+    };
+
+    /// @brief BVH over primitive indices.
+    /// @note The builder only sees precomputed bounds and centroids, primitives are tested through a callback during traversal,
+    /// so that callers are free to store their primitives in whatever layout suits them.
+    class IndexedBVH
     {
+#ifdef USE_EXT_BVH
         using Scalar = float;
         using BVH_BBox = bvh::v2::BBox<Scalar, 3>;
         using Node = bvh::v2::Node<Scalar, 3>;
@@ -102,326 +339,958 @@ namespace rendertoy
         }
 
     private:
+        Bvh _internal_bvh;
+
+        /// @brief Convert the bvh::v2 tree into depth-first LinearBVHNodes.
+        const int Flatten(const Node &node, std::vector<LinearBVHNode> &linear) const;
+        /// @brief Rebuild the bvh::v2 tree from depth-first LinearBVHNodes, for trees built by our own builders.
+        void FromLinear(const std::vector<LinearBVHNode> &linear);
+#else
+    private:
+        std::vector<LinearBVHNode> _node_tree;
+        std::vector<int> _build_order; // Scratch permutation partitioned by the builder, handed out as the leaf order.
+#endif // USE_EXT_BVH
+        WideBVH _wide;
+        // Set up by the first Refit after a build.
+        std::vector<int> _node_parent;
+        std::vector<int> _slot_leaf;
+
+        void SetBinaryNodeBBox(const int index, const BBox &bbox);
+        const int BinaryNodeCount() const;
+
     public:
-        BVH() = default;
-        BVH(const BVH &) = delete;
+        IndexedBVH() = default;
+        IndexedBVH(const IndexedBVH &) = delete;
 
-        std::vector<std::shared_ptr<AccelerableObject>> objects;
-        std::vector<std::shared_ptr<AccelerableObject>> precomputed_objects;
-        Bvh internal_bvh;
-        void Construct()
-        {
-            bvh::v2::ThreadPool thread_pool;
-            bvh::v2::ParallelExecutor executor(thread_pool);
-
-            std::vector<BVH_BBox> bboxes(objects.size());
-            std::vector<Vec3> centers(objects.size());
-            executor.for_each(0, objects.size(), [&](size_t begin, size_t end)
-                              {
-                                for (size_t i = begin; i < end; ++i) {
-                                    bboxes[i]  = BBoxConvert(objects[i]->GetBoundingBox());
-                                    centers[i] = Vec3Convert(objects[i]->GetCenter());
-                                } });
-
-            typename bvh::v2::DefaultBuilder<Node>::Config config;
-            config.quality = bvh::v2::DefaultBuilder<Node>::Quality::High;
-            internal_bvh = bvh::v2::DefaultBuilder<Node>::build(thread_pool, bboxes, centers, config);
+        /// @brief Build the hierarchy over primitives [0, bboxes.size()).
+        /// @param bboxes Bounding box of every primitive.
+        /// @param centers Centroid of every primitive, used for partitioning.
+        /// @param leaf_order Receives the leaf order, leaf_order[i] is the primitive that has to be moved to slot i.
+        /// @param splitter Clips primitives for spatial splits, the reference bounds are clipped when empty.
+        /// @note Leaves reference primitive slots directly, so the caller must permute its primitives by leaf_order before traversing.
+        /// With spatial splits leaf_order can be longer than bboxes and list a primitive several times.
+        void Build(const std::vector<BBox> &bboxes, const std::vector<glm::vec3> &centers, std::vector<int> &leaf_order, const BVHConfig &bvh_config = {}, const PrimitiveSplitter &splitter = nullptr);
+
+        /// @brief Primitive ranges [first, last) of all leaves.
+        const std::vector<std::pair<int, int>> LeafRanges() const;
+        /// @brief Memory taken by the nodes, in bytes.
+        const size_t NodeBytes() const;
+
+        /// @brief Refit the leaves holding dirty_slots and their ancestors to the current bounds, keeping the tree topology.
+        /// @param slot_bbox Current bounds of a slot, called for every slot of the refit leaves.
+        /// @return Whether the tree could be refit. Only the binary layout can, 4-wide trees have to be rebuilt.
+        /// @note Costs about the number of dirty slots times the tree depth. The tree quality degrades as primitives move away from where they were built.
+        const bool Refit(const std::vector<int> &dirty_slots, const std::function<const BBox(const int)> &slot_bbox);
+
+        /// @brief Store the built nodes in the on-disk cache, the caller stores its primitives in leaf order alongside.
+        void SaveCache(BVHCacheWriter &writer) const;
+        const bool LoadCache(BVHCacheReader &reader);
+
+        /// @brief Visit every primitive whose leaf is hit by the ray within [0, t_max], nearer leaves first.
+        /// @tparam ANY_HIT Stop at the first primitive reporting a hit, for occlusion queries.
+        /// @param t_max Closest hit distance so far. primitive_fn lowers it for the hits it accepts, nodes entered beyond it are then skipped.
+        /// Closest-hit callers usually pass the _t of the PrimitiveHit their primitive_fn fills in.
+        /// @param primitive_fn Called as primitive_fn(primitive_index) for every candidate primitive, returns whether the primitive is hit.
+        /// @return Whether any primitive reported a hit.
+        template <bool ANY_HIT = false, typename PrimitiveFn>
+        const bool Traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &t_max, PrimitiveFn &&primitive_fn) const
+        {
+            return TraverseImpl<ANY_HIT, false>(origin, direction, t_max, primitive_fn, nullptr);
         }
-        const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+        /// @brief Traverse while adding the work done to stats, for benchmarks.
+        template <bool ANY_HIT = false, typename PrimitiveFn>
+        const bool TraverseWithStats(const glm::vec3 &origin, const glm::vec3 &direction, float &t_max, PrimitiveFn &&primitive_fn, TraversalStats &stats) const
         {
-            auto ray = Ray{
-                Vec3Convert(origin),                   // Ray origin
-                Vec3Convert(direction),                // Ray direction
-                0.0f,                                  // Minimum intersection distance
-                std::numeric_limits<float>::infinity() // Maximum intersection distance
-            };
-            static constexpr size_t stack_size = 64;
-            static constexpr bool use_robust_traversal = false;
-            bvh::v2::SmallStack<Bvh::Index, stack_size> stack;
-            IntersectInfo temp_intersect_info;
-            temp_intersect_info._time = intersect_info._time; // 时间要保持一致
-            int closest_index = -1;
-            internal_bvh.intersect<false, use_robust_traversal>(ray, internal_bvh.get_root().index, stack,
-                                                                [&](size_t begin, size_t end)
-                                                                {
-                                                                    for (size_t i = begin; i < end; ++i)
-                                                                    {
-                                                                        auto j = internal_bvh.prim_ids[i];
-                                                                        auto hit = objects[j]->Intersect(origin, direction, temp_intersect_info);
-                                                                        if (hit)
-                                                                        {
-                                                                            if (closest_index == -1 || temp_intersect_info._t < intersect_info._t)
-                                                                            {
-                                                                                intersect_info = temp_intersect_info;
-                                                                                closest_index = j;
-                                                                            }
-                                                                        }
-                                                                    }
-                                                                    return closest_index != -1;
-                                                                });
-            if (closest_index == -1)
-            {
-                return false;
-            }
-            return true;
+            return TraverseImpl<ANY_HIT, true>(origin, direction, t_max, primitive_fn, &stats);
         }
-    };
-
-#else
-    template <typename AccelerableObject, std::enable_if_t<has_bounding_box<AccelerableObject>::value, bool> _ = true>
-    class BVH
-    {
-    public:
-    private:
-        std::vector<BVHNode> node_tree;
-        const int RecursiveConstruct(std::vector<std::shared_ptr<AccelerableObject>>::iterator begin, std::vector<std::shared_ptr<AccelerableObject>>::iterator end)
+        /// @brief Closest-hit traversal of the rays of a packet in mask, sharing one stack while enough of them reach the same nodes.
+        /// @param t_max Closest hit distance of every lane, nodes beyond it are skipped. primitive_fn lowers it for the lanes it hits.
+        /// @param primitive_fn Called as primitive_fn(slot, lane_mask) with the lanes whose rays reached the leaf.
+        /// @note The 4-wide layout is traversed ray by ray.
+        template <typename PrimitiveFn>
+        void TraversePacket(const RayPacket &packet, const uint32_t mask, float (&t_max)[MAX_RAY_PACKET_SIZE], PrimitiveFn &&primitive_fn) const
         {
-            if (begin + 1 == end)
+            if (mask == 0)
             {
-                node_tree[std::distance(objects.begin(), begin)]._bbox = (*begin)->GetBoundingBox();
-                return static_cast<int>(std::distance(objects.begin(), begin));
+                return;
             }
-
-            BBox overall_bbox = (*begin)->GetBoundingBox();
-            for (auto it = begin; it != end; ++it)
+            if (!_wide.empty())
             {
-                overall_bbox.Union((*it)->GetBoundingBox());
+                for (uint32_t lanes = mask; lanes != 0; lanes &= lanes - 1)
+                {
+                    const int lane = std::countr_zero(lanes);
+                    _wide.Traverse(packet.origins[lane], packet.directions[lane], t_max[lane], [&](const int first, const int last) -> bool
+                                   {
+                        for (int i = first; i < last; ++i)
+                        {
+                            primitive_fn(i, 1u << lane);
+                        }
+                        return false; });
+                }
+                return;
             }
-            auto mid = begin;
-#ifdef USE_SAH
-            BBox centroid_bbox((*begin)->GetBoundingBox().GetCenter(), (*begin)->GetBoundingBox().GetCenter());
-            for (auto it = begin; it != end; ++it)
+#ifdef USE_EXT_BVH
+            if (_internal_bvh.nodes.empty())
+#else
+            if (_node_tree.empty())
+#endif // USE_EXT_BVH
             {
-                centroid_bbox.Union((*it)->GetBoundingBox().GetCenter());
+                return;
             }
-            int dim = centroid_bbox.GetLongestAxis();
 
-            if (centroid_bbox._pmax[dim] == centroid_bbox._pmin[dim])
+            const PacketRays rays(packet);
+            float nearest_l, nearest_r;
+            uint32_t current_mask = IntersectPacket(GetBinaryNode(0)._bbox, rays, mask, t_max, nearest_l);
+            if (current_mask == 0)
             {
-                node_tree.push_back(BVHNode{overall_bbox,
-                                            -1,
-                                            -1,
-                                            static_cast<int>(std::distance(objects.begin(), begin)),
-                                            static_cast<int>(std::distance(objects.begin(), end)) - 1});
-                return static_cast<int>(node_tree.size()) - 1;
+                return;
             }
-
-            std::sort(begin, end, [&](const std::shared_ptr<AccelerableObject> &a, const std::shared_ptr<AccelerableObject> &b) -> bool
-                      { return a->GetBoundingBox().GetCenter()[dim] < b->GetBoundingBox().GetCenter()[dim]; });
-            if (std::distance(begin, end) <= 2)
+            struct StackEntry
             {
-                // begin + 1 == end case has been dealt before.
-                mid = std::next(begin, std::distance(begin, end) / 2);
-            }
-            else
+                int node;
+                uint32_t mask;
+            };
+            StackEntry traverse_stack[MAX_TRAVERSE_DEPTH];
+            int stack_size = 0;
+            int current = 0;
+            while (true)
             {
-                constexpr int N_BUCKETS = 24;
-                BVHSplitBucket buckets[N_BUCKETS];
-                for (auto prim = begin; prim != end; ++prim)
+                if (std::popcount(current_mask) <= RAY_PACKET_DIVERGENCE_THRESHOLD)
                 {
-                    int b = static_cast<int>(N_BUCKETS * centroid_bbox.Offset((*prim)->GetBoundingBox().GetCenter())[dim]);
-                    if (b == N_BUCKETS)
+                    // Too few rays left to share the node tests, finish the subtree ray by ray.
+                    for (uint32_t lanes = current_mask; lanes != 0; lanes &= lanes - 1)
                     {
-                        b = N_BUCKETS - 1;
+                        TraverseLane(current, rays, std::countr_zero(lanes), t_max, primitive_fn);
                     }
-                    buckets[b].count++;
-                    buckets[b].bounds.Union((*prim)->GetBoundingBox());
                 }
-
-                constexpr int N_SPLITS = N_BUCKETS - 1;
-                float costs[N_SPLITS] = {};
-                std::fill(&costs[0], &costs[N_SPLITS - 1], 0.0f);
-
-                int count_below = 0;
-                BBox bound_below = buckets[0].bounds;
-                for (int i = 0; i < N_SPLITS; ++i)
+                else
                 {
-                    bound_below.Union(buckets[i].bounds);
-                    count_below += buckets[i].count;
-                    costs[i] += count_below * bound_below.SurfaceArea();
+                    const BinaryNode node = GetBinaryNode(current);
+                    if (node.count > 0)
+                    {
+                        for (int i = node.first; i < node.first + node.count; ++i)
+                        {
+                            primitive_fn(i, current_mask);
+                        }
+                    }
+                    else
+                    {
+                        const uint32_t mask_l = IntersectPacket(GetBinaryNode(node.first)._bbox, rays, current_mask, t_max, nearest_l);
+                        const uint32_t mask_r = IntersectPacket(GetBinaryNode(node.second)._bbox, rays, current_mask, t_max, nearest_r);
+                        if (mask_l != 0 && mask_r != 0)
+                        {
+                            // Visit the child the packet enters first and defer the other one.
+                            const bool left_first = nearest_l <= nearest_r;
+                            traverse_stack[stack_size++] = left_first ? StackEntry{node.second, mask_r} : StackEntry{node.first, mask_l};
+                            current = left_first ? node.first : node.second;
+                            current_mask = left_first ? mask_l : mask_r;
+                            continue;
+                        }
+                        else if (mask_l != 0 || mask_r != 0)
+                        {
+                            current = mask_l != 0 ? node.first : node.second;
+                            current_mask = mask_l | mask_r;
+                            continue;
+                        }
+                    }
                 }
-
-                int count_above = 0;
-                BBox bound_above = buckets[N_SPLITS].bounds;
-                for (int i = N_SPLITS; i >= 1; --i)
+                // Deferred nodes are tested again, lanes may have found closer hits in the meantime.
+                current_mask = 0;
+                while (stack_size > 0 && current_mask == 0)
                 {
-                    bound_above.Union(buckets[i].bounds);
-                    count_above += buckets[i].count;
-                    costs[i - 1] += count_above * bound_above.SurfaceArea();
+                    const StackEntry entry = traverse_stack[--stack_size];
+                    current = entry.node;
+                    current_mask = IntersectPacket(GetBinaryNode(current)._bbox, rays, entry.mask, t_max, nearest_l);
                 }
-
-                int min_cost_split_bucket = -1;
-                float min_cost = std::numeric_limits<float>::infinity();
-                for (int i = 0; i < N_SPLITS; ++i)
+                if (current_mask == 0)
                 {
-                    if (costs[i] < min_cost)
-                    {
-                        min_cost = costs[i];
-                        min_cost_split_bucket = i;
-                    }
+                    break;
                 }
-                float leaf_cost = static_cast<float>(std::distance(begin, end));
-                min_cost = 1.0f / 2.0f + min_cost / overall_bbox.SurfaceArea();
+            }
+        }
+
+    private:
+        /// @brief Packet rays in structure-of-arrays form, so that a node is tested against all lanes in one vectorizable loop.
+        struct PacketRays
+        {
+            float origin[3][MAX_RAY_PACKET_SIZE];
+            float inv_direction[3][MAX_RAY_PACKET_SIZE];
 
-                if (std::distance(begin, end) > 16 || min_cost < leaf_cost)
+            explicit PacketRays(const RayPacket &packet)
+            {
+                for (int lane = 0; lane < MAX_RAY_PACKET_SIZE; ++lane)
                 {
-                    mid = std::stable_partition(
-                        begin, end,
-                        [=](const std::shared_ptr<AccelerableObject> &bp)
-                        {
-                            int b = static_cast<int>(N_BUCKETS * centroid_bbox.Offset(bp->GetBoundingBox().GetCenter())[dim]);
-                            if (b == N_BUCKETS)
-                            {
-                                b = N_BUCKETS - 1;
-                            }
-                            return b <= min_cost_split_bucket;
-                        });
+                    // Unused lanes get a harmless ray, they are masked out anyway.
+                    const glm::vec3 o = lane < packet.size ? packet.origins[lane] : glm::vec3(0.0f);
+                    const glm::vec3 inv_d = lane < packet.size ? 1.0f / packet.directions[lane] : glm::vec3(1.0f);
+                    for (int axis = 0; axis < 3; ++axis)
+                    {
+                        origin[axis][lane] = o[axis];
+                        inv_direction[axis][lane] = inv_d[axis];
+                    }
                 }
-                else
+            }
+        };
+        /// @brief Node of either binary tree, leaves have count > 0 and the primitives [first, first + count), interior nodes the children first and second.
+        struct BinaryNode
+        {
+            BBox _bbox;
+            int first;
+            int second;
+            int count;
+        };
+        const BinaryNode GetBinaryNode(const int index) const
+        {
+#ifdef USE_EXT_BVH
+            const Node &node = _internal_bvh.nodes[index];
+            const BVH_BBox bbox = node.get_bbox();
+            const BBox converted(glm::vec3(bbox.min[0], bbox.min[1], bbox.min[2]), glm::vec3(bbox.max[0], bbox.max[1], bbox.max[2]));
+            const int first = static_cast<int>(node.index.first_id());
+            if (node.is_leaf())
+            {
+                return BinaryNode{converted, first, 0, static_cast<int>(node.index.prim_count())};
+            }
+            return BinaryNode{converted, first, first + 1, 0};
+#else
+            const LinearBVHNode &node = _node_tree[index];
+            if (node.n_primitives > 0)
+            {
+                return BinaryNode{node._bbox, node.primitive_offset, 0, node.n_primitives};
+            }
+            return BinaryNode{node._bbox, index + 1, node.second_child_offset, 0};
+#endif // USE_EXT_BVH
+        }
+        /// @brief Lanes in mask hitting bbox before their t_max, nearest receives the smallest entry distance among them.
+        static const uint32_t IntersectPacket(const BBox &bbox, const PacketRays &rays, const uint32_t mask, const float (&t_max)[MAX_RAY_PACKET_SIZE], float &nearest)
+        {
+            float t_enter[MAX_RAY_PACKET_SIZE];
+            uint32_t hit_mask = 0;
+            for (int lane = 0; lane < MAX_RAY_PACKET_SIZE; ++lane)
+            {
+                float enter = 0.0f, exit = t_max[lane];
+                for (int axis = 0; axis < 3; ++axis)
                 {
-                    node_tree.push_back(BVHNode{overall_bbox,
-                                                -1,
-                                                -1,
-                                                static_cast<int>(std::distance(objects.begin(), begin)),
-                                                static_cast<int>(std::distance(objects.begin(), end)) - 1});
-                    return static_cast<int>(node_tree.size()) - 1;
+                    // Same plane selection as BBox::IntersectSegment.
+                    const bool negative = rays.inv_direction[axis][lane] < 0.0f;
+                    const float t_near = ((negative ? bbox._pmax[axis] : bbox._pmin[axis]) - rays.origin[axis][lane]) * rays.inv_direction[axis][lane];
+                    const float t_far = ((negative ? bbox._pmin[axis] : bbox._pmax[axis]) - rays.origin[axis][lane]) * rays.inv_direction[axis][lane];
+                    enter = std::max(enter, t_near);
+                    exit = std::min(exit, t_far);
                 }
+                t_enter[lane] = enter;
+                hit_mask |= static_cast<uint32_t>(enter <= exit) << lane;
             }
-#else
-            int longest_axis = overall_bbox.GetLongestAxis();
-            std::sort(begin, end, [&](const std::shared_ptr<AccelerableObject> &a, const std::shared_ptr<AccelerableObject> &b) -> bool
-                      { return a->GetBoundingBox().GetCenter()[longest_axis] < b->GetBoundingBox().GetCenter()[longest_axis]; });
-            mid = std::next(begin, std::distance(begin, end) / 2);
-#endif // USE_SAH
-            int left_node = RecursiveConstruct(begin, mid);
-            int right_node = RecursiveConstruct(mid, end);
-#ifdef USE_SAH
-            node_tree.push_back(BVHNode{overall_bbox,
-                                        left_node,
-                                        right_node,
-                                        static_cast<int>(std::distance(objects.begin(), begin)),
-                                        static_cast<int>(std::distance(begin, end)) - 1});
-#else
-            node_tree.push_back(BVHNode{overall_bbox,
-                                        left_node,
-                                        right_node});
-#endif             // USE_SAH
-
-            return static_cast<int>(node_tree.size()) - 1;
+            hit_mask &= mask;
+            nearest = std::numeric_limits<float>::infinity();
+            for (uint32_t lanes = hit_mask; lanes != 0; lanes &= lanes - 1)
+            {
+                nearest = std::min(nearest, t_enter[std::countr_zero(lanes)]);
+            }
+            return hit_mask;
         }
-
-    public:
-        BVH() = default;
-        BVH(const BVH &) = delete;
-
-        std::vector<std::shared_ptr<AccelerableObject>> objects;
-        void Construct()
+        /// @brief IntersectPacket for a single lane, t receives the entry distance.
+        static const bool IntersectLane(const BBox &bbox, const PacketRays &rays, const int lane, const float t_max, float &t)
         {
-            if (objects.empty())
+            float enter = 0.0f, exit = t_max;
+            for (int axis = 0; axis < 3; ++axis)
             {
-                return;
+                const bool negative = rays.inv_direction[axis][lane] < 0.0f;
+                const float t_near = ((negative ? bbox._pmax[axis] : bbox._pmin[axis]) - rays.origin[axis][lane]) * rays.inv_direction[axis][lane];
+                const float t_far = ((negative ? bbox._pmin[axis] : bbox._pmax[axis]) - rays.origin[axis][lane]) * rays.inv_direction[axis][lane];
+                enter = std::max(enter, t_near);
+                exit = std::min(exit, t_far);
             }
-            node_tree.resize(objects.size());
-            RecursiveConstruct(objects.begin(), objects.end());
+            t = enter;
+            return enter <= exit;
         }
-        const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+        /// @brief Single-ray traversal of the subtree at root for one lane of a packet, the root bounds are known to be hit.
+        template <typename PrimitiveFn>
+        void TraverseLane(const int root, const PacketRays &rays, const int lane, float (&t_max)[MAX_RAY_PACKET_SIZE], PrimitiveFn &primitive_fn) const
         {
-            if (node_tree.empty())
+            const uint32_t lane_mask = 1u << lane;
+            int traverse_stack[MAX_TRAVERSE_DEPTH];
+            int stack_size = 0;
+            int current = root;
+            while (true)
             {
-                return false;
+                const BinaryNode node = GetBinaryNode(current);
+                if (node.count > 0)
+                {
+                    for (int i = node.first; i < node.first + node.count; ++i)
+                    {
+                        primitive_fn(i, lane_mask);
+                    }
+                }
+                else
+                {
+                    float dist_l, dist_r;
+                    const bool intersect_l = IntersectLane(GetBinaryNode(node.first)._bbox, rays, lane, t_max[lane], dist_l);
+                    const bool intersect_r = IntersectLane(GetBinaryNode(node.second)._bbox, rays, lane, t_max[lane], dist_r);
+                    if (intersect_l && intersect_r)
+                    {
+                        traverse_stack[stack_size++] = dist_l <= dist_r ? node.second : node.first;
+                        current = dist_l <= dist_r ? node.first : node.second;
+                        continue;
+                    }
+                    else if (intersect_l || intersect_r)
+                    {
+                        current = intersect_l ? node.first : node.second;
+                        continue;
+                    }
+                }
+                float dist;
+                do
+                {
+                    if (stack_size == 0)
+                    {
+                        return;
+                    }
+                    current = traverse_stack[--stack_size];
+                } while (!IntersectLane(GetBinaryNode(current)._bbox, rays, lane, t_max[lane], dist));
             }
-            IntersectInfo temp_intersect_info;
-            temp_intersect_info._time = intersect_info._time; // 时间要保持一致
-            int closest_index = -1;
-// #define DISABLE_BVH
-#ifdef DISABLE_BVH // For debug purposes.
-            for (int i = 0; i < objects.size(); ++i)
+        }
+        template <bool ANY_HIT, bool COUNT_STATS, typename PrimitiveFn>
+        const bool TraverseImpl(const glm::vec3 &origin, const glm::vec3 &direction, float &t_max, PrimitiveFn &primitive_fn, TraversalStats *stats) const
+        {
+            bool hit = false;
+            auto leaf_fn = [&](const int first, const int last) -> bool
             {
-                if (objects[i]->Intersect(origin, direction, temp_intersect_info))
+                if constexpr (COUNT_STATS)
+                {
+                    stats->primitive_tests += last - first;
+                }
+                for (int i = first; i < last; ++i)
                 {
-                    if (closest_index == -1 || temp_intersect_info._t < intersect_info._t)
+                    if (primitive_fn(i))
                     {
-                        intersect_info = temp_intersect_info;
-                        closest_index = i;
+                        hit = true;
+                        if constexpr (ANY_HIT)
+                        {
+                            return true;
+                        }
                     }
                 }
+                return false;
+            };
+            if (!_wide.empty())
+            {
+                _wide.Traverse<COUNT_STATS>(origin, direction, t_max, leaf_fn, stats);
+                return hit;
             }
+#ifdef USE_EXT_BVH
+            if (_internal_bvh.nodes.empty())
+            {
+                return false;
+            }
+
+            auto ray = Ray{
+                Vec3Convert(origin),    // Ray origin
+                Vec3Convert(direction), // Ray direction
+                0.0f,                   // Minimum intersection distance
+                t_max                   // Maximum intersection distance, shrunk as hits are found
+            };
+            static constexpr size_t stack_size = 64;
+            static constexpr bool use_robust_traversal = false;
+            bvh::v2::SmallStack<Bvh::Index, stack_size> stack;
+            _internal_bvh.intersect<ANY_HIT, use_robust_traversal>(
+                ray, _internal_bvh.get_root().index, stack, [&](size_t begin, size_t end)
+                {
+                    const bool stop = leaf_fn(static_cast<int>(begin), static_cast<int>(end));
+                    ray.tmax = t_max;
+                    return stop; },
+                [&](const Node &, const Node &)
+                {
+                    if constexpr (COUNT_STATS)
+                    {
+                        ++stats->node_visits;
+                    }
+                });
+            return hit;
 #else
-            std::stack<int> traverse_stack;
-            traverse_stack.push(static_cast<int>(node_tree.size()) - 1);
-            while (!traverse_stack.empty())
+            if (_node_tree.empty())
             {
-                auto stack_top = traverse_stack.top();
-                traverse_stack.pop();
-                if (stack_top < objects.size())
+                return false;
+            }
+            struct StackEntry
+            {
+                int node;
+                float dist;
+            };
+            StackEntry traverse_stack[MAX_TRAVERSE_DEPTH];
+            int stack_size = 0;
+            const glm::vec3 inv_direction = 1.0f / direction;
+            float dist_root;
+            if (!_node_tree[0]._bbox.IntersectSegment(origin, inv_direction, t_max, dist_root))
+            {
+                return false;
+            }
+            int current = 0;
+            while (true)
+            {
+                const LinearBVHNode &node = _node_tree[current];
+                if (node.n_primitives > 0)
                 {
-                    if (objects[stack_top]->Intersect(origin, direction, temp_intersect_info))
+                    if (leaf_fn(node.primitive_offset, node.primitive_offset + node.n_primitives))
+                    {
+                        return true;
+                    }
+                }
+                else
+                {
+                    if constexpr (COUNT_STATS)
+                    {
+                        ++stats->node_visits;
+                    }
+                    const int left = current + 1;
+                    const int right = node.second_child_offset;
+                    float dist_l, dist_r;
+                    const bool intersect_l = _node_tree[left]._bbox.IntersectSegment(origin, inv_direction, t_max, dist_l);
+                    const bool intersect_r = _node_tree[right]._bbox.IntersectSegment(origin, inv_direction, t_max, dist_r);
+                    if (intersect_l && intersect_r)
                     {
-                        if (closest_index == -1 || temp_intersect_info._t < intersect_info._t)
+                        // Visit the nearer child first and defer the other one.
+                        if (dist_l < dist_r)
                         {
-                            intersect_info = temp_intersect_info;
-                            closest_index = stack_top;
+                            traverse_stack[stack_size++] = StackEntry{right, dist_r};
+                            current = left;
                         }
+                        else
+                        {
+                            traverse_stack[stack_size++] = StackEntry{left, dist_l};
+                            current = right;
+                        }
+                        continue;
+                    }
+                    else if (intersect_l)
+                    {
+                        current = left;
+                        continue;
+                    }
+                    else if (intersect_r)
+                    {
+                        current = right;
+                        continue;
                     }
                 }
-#ifdef USE_SAH
-                else if (node_tree[stack_top].left == -1 && node_tree[stack_top].right == -1)
+                // Deferred nodes entered behind the closest hit found since they were pushed are dropped.
+                do
                 {
-                    for (int prim_idx = node_tree[stack_top].first_primitive_offset; prim_idx <= node_tree[stack_top].last_primitive_offset; ++prim_idx)
+                    if (stack_size == 0)
                     {
-                        if (objects[prim_idx]->Intersect(origin, direction, temp_intersect_info))
+                        return hit;
+                    }
+                    --stack_size;
+                } while (traverse_stack[stack_size].dist > t_max);
+                current = traverse_stack[stack_size].node;
+            }
+#endif // USE_EXT_BVH
+        }
+    };
+
+    constexpr int MOTION_BVH_LEAF_PRIMITIVES = 2;
+
+    struct MotionBVHNode
+    {
+        int offset = 0;            // 叶节点为第一个图元的位置，内部节点为第二个子节点的位置
+        uint16_t n_primitives = 0; // 0 for interior nodes.
+        uint8_t axis = 0;
+    };
+
+    /// @brief BVH over moving primitives.
+    /// @note The time line is split into segments at the motion key times. Every node keeps its bounds at the start and the end of each segment,
+    /// and a ray tests the box linearly interpolated at its time, instead of a box covering the whole motion.
+    class IndexedMotionBVH
+    {
+    private:
+        std::vector<MotionBVHNode> _nodes;
+        std::vector<float> _segment_times;
+        std::vector<BBox> _node_bounds; // Indexed by (segment * node_count + node) * 2 + {0: segment start, 1: segment end}.
+        std::vector<int> _build_order;
+
+        const int RecursiveConstruct(std::vector<int>::iterator begin, std::vector<int>::iterator end, const int depth, const std::vector<glm::vec3> &centers);
+        const BBox GetNodeBounds(const int segment, const int node, const float segment_factor) const
+        {
+            const size_t base = (static_cast<size_t>(segment) * _nodes.size() + node) * 2;
+            const BBox &bbox_from = _node_bounds[base];
+            const BBox &bbox_to = _node_bounds[base + 1];
+            return BBox(glm::mix(bbox_from._pmin, bbox_to._pmin, segment_factor), glm::mix(bbox_from._pmax, bbox_to._pmax, segment_factor));
+        }
+
+    public:
+        IndexedMotionBVH() = default;
+        IndexedMotionBVH(const IndexedMotionBVH &) = delete;
+
+        /// @brief Build the hierarchy over primitives [0, bounds[0].size() / 2).
+        /// @param segment_times Sorted segment boundaries, at least two.
+        /// @param bounds For every segment, the bounds of every primitive at the start and the end of the segment, as bounds[segment][primitive * 2 + {0, 1}].
+        /// Interpolating them linearly has to contain the primitive at any time of the segment.
+        /// @param leaf_order Receives the leaf order, same as IndexedBVH::Build.
+        void Build(const std::vector<float> &segment_times, const std::vector<std::vector<BBox>> &bounds, std::vector<int> &leaf_order);
+        const bool empty() const
+        {
+            return _nodes.empty();
+        }
+
+        /// @brief Visit every primitive whose leaf is hit by the ray at the given time within [0, t_max], nearer leaves first.
+        /// @param t_max Lowered by primitive_fn as it accepts hits, same as IndexedBVH::Traverse.
+        /// @note Times out of the segments are clamped, the primitives are expected to hold their first or last pose there.
+        template <bool ANY_HIT = false, typename PrimitiveFn>
+        const bool Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float time, float &t_max, PrimitiveFn &&primitive_fn) const
+        {
+            if (_nodes.empty())
+            {
+                return false;
+            }
+            const int segment_count = static_cast<int>(_segment_times.size()) - 1;
+            const int segment = std::clamp(static_cast<int>(std::upper_bound(_segment_times.begin(), _segment_times.end(), time) - _segment_times.begin()) - 1, 0, segment_count - 1);
+            const float segment_factor = std::clamp((time - _segment_times[segment]) / (_segment_times[segment + 1] - _segment_times[segment]), 0.0f, 1.0f);
+
+            bool hit = false;
+            struct StackEntry
+            {
+                int node;
+                float dist;
+            };
+            StackEntry traverse_stack[MAX_TRAVERSE_DEPTH];
+            int stack_size = 0;
+            const glm::vec3 inv_direction = 1.0f / direction;
+            float dist_root;
+            if (!GetNodeBounds(segment, 0, segment_factor).IntersectSegment(origin, inv_direction, t_max, dist_root))
+            {
+                return false;
+            }
+            int current = 0;
+            while (true)
+            {
+                const MotionBVHNode &node = _nodes[current];
+                if (node.n_primitives > 0)
+                {
+                    for (int i = node.offset; i < node.offset + node.n_primitives; ++i)
+                    {
+                        if (primitive_fn(i))
                         {
-                            if (closest_index == -1 || temp_intersect_info._t < intersect_info._t)
+                            hit = true;
+                            if constexpr (ANY_HIT)
                             {
-                                intersect_info = temp_intersect_info;
-                                closest_index = stack_top;
+                                return true;
                             }
                         }
                     }
                 }
-#endif // USE_SAH
                 else
                 {
-                    float dist_l = std::numeric_limits<float>::infinity(), dist_r = std::numeric_limits<float>::infinity();
-                    bool intersect_l = false, intersect_r = false;
-                    if (node_tree[stack_top].left != -1)
+                    const int left = current + 1;
+                    const int right = node.offset;
+                    float dist_l, dist_r;
+                    const bool intersect_l = GetNodeBounds(segment, left, segment_factor).IntersectSegment(origin, inv_direction, t_max, dist_l);
+                    const bool intersect_r = GetNodeBounds(segment, right, segment_factor).IntersectSegment(origin, inv_direction, t_max, dist_r);
+                    if (intersect_l && intersect_r)
                     {
-                        intersect_l = node_tree[node_tree[stack_top].left]._bbox.Intersect(origin, direction, dist_l);
+                        traverse_stack[stack_size++] = dist_l < dist_r ? StackEntry{right, dist_r} : StackEntry{left, dist_l};
+                        current = dist_l < dist_r ? left : right;
+                        continue;
                     }
-                    if (node_tree[stack_top].right != -1)
+                    else if (intersect_l || intersect_r)
                     {
-                        intersect_r = node_tree[node_tree[stack_top].right]._bbox.Intersect(origin, direction, dist_r);
+                        current = intersect_l ? left : right;
+                        continue;
                     }
-                    if (intersect_l && intersect_r)
+                }
+                do
+                {
+                    if (stack_size == 0)
                     {
-                        if (dist_l < dist_r)
-                        {
-                            traverse_stack.push(node_tree[stack_top].right);
-                            traverse_stack.push(node_tree[stack_top].left); // So left is on the top.
-                        }
-                        else
-                        {
-                            traverse_stack.push(node_tree[stack_top].left);
-                            traverse_stack.push(node_tree[stack_top].right);
-                        }
+                        return hit;
                     }
-                    else if (intersect_l && !intersect_r)
+                    --stack_size;
+                } while (traverse_stack[stack_size].dist > t_max);
+                current = traverse_stack[stack_size].node;
+            }
+        }
+    };
+
+    /// @brief Default leaf dispatch of BVH, calls the virtual functions of the objects.
+    template <typename AccelerableObject>
+    class VirtualDispatch
+    {
+    private:
+        const std::vector<std::shared_ptr<AccelerableObject>> *_objects = nullptr;
+
+    public:
+        void Build(const std::vector<std::shared_ptr<AccelerableObject>> &objects)
+        {
+            _objects = &objects;
+        }
+        void Add(const std::shared_ptr<AccelerableObject> &)
+        {
+        }
+        template <typename Fn>
+        decltype(auto) Visit(const int object, Fn &&fn) const
+        {
+            return fn(*(*_objects)[object]);
+        }
+    };
+
+    /// @tparam Dispatch Built over the objects after Construct, Visit(i, fn) calls fn with object i. Add(object) is called for every object appended by Insert.
+    /// @note Besides Construct, objects can be updated in place by Refit, Insert and Remove, see their cost notes.
+    template <typename AccelerableObject, typename Dispatch = VirtualDispatch<AccelerableObject>, std::enable_if_t<has_bounding_box<AccelerableObject>::value, bool> _ = true>
+    class BVH
+    {
+    private:
+        Dispatch _dispatch;
+        IndexedBVH _accel;
+        IndexedMotionBVH _motion_accel;
+        int _static_count = 0; // objects[0, _static_count) are in _accel, the rest in _motion_accel.
+        std::vector<int> _leaf_objects; // Leaf slot to object index of _accel, only used when spatial splits referenced an object more than once.
+        // objects[_built_count, objects.size()) were appended by Insert, they are kept in _insert_accel until the next Construct.
+        int _built_count = 0;
+        IndexedBVH _insert_accel;
+        std::vector<int> _insert_leaf_order; // Leaf slot of _insert_accel to offset from _built_count.
+        // Objects dropped by Remove are skipped by the traversals until the next Construct erases them. Empty if there are none.
+        std::vector<uint8_t> _removed;
+        int _removed_count = 0;
+        std::unordered_map<const AccelerableObject *, int> _object_index;
+
+        const int LeafObject(const int slot) const
+        {
+            return _leaf_objects.empty() ? slot : _leaf_objects[slot];
+        }
+        const int InsertedObject(const int slot) const
+        {
+            return _built_count + _insert_leaf_order[slot];
+        }
+        const bool IsRemoved(const int object) const
+        {
+            return _removed_count > 0 && _removed[object];
+        }
+        const BBox ObjectBBox(const int object) const
+        {
+            // Removed objects get an inverted box. Every box test picks its planes by direction sign and misses it, so refit nodes stop reaching them.
+            return IsRemoved(object) ? BBox(glm::vec3(std::numeric_limits<float>::infinity()), glm::vec3(-std::numeric_limits<float>::infinity())) : objects[object]->GetBoundingBox();
+        }
+        void BuildInsertAccel()
+        {
+            const int insert_count = static_cast<int>(objects.size()) - _built_count;
+            std::vector<BBox> bboxes(insert_count);
+            std::vector<glm::vec3> centers(insert_count);
+            for (int i = 0; i < insert_count; ++i)
+            {
+                bboxes[i] = ObjectBBox(_built_count + i);
+                centers[i] = objects[_built_count + i]->GetCenter();
+            }
+            _insert_accel.Build(bboxes, centers, _insert_leaf_order);
+        }
+
+    public:
+        BVH() = default;
+        BVH(const BVH &) = delete;
+
+        std::vector<std::shared_ptr<AccelerableObject>> objects;
+        void Construct(const BVHConfig &bvh_config = {})
+        {
+            if (_removed_count > 0)
+            {
+                size_t kept = 0;
+                for (size_t i = 0; i < objects.size(); ++i)
+                {
+                    if (!_removed[i])
                     {
-                        traverse_stack.push(node_tree[stack_top].left);
+                        objects[kept++] = std::move(objects[i]);
                     }
-                    else if (!intersect_l && intersect_r)
+                }
+                objects.resize(kept);
+            }
+            _removed.clear();
+            _removed_count = 0;
+            _insert_accel.Build({}, {}, _insert_leaf_order);
+            // Static objects come first, animated ones are moved behind them into the motion BVH.
+            auto motion_begin = std::stable_partition(objects.begin(), objects.end(), [](const std::shared_ptr<AccelerableObject> &object)
+                                                      { return !object->IsAnimated(); });
+            std::vector<float> segment_times;
+            for (auto it = motion_begin; it != objects.end(); ++it)
+            {
+                (*it)->GetMotionKeyTimes(segment_times);
+            }
+            std::sort(segment_times.begin(), segment_times.end());
+            segment_times.erase(std::unique(segment_times.begin(), segment_times.end()), segment_times.end());
+            if (segment_times.size() < 2)
+            {
+                // 所有关键帧落在同一时刻, 没有可插值的运动段, 按静态物体处理.
+                motion_begin = objects.end();
+            }
+            _static_count = static_cast<int>(motion_begin - objects.begin());
+
+            std::vector<BBox> bboxes(_static_count);
+            std::vector<glm::vec3> centers(_static_count);
+            for (int i = 0; i < _static_count; ++i)
+            {
+                bboxes[i] = objects[i]->GetBoundingBox();
+                centers[i] = objects[i]->GetCenter();
+            }
+            std::vector<int> leaf_order;
+            _accel.Build(bboxes, centers, leaf_order, bvh_config);
+
+            // Store the objects in leaf order, so that each leaf is a contiguous run.
+            // With spatial splits an object may appear in several leaves, objects then keeps its order and leaves go through _leaf_objects.
+            std::vector<std::shared_ptr<AccelerableObject>> ordered_objects(objects.size());
+            _leaf_objects.clear();
+            if (static_cast<int>(leaf_order.size()) > _static_count)
+            {
+                std::move(objects.begin(), objects.begin() + _static_count, ordered_objects.begin());
+                _leaf_objects = std::move(leaf_order);
+            }
+            else
+            {
+                for (size_t i = 0; i < leaf_order.size(); ++i)
+                {
+                    ordered_objects[i] = std::move(objects[leaf_order[i]]);
+                }
+            }
+
+            const int motion_count = static_cast<int>(objects.size()) - _static_count;
+            if (motion_count == 0)
+            {
+                // Drop the nodes of an earlier Construct, they would index past the static objects.
+                std::vector<int> motion_leaf_order;
+                _motion_accel.Build({}, {}, motion_leaf_order);
+            }
+            else
+            {
+                std::vector<std::vector<BBox>> motion_bounds(segment_times.size() - 1, std::vector<BBox>(motion_count * 2));
+                for (size_t segment = 0; segment + 1 < segment_times.size(); ++segment)
+                {
+                    for (int i = 0; i < motion_count; ++i)
                     {
-                        traverse_stack.push(node_tree[stack_top].right);
+                        objects[_static_count + i]->GetMotionBoundingBoxes(segment_times[segment], segment_times[segment + 1], motion_bounds[segment][i * 2], motion_bounds[segment][i * 2 + 1]);
                     }
                 }
+                std::vector<int> motion_leaf_order;
+                _motion_accel.Build(segment_times, motion_bounds, motion_leaf_order);
+                for (int i = 0; i < motion_count; ++i)
+                {
+                    ordered_objects[_static_count + i] = std::move(objects[_static_count + motion_leaf_order[i]]);
+                }
+                INFO << motion_count << " animated object(s) over " << segment_times.size() - 1 << " motion segment(s) are kept in the motion BVH." << std::endl;
+            }
+            objects = std::move(ordered_objects);
+            _built_count = static_cast<int>(objects.size());
+            _object_index.clear();
+            for (int i = 0; i < _built_count; ++i)
+            {
+                _object_index[objects[i].get()] = i;
+            }
+            _dispatch.Build(objects);
+        }
+        /// @brief Index of object in objects, -1 if it is not in the hierarchy.
+        const int Find(const AccelerableObject *object) const
+        {
+            auto it = _object_index.find(object);
+            return it == _object_index.end() ? -1 : it->second;
+        }
+        /// @brief Objects inserted or removed since the last Construct.
+        const int PendingCount() const
+        {
+            return static_cast<int>(objects.size()) - _built_count + _removed_count;
+        }
+        /// @brief Update the hierarchy to the current bounds of the given objects, e.g. after they have been transformed.
+        /// @return False if it has to be rebuilt by Construct instead, i.e. for animated objects, spatial splits or the 4-wide layouts.
+        /// @note Static objects are refit at a cost of about their count times the tree depth, the inserted ones are rebuilt along with all others inserted since the last Construct.
+        const bool Refit(const std::vector<int> &dirty)
+        {
+            std::vector<int> dirty_slots;
+            bool dirty_inserted = false;
+            for (const int object : dirty)
+            {
+                if (object >= _built_count)
+                {
+                    dirty_inserted = true;
+                }
+                else if (object >= _static_count || !_leaf_objects.empty() || objects[object]->IsAnimated())
+                {
+                    return false;
+                }
+                else
+                {
+                    // Without spatial splits static objects are stored in leaf order, the slot is the object index.
+                    dirty_slots.push_back(object);
+                }
+            }
+            if (!_accel.Refit(dirty_slots, [&](const int slot)
+                              { return ObjectBBox(slot); }))
+            {
+                return false;
+            }
+            if (dirty_inserted)
+            {
+                BuildInsertAccel();
             }
+            return true;
+        }
+        /// @brief Append static objects, kept in a hierarchy of their own that is rebuilt over all objects inserted since the last Construct.
+        /// @return False without changing anything if any of them is animated, Construct has to take them in then.
+        const bool Insert(const std::vector<std::shared_ptr<AccelerableObject>> &added)
+        {
+            for (const std::shared_ptr<AccelerableObject> &object : added)
+            {
+                if (object->IsAnimated())
+                {
+                    return false;
+                }
+            }
+            for (const std::shared_ptr<AccelerableObject> &object : added)
+            {
+                _object_index[object.get()] = static_cast<int>(objects.size());
+                objects.push_back(object);
+                _dispatch.Add(object);
+                if (_removed_count > 0)
+                {
+                    _removed.push_back(0);
+                }
+            }
+            BuildInsertAccel();
+            return true;
+        }
+        /// @brief Stop reporting hits on objects[object], it is erased from objects by the next Construct.
+        /// @return False if a static object could not be refit out of the hierarchy, i.e. for the 4-wide layouts. It is then skipped when reached,
+        /// as animated, inserted and spatially split objects always are, until the next Construct.
+        const bool Remove(const int object)
+        {
+            if (IsRemoved(object))
+            {
+                return true;
+            }
+            _removed.resize(objects.size(), 0);
+            _removed[object] = 1;
+            ++_removed_count;
+            _object_index.erase(objects[object].get());
+            if (object < _static_count && _leaf_objects.empty())
+            {
+                return _accel.Refit({object}, [&](const int slot)
+                                    { return ObjectBBox(slot); });
+            }
+            return true;
+        }
+        const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+        {
+            // Only (t, barycentric, index) is tracked during traversal, the closest object fills in the surface attributes afterwards.
+            PrimitiveHit hit;
+            int closest_index = -1;
+            auto test_primitive = [&](const int prim_idx) -> bool
+            {
+                if (IsRemoved(prim_idx))
+                {
+                    return false;
+                }
+                if (_dispatch.Visit(prim_idx, [&](const auto &object)
+                                    { return object.IntersectHit(origin, direction, intersect_info._time, hit); }))
+                {
+                    closest_index = prim_idx;
+                    return true;
+                }
+                return false;
+            };
+// #define DISABLE_BVH
+#ifdef DISABLE_BVH // For debug purposes.
+            for (int i = 0; i < static_cast<int>(objects.size()); ++i)
+            {
+                test_primitive(i);
+            }
+#else
+            // IntersectHit only accepts hits closer than hit._t, which makes it the running t_max of both traversals.
+            _accel.Traverse(origin, direction, hit._t, [&](const int slot) -> bool
+                            { return test_primitive(LeafObject(slot)); });
+            _motion_accel.Traverse(origin, direction, intersect_info._time, hit._t, [&](const int prim_idx) -> bool
+                                   { return test_primitive(_static_count + prim_idx); });
+            _insert_accel.Traverse(origin, direction, hit._t, [&](const int slot) -> bool
+                                   { return test_primitive(InsertedObject(slot)); });
 #endif // DISABLE_BVH
             if (closest_index == -1)
             {
                 return false;
             }
+            _dispatch.Visit(closest_index, [&](const auto &object)
+                            { object.FillIntersectInfo(origin, direction, hit, intersect_info); });
             return true;
         }
+        /// @brief Intersect for the rays of a packet, intersect_info[i] receives the hit of ray i at packet.times[i].
+        /// @return Mask of the rays that hit.
+        const uint32_t Intersect(const RayPacket &packet, IntersectInfo *intersect_info) const
+        {
+            PrimitiveHit hits[MAX_RAY_PACKET_SIZE];
+            int closest_index[MAX_RAY_PACKET_SIZE];
+            float t_max[MAX_RAY_PACKET_SIZE];
+            std::fill(std::begin(closest_index), std::end(closest_index), -1);
+            std::fill(std::begin(t_max), std::end(t_max), std::numeric_limits<float>::infinity());
+            const uint32_t mask = packet.mask();
+            auto test_packet = [&](const int object, const uint32_t lane_mask)
+            {
+                if (IsRemoved(object))
+                {
+                    return;
+                }
+                const uint32_t hit_lanes = _dispatch.Visit(object, [&](const auto &primitive)
+                                                           { return primitive.IntersectHitPacket(packet, lane_mask, hits); });
+                for (uint32_t lanes = hit_lanes; lanes != 0; lanes &= lanes - 1)
+                {
+                    const int lane = std::countr_zero(lanes);
+                    closest_index[lane] = object;
+                    t_max[lane] = hits[lane]._t;
+                }
+            };
+            _accel.TraversePacket(packet, mask, t_max, [&](const int slot, const uint32_t lane_mask)
+                                  { test_packet(LeafObject(slot), lane_mask); });
+            _insert_accel.TraversePacket(packet, mask, t_max, [&](const int slot, const uint32_t lane_mask)
+                                         { test_packet(InsertedObject(slot), lane_mask); });
+            // Animated objects are few, they are tested ray by ray.
+            if (_static_count < _built_count)
+            {
+                for (uint32_t lanes = mask; lanes != 0; lanes &= lanes - 1)
+                {
+                    const int lane = std::countr_zero(lanes);
+                    _motion_accel.Traverse(packet.origins[lane], packet.directions[lane], packet.times[lane], hits[lane]._t, [&](const int prim_idx) -> bool
+                                           {
+                        if (IsRemoved(_static_count + prim_idx))
+                        {
+                            return false;
+                        }
+                        if (_dispatch.Visit(_static_count + prim_idx, [&](const auto &object)
+                                            { return object.IntersectHit(packet.origins[lane], packet.directions[lane], packet.times[lane], hits[lane]); }))
+                        {
+                            closest_index[lane] = _static_count + prim_idx;
+                            return true;
+                        }
+                        return false; });
+                }
+            }
+            uint32_t hit_mask = 0;
+            for (uint32_t lanes = mask; lanes != 0; lanes &= lanes - 1)
+            {
+                const int lane = std::countr_zero(lanes);
+                if (closest_index[lane] != -1)
+                {
+                    intersect_info[lane]._time = packet.times[lane];
+                    _dispatch.Visit(closest_index[lane], [&](const auto &object)
+                                    { object.FillIntersectInfo(packet.origins[lane], packet.directions[lane], hits[lane], intersect_info[lane]); });
+                    hit_mask |= 1u << lane;
+                }
+            }
+            return hit_mask;
+        }
+        /// @brief Whether any object occludes the ray within (0, t_max), stops at the first occluder found.
+        const bool Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time = 0.0f) const
+        {
+            float t_cull = t_max;
+            auto test_object = [&](const int index) -> bool
+            {
+                return !IsRemoved(index) && _dispatch.Visit(index, [&](const auto &object)
+                                                            { return object.Occluded(origin, direction, t_max, time); });
+            };
+            return _accel.Traverse<true>(origin, direction, t_cull, [&](const int slot) -> bool
+                                         { return test_object(LeafObject(slot)); }) ||
+                   _motion_accel.Traverse<true>(origin, direction, time, t_cull, [&](const int prim_idx) -> bool
+                                                { return test_object(_static_count + prim_idx); }) ||
+                   _insert_accel.Traverse<true>(origin, direction, t_cull, [&](const int slot) -> bool
+                                                { return test_object(InsertedObject(slot)); });
+        }
     };
-#endif // USE_EXT_BVH
-}
\ No newline at end of file
+}
@@ -0,0 +1,214 @@
+#include <filesystem>
+#include <random>
+
+#include "bvhcache.h"
+#include "accelerate.h"
+#include "logger.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif // _WIN32
+
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ull;
+
+// 64-bit FNV-1a.
+static void HashBytes(const void *data, const size_t size, uint64_t &hash)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+}
+
+template <typename T>
+static void HashValue(const T &value, uint64_t &hash)
+{
+    HashBytes(&value, sizeof(T), hash);
+}
+
+const bool rendertoy::ComputeBVHCacheKey(const std::string &source_path, const BVHConfig &bvh_config, uint64_t &key)
+{
+    std::ifstream source(source_path, std::ios::binary);
+    if (!source)
+    {
+        return false;
+    }
+    key = FNV_OFFSET_BASIS;
+    std::vector<char> buffer(1 << 20);
+    while (source)
+    {
+        source.read(buffer.data(), buffer.size());
+        HashBytes(buffer.data(), static_cast<size_t>(source.gcount()), key);
+    }
+
+    // Everything that changes the cached data goes into the key, the cache switch itself does not.
+    HashValue(BVH_CACHE_VERSION, key);
+    HashValue(static_cast<int>(bvh_config.layout), key);
+    HashValue(bvh_config.reorder_vertices, key);
+    HashValue(bvh_config.spatial_splits, key);
+    if (bvh_config.spatial_splits)
+    {
+        HashValue(bvh_config.spatial_split_budget, key);
+    }
+#ifdef USE_EXT_BVH
+    HashValue(uint8_t(1), key);
+#else
+    HashValue(uint8_t(0), key);
+#endif // USE_EXT_BVH
+    return true;
+}
+
+// Unique per writer, jobs importing the same file at once must not write into one temporary file.
+static const std::string MakeTempPath(const std::string &path)
+{
+#ifdef _WIN32
+    const int pid = _getpid();
+#else
+    const int pid = static_cast<int>(getpid());
+#endif // _WIN32
+    std::random_device random;
+    return path + ".tmp." + std::to_string(pid) + "." + std::to_string(random());
+}
+
+rendertoy::BVHCacheWriter::BVHCacheWriter(const std::string &path)
+    : _path(path), _temp_path(MakeTempPath(path)), _file(_temp_path, std::ios::binary | std::ios::trunc), _checksum(FNV_OFFSET_BASIS)
+{
+}
+
+void rendertoy::BVHCacheWriter::WriteBytes(const void *data, const size_t size)
+{
+    HashBytes(data, size, _checksum);
+    _file.write(static_cast<const char *>(data), size);
+}
+
+rendertoy::BVHCacheWriter::~BVHCacheWriter()
+{
+    // A writer that has not been committed leaves no file behind.
+    if (_file.is_open())
+    {
+        _file.close();
+        std::error_code ec;
+        std::filesystem::remove(_temp_path, ec);
+    }
+}
+
+const bool rendertoy::BVHCacheWriter::Commit()
+{
+    _file.write(reinterpret_cast<const char *>(&_checksum), sizeof(_checksum));
+    _file.close();
+    if (_file.fail())
+    {
+        std::error_code ec;
+        std::filesystem::remove(_temp_path, ec);
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(_temp_path, _path, ec);
+    if (ec)
+    {
+        std::filesystem::remove(_temp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+rendertoy::BVHCacheReader::BVHCacheReader(const std::string &path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+    {
+        CloseHandle(file);
+        return;
+    }
+    const void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return;
+    }
+    _file_handle = file;
+    _mapping_handle = mapping;
+    _data = static_cast<const char *>(data);
+    _size = static_cast<size_t>(file_size.QuadPart);
+    _mapped_size = _size;
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+    void *data = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return;
+    }
+    _data = static_cast<const char *>(data);
+    _size = static_cast<size_t>(file_stat.st_size);
+    _mapped_size = _size;
+#endif // _WIN32
+}
+
+rendertoy::BVHCacheReader::~BVHCacheReader()
+{
+    if (!_data)
+    {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(_data);
+    CloseHandle(_mapping_handle);
+    CloseHandle(_file_handle);
+#else
+    munmap(const_cast<char *>(_data), _mapped_size);
+#endif // _WIN32
+}
+
+const bool rendertoy::BVHCacheReader::VerifyChecksum()
+{
+    uint64_t checksum;
+    if (!_data || _size < sizeof(checksum))
+    {
+        return false;
+    }
+    const size_t payload_size = _size - sizeof(checksum);
+    std::memcpy(&checksum, _data + payload_size, sizeof(checksum));
+    uint64_t hash = FNV_OFFSET_BASIS;
+    HashBytes(_data, payload_size, hash);
+    if (hash != checksum)
+    {
+        return false;
+    }
+    _size = payload_size;
+    return true;
+}
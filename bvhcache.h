@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "rendertoy_internal.h"
+
+namespace rendertoy
+{
+    struct BVHConfig;
+
+    /// @brief Cache files are stored next to the source file, with this suffix appended.
+    const std::string BVH_CACHE_EXTENSION = ".rtbvh";
+    constexpr uint32_t BVH_CACHE_MAGIC = 0x43425452; // "RTBC"
+    /// @brief Bump whenever the layout of any cached structure or the import pipeline changes, older caches are then rebuilt.
+    constexpr uint32_t BVH_CACHE_VERSION = 4;
+
+    /// @brief Key of a cached mesh file, from the content of the source file, the build settings and the BVH implementation.
+    /// @return false if the source file could not be read.
+    const bool ComputeBVHCacheKey(const std::string &source_path, const BVHConfig &bvh_config, uint64_t &key);
+
+    /// @brief Sequential writer of a cache file. Arrays are stored as their element count followed by the raw elements,
+    /// the file ends with a checksum of everything before it.
+    /// @note Every writer writes to a temporary file of its own, which Commit moves into place.
+    /// Concurrent readers never see a partial cache, and of concurrent writers of one path the last to commit wins.
+    class BVHCacheWriter
+    {
+    private:
+        std::string _path;
+        std::string _temp_path;
+        std::ofstream _file;
+        uint64_t _checksum;
+
+        void WriteBytes(const void *data, const size_t size);
+
+    public:
+        explicit BVHCacheWriter(const std::string &path);
+        BVHCacheWriter(const BVHCacheWriter &) = delete;
+        ~BVHCacheWriter();
+
+        const bool good() const
+        {
+            return _file.good();
+        }
+        template <typename T>
+        void Write(const T &value)
+        {
+            static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable values can be cached.");
+            WriteBytes(&value, sizeof(T));
+        }
+        template <typename T>
+        void WriteArray(const std::vector<T> &values)
+        {
+            static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable values can be cached.");
+            Write(static_cast<uint64_t>(values.size()));
+            WriteBytes(values.data(), sizeof(T) * values.size());
+        }
+        /// @brief Append the checksum and move the file to its final path.
+        const bool Commit();
+    };
+
+    /// @brief Reader of a cache file, the file is memory-mapped and arrays are copied out of the mapping in one go.
+    class BVHCacheReader
+    {
+    private:
+        const char *_data = nullptr;
+        size_t _size = 0; // Readable bytes, the checksum is excluded once verified.
+        size_t _mapped_size = 0;
+        size_t _cursor = 0;
+#ifdef _WIN32
+        void *_file_handle = nullptr;
+        void *_mapping_handle = nullptr;
+#endif // _WIN32
+
+    public:
+        explicit BVHCacheReader(const std::string &path);
+        BVHCacheReader(const BVHCacheReader &) = delete;
+        ~BVHCacheReader();
+
+        const bool good() const
+        {
+            return _data != nullptr;
+        }
+        /// @brief Check the payload against the checksum at the end of the file, which later reads then no longer reach.
+        /// @note Array lengths are bounded by the file size, but their contents are trusted, a damaged file has to be caught here.
+        const bool VerifyChecksum();
+        template <typename T>
+        const bool Read(T &value)
+        {
+            static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable values can be cached.");
+            if (!_data || _size - _cursor < sizeof(T))
+            {
+                return false;
+            }
+            std::memcpy(&value, _data + _cursor, sizeof(T));
+            _cursor += sizeof(T);
+            return true;
+        }
+        template <typename T>
+        const bool ReadArray(std::vector<T> &values)
+        {
+            static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable values can be cached.");
+            uint64_t count;
+            if (!Read(count) || count > (_size - _cursor) / sizeof(T))
+            {
+                return false;
+            }
+            values.resize(count);
+            if (count > 0)
+            {
+                std::memcpy(values.data(), _data + _cursor, sizeof(T) * count);
+            }
+            _cursor += sizeof(T) * count;
+            return true;
+        }
+    };
+}
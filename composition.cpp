@@ -120,38 +120,103 @@ void rendertoy::Image::PixelShadeSSAA(const rendertoy::PixelShaderSSAA &shader,
 #endif // DISABLE_PARALLEL
 }
 
-void rendertoy::Image::RayTrace(const RayTracingShader &shader, const int x_sample, const int y_sample, const int spp, const float max_noise_tolerance)
+void rendertoy::Image::PixelShadeSSAA(const rendertoy::PacketPixelShaderSSAA &shader, const int x_sample, const int y_sample, const int packet_size)
 {
-// #define DISABLE_PARALLEL
-#ifdef DISABLE_PARALLEL
-    for (int x = 0; x < _width; ++x)
+    // Samples are gathered pixel after pixel along y, so that a packet covers a few neighbouring pixels.
+    auto shade_range = [&](const int x_begin, const int x_end, const int y_begin, const int y_end)
     {
-        for (int y = 0; y < _height; ++y)
+        std::vector<glm::vec2> screen_coords;
+        std::vector<glm::vec4 *> targets;
+        std::vector<glm::vec4> colors(packet_size);
+        screen_coords.reserve(packet_size);
+        targets.reserve(packet_size);
+        auto flush = [&]()
         {
-#else
-    tbb::parallel_for(tbb::blocked_range2d<int>(0, _width, 0, _height), [&](const tbb::blocked_range2d<int> &r)
-                      {
-        for (int x = r.rows().begin(); x < r.rows().end(); ++x)
+            shader(static_cast<int>(screen_coords.size()), screen_coords.data(), colors.data());
+            for (size_t i = 0; i < screen_coords.size(); ++i)
+            {
+                *targets[i] += colors[i];
+            }
+            screen_coords.clear();
+            targets.clear();
+        };
+        for (int x = x_begin; x < x_end; ++x)
         {
-            for (int y = r.cols().begin(); y < r.cols().end(); ++y)
+            for (int y = y_begin; y < y_end; ++y)
             {
+                glm::vec4 &pixel = (*this)(x, y);
+                pixel = glm::vec4(0.0f);
+                for (int xx = 0; xx < x_sample; ++xx)
+                {
+                    for (int yy = 0; yy < y_sample; ++yy)
+                    {
+                        glm::vec2 pixel_offset((static_cast<float>(xx) + 0.5f) / static_cast<float>(x_sample),
+                                               (static_cast<float>(yy) + 0.5f) / static_cast<float>(x_sample));
+                        screen_coords.push_back(glm::vec2((static_cast<float>(x) + pixel_offset.x) / static_cast<float>(_width), (static_cast<float>(y) + pixel_offset.y) / static_cast<float>(_height)));
+                        targets.push_back(&pixel);
+                        if (static_cast<int>(screen_coords.size()) == packet_size)
+                        {
+                            flush();
+                        }
+                    }
+                }
+            }
+        }
+        if (!screen_coords.empty())
+        {
+            flush();
+        }
+        for (int x = x_begin; x < x_end; ++x)
+        {
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                (*this)(x, y) *= 1.0f / (static_cast<float>(x_sample) * static_cast<float>(y_sample));
+            }
+        }
+    };
+#ifdef DISABLE_PARALLEL
+    shade_range(0, _width, 0, _height);
+#else
+    tbb::parallel_for(tbb::blocked_range2d<int>(0, _width, 0, _height), [&](const tbb::blocked_range2d<int> &r)
+                      { shade_range(r.rows().begin(), r.rows().end(), r.cols().begin(), r.cols().end()); });
 #endif // DISABLE_PARALLEL
-            glm::vec3 contribution(0.0f);
-            glm::vec3 ret(0.0f);
-            float luminance_sum = 0.0f;
-            float luminance2_sum = 0.0f;
-            int sample_count = 0;
-            for (int xx = 0; xx < x_sample; ++xx)
+}
+
+void rendertoy::Image::RayTrace(const RayTracingShader &shader, const int x_sample, const int y_sample, const int spp, const float max_noise_tolerance)
+{
+    PacketRayTracingShader packet_shader = [&](const glm::vec2 &screen_coord, const int count, glm::vec3 *radiance)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            radiance[i] = shader(screen_coord);
+        }
+    };
+    RayTrace(packet_shader, x_sample, y_sample, spp, max_noise_tolerance, 1);
+}
+
+void rendertoy::Image::RayTrace(const PacketRayTracingShader &shader, const int x_sample, const int y_sample, const int spp, const float max_noise_tolerance, const int packet_size)
+{
+    auto trace_pixel = [&](const int x, const int y, glm::vec3 *radiance)
+    {
+        glm::vec3 contribution(0.0f);
+        float luminance_sum = 0.0f;
+        float luminance2_sum = 0.0f;
+        int sample_count = 0;
+        for (int xx = 0; xx < x_sample; ++xx)
+        {
+            for (int yy = 0; yy < y_sample; ++yy)
             {
-                for (int yy = 0; yy < y_sample; ++yy)
-                {
-                    glm::vec2 pixel_offset((static_cast<float>(xx) + 0.5f) / static_cast<float>(x_sample),
-                                           (static_cast<float>(yy) + 0.5f) / static_cast<float>(x_sample));
-                    glm::vec2 screen_coord((static_cast<float>(x) + pixel_offset.x) / static_cast<float>(_width), (static_cast<float>(y) + pixel_offset.y) / static_cast<float>(_height));
+                glm::vec2 pixel_offset((static_cast<float>(xx) + 0.5f) / static_cast<float>(x_sample),
+                                       (static_cast<float>(yy) + 0.5f) / static_cast<float>(x_sample));
+                glm::vec2 screen_coord((static_cast<float>(x) + pixel_offset.x) / static_cast<float>(_width), (static_cast<float>(y) + pixel_offset.y) / static_cast<float>(_height));
 
-                    for (int i = 0; i < spp; ++i)
+                for (int first = 0; first < spp; first += packet_size)
+                {
+                    const int count = std::min(packet_size, spp - first);
+                    shader(screen_coord, count, radiance);
+                    for (int i = first; i < first + count; ++i)
                     {
-                        ret = shader(screen_coord);
+                        const glm::vec3 &ret = radiance[i - first];
                         contribution += ret;
 #define ENABLE_ADAPTIVE_SAMPLING
 #ifdef ENABLE_ADAPTIVE_SAMPLING
@@ -166,6 +231,7 @@ void rendertoy::Image::RayTrace(const RayTracingShader &shader, const int x_samp
                             float I = 1.96f * std::sqrt(sigma2 / (i + 1));
                             if (I <= max_noise_tolerance * mu)
                             {
+                                // The rest of the packet is dropped, as if it had never been traced.
                                 ++sample_count;
                                 goto ADAPTIVE_SAMPLING_TERMINATION;
                             }
@@ -175,18 +241,33 @@ void rendertoy::Image::RayTrace(const RayTracingShader &shader, const int x_samp
                     }
                 }
             }
-        ADAPTIVE_SAMPLING_TERMINATION:
-            (*this)(x, y) = glm::vec4(contribution * (1.0f / static_cast<float>(sample_count)), 1.0f);
-#ifndef DISABLE_PARALLEL
+        }
+    ADAPTIVE_SAMPLING_TERMINATION:
+        (*this)(x, y) = glm::vec4(contribution * (1.0f / static_cast<float>(sample_count)), 1.0f);
+    };
+// #define DISABLE_PARALLEL
+#ifdef DISABLE_PARALLEL
+    std::vector<glm::vec3> radiance(packet_size);
+    for (int x = 0; x < _width; ++x)
+    {
+        for (int y = 0; y < _height; ++y)
+        {
+            trace_pixel(x, y, radiance.data());
         }
     }
-});
-}
 #else
+    tbb::parallel_for(tbb::blocked_range2d<int>(0, _width, 0, _height), [&](const tbb::blocked_range2d<int> &r)
+                      {
+        std::vector<glm::vec3> radiance(packet_size);
+        for (int x = r.rows().begin(); x < r.rows().end(); ++x)
+        {
+            for (int y = r.cols().begin(); y < r.cols().end(); ++y)
+            {
+                trace_pixel(x, y, radiance.data());
             }
-        }
+        } });
+#endif // DISABLE_PARALLEL
 }
-#endif
 
 const rendertoy::Image rendertoy::Image::UpScale(const glm::float32 factor) const
 {
@@ -215,16 +296,26 @@ const rendertoy::Image rendertoy::Image::NextMipMap() const
 
 const glm::vec4 rendertoy::Image::Avg() const
 {
-    glm::vec4 ret = glm::vec4(0.0f);
-    for (int x = 0; x < _width; ++x)
-    {
-        for (int y = 0; y < _height; ++y)
+    // 按行并行求和, 每行先求和再合并, 大图也不会因逐像素累加到一个 float 而丢失精度.
+    glm::dvec4 ret = tbb::parallel_reduce(
+        tbb::blocked_range<int>(0, _height), glm::dvec4(0.0),
+        [&](const tbb::blocked_range<int> &r, glm::dvec4 sum)
         {
-            ret += (*this)(x, y);
-        }
-    }
-    ret /= static_cast<float>(_width) * static_cast<float>(_height);
-    return ret;
+            for (int y = r.begin(); y < r.end(); ++y)
+            {
+                glm::vec4 row = glm::vec4(0.0f);
+                for (int x = 0; x < _width; ++x)
+                {
+                    row += _buffer[y * _width + x];
+                }
+                sum += glm::dvec4(row);
+            }
+            return sum;
+        },
+        [](const glm::dvec4 &a, const glm::dvec4 &b)
+        { return a + b; });
+    ret /= static_cast<double>(_width) * static_cast<double>(_height);
+    return glm::vec4(ret);
 }
 
 rendertoy::Canvas::Canvas(int width, int height)
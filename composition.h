@@ -14,6 +14,10 @@ namespace rendertoy
     typedef std::function<glm::vec4(const int, const int)> PixelShader;
     typedef std::function<glm::vec4(const glm::vec2 &)> PixelShaderSSAA;
     typedef std::function<glm::vec3(const glm::vec2 &)> RayTracingShader;
+    /// @brief Shades count samples at once, so that their rays can be traced as a packet.
+    typedef std::function<void(const int count, const glm::vec2 *screen_coords, glm::vec4 *colors)> PacketPixelShaderSSAA;
+    /// @brief Computes count samples of the same screen coordinate at once.
+    typedef std::function<void(const glm::vec2 &screen_coord, const int count, glm::vec3 *radiance)> PacketRayTracingShader;
 
     class Image
     {
@@ -42,7 +46,11 @@ namespace rendertoy
 
         void PixelShade(const PixelShader &shader);
         void PixelShadeSSAA(const PixelShaderSSAA &shader, const int x_sample, const int y_sample);
+        /// @brief PixelShadeSSAA handing the samples of neighbouring pixels to the shader in groups of up to packet_size.
+        void PixelShadeSSAA(const PacketPixelShaderSSAA &shader, const int x_sample, const int y_sample, const int packet_size);
         void RayTrace(const RayTracingShader &shader, const int x_sample, const int y_sample, const int spp, const float max_noise_tolerance);
+        /// @brief RayTrace computing the samples of a pixel in groups of up to packet_size.
+        void RayTrace(const PacketRayTracingShader &shader, const int x_sample, const int y_sample, const int spp, const float max_noise_tolerance, const int packet_size);
 
         const Image UpScale(const glm::float32 factor) const;
         const Image NextMipMap() const;
@@ -0,0 +1,269 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <bit>
+#include <random>
+
+#include "rendertoy.h"
+#include "logger.h"
+
+using namespace rendertoy;
+
+// Traversal throughput benchmark on the gallery scenes.
+// Usage: BVHBench [--wide] [--quantized] [--sbvh] [scene...], where scene is one of final1, final2. Defaults to both.
+// --wide selects the collapsed 4-wide BVH layout for both BVH levels, --quantized the 4-wide layout with quantized child bounds.
+// --sbvh builds the scene with spatial splits. Traversal steps of the default and the spatial split build are compared in any case.
+
+struct BenchScene
+{
+    std::string name;
+    std::string path;
+    glm::vec3 eye;
+    glm::vec3 center;
+    float fov;
+};
+
+static const BenchScene bench_scenes[] = {
+    {"final1", "./final1.obj", glm::vec3{-1.2511f, 0.87042f, 3.0f}, glm::vec3{-1.2511f, 0.97042f, 0.0f}, 37.0f},
+    {"final2", "./final2.obj", glm::vec3{1.2601f, 0.10336f, 1.2215f}, glm::vec3{-1.275f, 0.4832f, -1.424f}, 21.0f},
+};
+
+constexpr int BENCH_WIDTH = 640;
+constexpr int BENCH_HEIGHT = 360;
+constexpr int BENCH_REPEAT = 4;
+constexpr unsigned int BENCH_SEED = 7;
+
+// Traversal steps per ray over all triangles of the scene, with and without spatial splits, in the layout of bvh_config.
+static void CompareSpatialSplits(const std::vector<std::shared_ptr<Primitive>> &objects, const std::vector<glm::vec3> &origins, const std::vector<glm::vec3> &directions, const BVHConfig &bvh_config)
+{
+    std::vector<std::pair<const TriangleMesh *, int>> triangles;
+    for (const auto &object : objects)
+    {
+        if (const TriangleMesh *mesh = dynamic_cast<const TriangleMesh *>(object.get()))
+        {
+            for (int face = 0; face < static_cast<int>(mesh->triangle_count()); ++face)
+            {
+                triangles.emplace_back(mesh, mesh->GetFaceSlot(face));
+            }
+        }
+    }
+    if (triangles.empty())
+    {
+        return;
+    }
+    std::vector<BBox> bboxes(triangles.size());
+    std::vector<glm::vec3> centers(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i)
+    {
+        bboxes[i] = triangles[i].first->GetTriangleBoundingBox(triangles[i].second);
+        centers[i] = triangles[i].first->GetTriangleCenter(triangles[i].second);
+    }
+    PrimitiveSplitter splitter = [&](const int primitive, const int axis, const float position, const BBox &bounds, BBox &left, BBox &right)
+    {
+        triangles[primitive].first->SplitTriangleBounds(triangles[primitive].second, axis, position, bounds, left, right);
+    };
+
+    INFO << "Traversal steps over " << triangles.size() << " triangles:" << std::endl;
+    for (const bool spatial_splits : {false, true})
+    {
+        BVHConfig config = bvh_config;
+        config.spatial_splits = spatial_splits;
+        IndexedBVH accel;
+        std::vector<int> leaf_order;
+        auto build_start = std::chrono::high_resolution_clock::now();
+        accel.Build(bboxes, centers, leaf_order, config, splitter);
+        auto build_end = std::chrono::high_resolution_clock::now();
+
+        TraversalStats stats;
+        int hit_count = 0;
+        for (size_t i = 0; i < origins.size(); ++i)
+        {
+            PrimitiveHit hit;
+            hit_count += accel.TraverseWithStats(origins[i], directions[i], hit._t, [&](const int slot) -> bool
+                                                 {
+                const auto &[mesh, index] = triangles[leaf_order[slot]];
+                return mesh->IntersectTriangle(index, origins[i], directions[i], hit); }, stats) ? 1 : 0;
+        }
+        const double ray_count = static_cast<double>(std::max<size_t>(origins.size(), 1));
+        INFO << "  " << (spatial_splits ? "spatial splits" : "default") << ": build " << std::chrono::duration<double>(build_end - build_start).count() << "s, "
+             << leaf_order.size() << " references, " << accel.NodeBytes() / 1024 << " KiB of nodes, " << hit_count << " hits, "
+             << stats.node_visits / ray_count << " node visits/ray, " << stats.primitive_tests / ray_count << " primitive tests/ray" << std::endl;
+    }
+}
+
+static void RunBenchScene(const BenchScene &bench_scene, const BVHConfig &bvh_config)
+{
+    INFO << "Benchmarking scene " << bench_scene.name << "..." << std::endl;
+    auto ret = ImportMeshFromFile(bench_scene.path, bvh_config);
+    if (ret.empty())
+    {
+        WARN << "Skipping scene " << bench_scene.name << std::endl;
+        return;
+    }
+
+    MeshLayoutStats total_stats;
+    for (const auto &mesh : ret)
+    {
+        total_stats.leaf_count += mesh->layout_stats().leaf_count;
+        total_stats.index_lines_file += mesh->layout_stats().index_lines_file;
+        total_stats.index_lines_leaf += mesh->layout_stats().index_lines_leaf;
+        total_stats.vertex_lines_file += mesh->layout_stats().vertex_lines_file;
+        total_stats.vertex_lines_leaf += mesh->layout_stats().vertex_lines_leaf;
+    }
+    INFO << "Leaves: " << total_stats.leaf_count << ", cache lines touched by all leaves (file order -> leaf order): indices " << total_stats.index_lines_file << " -> " << total_stats.index_lines_leaf
+         << ", vertices " << total_stats.vertex_lines_file << " -> " << total_stats.vertex_lines_leaf << std::endl;
+
+    std::shared_ptr<Scene> scene = std::make_shared<Scene>();
+    scene->bvh_config() = bvh_config;
+    scene->objects().insert(scene->objects().end(), std::make_move_iterator(ret.begin()), std::make_move_iterator(ret.end()));
+    std::shared_ptr<ISamplableColor> tex_white = std::make_shared<ColorTexture>(glm::vec4{1.0f});
+    std::shared_ptr<ISamplableNumerical> diffuse_roughness = std::make_shared<ConstantNumerical>(0.0f);
+    std::shared_ptr<IMaterial> mat_white = std::make_shared<DiffuseBSDF>(tex_white, diffuse_roughness);
+    for (auto &object : scene->objects())
+    {
+        object->mat() = mat_white;
+    }
+
+    auto build_start = std::chrono::high_resolution_clock::now();
+    scene->Init();
+    auto build_end = std::chrono::high_resolution_clock::now();
+    INFO << "Scene::Init took " << std::chrono::duration<double>(build_end - build_start).count() << "s" << std::endl;
+
+    Camera camera(bench_scene.eye, bench_scene.center, glm::vec3{0.0f, 1.0f, 0.0f}, glm::radians(bench_scene.fov), static_cast<float>(BENCH_WIDTH) / static_cast<float>(BENCH_HEIGHT));
+
+    // Primary rays are coherent, secondary rays leave the primary hit points in random directions.
+    std::vector<glm::vec3> primary_origins, primary_directions, secondary_origins, secondary_directions;
+    // Seeded locally, so the secondary rays do not depend on what the renderer draws from the global random stream.
+    std::mt19937 rng(BENCH_SEED);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    primary_origins.reserve(BENCH_WIDTH * BENCH_HEIGHT);
+    primary_directions.reserve(BENCH_WIDTH * BENCH_HEIGHT);
+    for (int y = 0; y < BENCH_HEIGHT; ++y)
+    {
+        for (int x = 0; x < BENCH_WIDTH; ++x)
+        {
+            glm::vec3 origin, direction;
+            camera.SpawnRay(glm::vec2((x + 0.5f) / BENCH_WIDTH, (y + 0.5f) / BENCH_HEIGHT), origin, direction);
+            primary_origins.push_back(origin);
+            primary_directions.push_back(direction);
+        }
+    }
+
+    auto trace = [&](const std::vector<glm::vec3> &origins, const std::vector<glm::vec3> &directions, const bool record_secondary)
+    {
+        int hit_count = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int repeat = 0; repeat < BENCH_REPEAT; ++repeat)
+        {
+            for (size_t i = 0; i < origins.size(); ++i)
+            {
+                IntersectInfo intersect_info;
+                if (scene->Intersect(origins[i], directions[i], intersect_info))
+                {
+                    ++hit_count;
+                    if (record_secondary && repeat == 0)
+                    {
+                        const float x = uniform(rng), y = uniform(rng), z = uniform(rng);
+                        glm::vec3 dir = glm::normalize(glm::vec3(x, y, z));
+                        secondary_origins.push_back(intersect_info._coord);
+                        secondary_directions.push_back(glm::dot(dir, intersect_info._geometry_normal) < 0.0f ? -dir : dir);
+                    }
+                }
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        double mrays = static_cast<double>(origins.size()) * BENCH_REPEAT / seconds * 1e-6;
+        INFO << "  " << origins.size() * BENCH_REPEAT << " rays, " << hit_count << " hits, " << seconds << "s, " << mrays << " Mrays/s" << std::endl;
+    };
+
+    INFO << "Primary rays:" << std::endl;
+    trace(primary_origins, primary_directions, true);
+    // The same primary rays in packets of neighbouring pixels.
+    INFO << "Primary ray packets of " << RAY_PACKET_SIZE << ":" << std::endl;
+    {
+        int hit_count = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int repeat = 0; repeat < BENCH_REPEAT; ++repeat)
+        {
+            for (size_t i = 0; i < primary_origins.size(); i += RAY_PACKET_SIZE)
+            {
+                const int count = static_cast<int>(std::min<size_t>(RAY_PACKET_SIZE, primary_origins.size() - i));
+                IntersectInfo intersect_info[RAY_PACKET_SIZE];
+                hit_count += std::popcount(scene->Intersect(count, &primary_origins[i], &primary_directions[i], intersect_info));
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        INFO << "  " << primary_origins.size() * BENCH_REPEAT << " rays, " << hit_count << " hits, " << seconds << "s, " << static_cast<double>(primary_origins.size()) * BENCH_REPEAT / seconds * 1e-6 << " Mrays/s" << std::endl;
+    }
+    INFO << "Secondary rays:" << std::endl;
+    trace(secondary_origins, secondary_directions, false);
+
+    // The secondary rays again, as occlusion-only shadow rays.
+    INFO << "Shadow rays:" << std::endl;
+    int occluded_count = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int repeat = 0; repeat < BENCH_REPEAT; ++repeat)
+    {
+        for (size_t i = 0; i < secondary_origins.size(); ++i)
+        {
+            occluded_count += scene->Occluded(secondary_origins[i], secondary_directions[i]) ? 1 : 0;
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    INFO << "  " << secondary_origins.size() * BENCH_REPEAT << " rays, " << occluded_count << " occluded, " << seconds << "s, " << static_cast<double>(secondary_origins.size()) * BENCH_REPEAT / seconds * 1e-6 << " Mrays/s" << std::endl;
+
+    std::vector<glm::vec3> step_origins = primary_origins, step_directions = primary_directions;
+    step_origins.insert(step_origins.end(), secondary_origins.begin(), secondary_origins.end());
+    step_directions.insert(step_directions.end(), secondary_directions.begin(), secondary_directions.end());
+    CompareSpatialSplits(scene->objects(), step_origins, step_directions, bvh_config);
+}
+
+int main(int argc, char **argv)
+{
+    INFO << "Welcome to the \'bvhbench\' executable program of RenderToy2!" << std::endl;
+#ifdef USE_EXT_BVH
+    INFO << "BVH implementation: bvh::v2" << std::endl;
+#else
+    INFO << "BVH implementation: native" << std::endl;
+#endif // USE_EXT_BVH
+
+    BVHConfig bvh_config;
+    std::vector<std::string> selected_scenes;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::string(argv[i]) == "--wide")
+        {
+            bvh_config.layout = BVHLayout::WIDE4;
+        }
+        else if (std::string(argv[i]) == "--quantized")
+        {
+            bvh_config.layout = BVHLayout::WIDE4_QUANTIZED;
+        }
+        else if (std::string(argv[i]) == "--sbvh")
+        {
+            bvh_config.spatial_splits = true;
+        }
+        else
+        {
+            selected_scenes.push_back(argv[i]);
+        }
+    }
+    const char *layout_names[] = {"binary", "wide4", "wide4 quantized"};
+    INFO << "BVH layout: " << layout_names[static_cast<int>(bvh_config.layout)] << (bvh_config.spatial_splits ? ", spatial splits" : "") << std::endl;
+
+    for (const BenchScene &bench_scene : bench_scenes)
+    {
+        if (selected_scenes.empty() || std::find(selected_scenes.begin(), selected_scenes.end(), bench_scene.name) != selected_scenes.end())
+        {
+            RunBenchScene(bench_scene, bvh_config);
+        }
+    }
+
+    return 0;
+}
@@ -17,26 +17,18 @@ int main()
     std::shared_ptr<IMaterial> mat_white = std::make_shared<DiffuseBSDF>(tex_white, diffuse_roughness);
 
     std::shared_ptr<Scene> scene = std::make_shared<Scene>();
-    auto sdf_func1 = [](glm::vec3 p) -> float
-    { return glm::length(p) - 1.0f; };
     glm::vec3 b(1.0f, 0.5f, 1.0f);
-    auto sdf_func2 = [&](glm::vec3 p) -> float
-    { glm::vec3 q = glm::abs(p) - b;
-        return glm::length(glm::max(q,0.0f)) + glm::min(glm::max(q.x,glm::max(q.y,q.z)),0.0f); };
     glm::vec2 t(1.0f, 0.3f);
-    auto sdf_func3 = [&](glm::vec3 p) -> float
-    {
-        glm::vec2 q = glm::vec2(glm::length(glm::vec2(p.x, p.y)) - t.x, p.z);
-        return length(q) - t.y;
-    };
-    scene->objects().push_back(std::make_shared<SDF>(SDFSmoothUnion(SDFTranslate(sdf_func1, glm::vec3(0.0f, 1.5f, 0.0f)), SDFRound(sdf_func2)) + SDFTranslate(sdf_func3, glm::vec3(1.0f)),
-                                                     BBox(glm::vec3(-4.0f), glm::vec3(4.0f))));
+    std::shared_ptr<SDF> sdf = std::make_shared<SDF>(SDFSmoothUnion(SDFTranslate(SDFSphere(1.0f), glm::vec3(0.0f, 1.5f, 0.0f)), SDFRound(SDFBox(b))) + SDFTranslate(SDFTorus(t), glm::vec3(1.0f)),
+                                                     BBox(glm::vec3(-4.0f), glm::vec3(4.0f)));
+    sdf->Bake();
+    scene->objects().push_back(sdf);
 
     // scene->inf_lights().push_back(std::make_shared<HDRILight>("./hdri.hdr"));
     scene->inf_lights().push_back(std::make_shared<HDRILight>("./hdri.hdr"));
+    scene->objects()[0]->mat() = mat_white;
     scene->Init();
     INFO << "Scene inited." << std::endl;
-    scene->objects()[0]->mat() = mat_white;
 
     std::shared_ptr<ISamplableColor> hdr_bg = std::make_shared<ColorTexture>(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
     scene->hdr_background() = hdr_bg;
@@ -6,6 +6,7 @@
 #include "composition.h"
 #include "primitive.h"
 #include "logger.h"
+#include "bvhcache.h"
 
 #include <assimp/vector2.h>
 #include <assimp/vector3.h>
@@ -13,12 +14,76 @@
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
-const std::vector<std::shared_ptr<rendertoy::TriangleMesh>> rendertoy::ImportMeshFromFile(const std::string &path)
+static const std::vector<std::shared_ptr<rendertoy::TriangleMesh>> LoadMeshCache(const std::string &cache_path, const uint64_t cache_key)
 {
+    using namespace rendertoy;
+    BVHCacheReader reader(cache_path);
+    uint32_t magic, version;
+    uint64_t key, mesh_count;
+    if (!reader.good() || !reader.Read(magic) || !reader.Read(version) || !reader.Read(key) || !reader.Read(mesh_count) ||
+        magic != BVH_CACHE_MAGIC || version != BVH_CACHE_VERSION || key != cache_key)
+    {
+        return {};
+    }
+    if (!reader.VerifyChecksum())
+    {
+        WARN << "BVH cache " << cache_path << " is damaged, rebuilding." << std::endl;
+        return {};
+    }
     std::vector<std::shared_ptr<TriangleMesh>> ret;
+    for (uint64_t i = 0; i < mesh_count; ++i)
+    {
+        std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>();
+        if (!mesh->LoadCache(reader))
+        {
+            WARN << "BVH cache " << cache_path << " is truncated, rebuilding." << std::endl;
+            return {};
+        }
+        ret.push_back(std::move(mesh));
+    }
+    return ret;
+}
+
+static void SaveMeshCache(const std::string &cache_path, const uint64_t cache_key, const std::vector<std::shared_ptr<rendertoy::TriangleMesh>> &meshes)
+{
+    using namespace rendertoy;
+    BVHCacheWriter writer(cache_path);
+    writer.Write(BVH_CACHE_MAGIC);
+    writer.Write(BVH_CACHE_VERSION);
+    writer.Write(cache_key);
+    writer.Write(static_cast<uint64_t>(meshes.size()));
+    for (const auto &mesh : meshes)
+    {
+        mesh->SaveCache(writer);
+    }
+    if (!writer.Commit())
+    {
+        WARN << "Could not write BVH cache " << cache_path << std::endl;
+        return;
+    }
+    INFO << "BVH cache written to " << cache_path << std::endl;
+}
+
+const std::vector<std::shared_ptr<rendertoy::TriangleMesh>> rendertoy::ImportMeshFromFile(const std::string &path, const BVHConfig &bvh_config)
+{
+    std::vector<std::shared_ptr<TriangleMesh>> ret;
+
+    // Meshes built by an earlier run are restored from the cache, skipping both Assimp and the BVH build.
+    const std::string cache_path = path + BVH_CACHE_EXTENSION;
+    uint64_t cache_key = 0;
+    const bool use_cache = bvh_config.use_disk_cache && ComputeBVHCacheKey(path, bvh_config, cache_key);
+    if (use_cache)
+    {
+        ret = LoadMeshCache(cache_path, cache_key);
+        if (!ret.empty())
+        {
+            INFO << "Loaded " << ret.size() << " mesh(es) of " << path << " from BVH cache " << cache_path << std::endl;
+            return ret;
+        }
+    }
 
     Assimp::Importer importer;
-    const auto scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenBoundingBoxes);
+    const auto scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_GenBoundingBoxes);
 
     if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
     {
@@ -35,23 +100,44 @@ const std::vector<std::shared_ptr<rendertoy::TriangleMesh>> rendertoy::ImportMes
         aiVector3D *uvs = mesh->mTextureCoords[0]; // TODO: UV information may not be stored in channel 0.
         auto norms = mesh->mNormals; // TODO: exception handling.
         std::shared_ptr<TriangleMesh> tmp = std::make_shared<TriangleMesh>();
+        tmp->_positions.resize(mesh->mNumVertices);
+        tmp->_normals.resize(mesh->mNumVertices, glm::vec3(0.0f));
+        tmp->_uvs.resize(mesh->mNumVertices, glm::vec2(0.0f));
+        for (unsigned int j = 0; j < mesh->mNumVertices; ++j)
+        {
+            tmp->_positions[j] = glm::vec3(vertices[j].x, vertices[j].y, vertices[j].z);
+            if (norms)
+                tmp->_normals[j] = glm::vec3(norms[j].x, norms[j].y, norms[j].z);
+            if (uvs)
+                tmp->_uvs[j] = glm::vec2(uvs[j].x, uvs[j].y);
+        }
+        tmp->_indices.reserve(mesh->mNumFaces);
         for (unsigned int j = 0; j < mesh->mNumFaces; ++j)
         {
-            tmp->_triangles.objects.push_back(std::make_shared<Triangle>(vertices[mesh->mFaces[j].mIndices[0]], vertices[mesh->mFaces[j].mIndices[1]], vertices[mesh->mFaces[j].mIndices[2]],
-                                                                        aiVector2D(uvs[mesh->mFaces[j].mIndices[0]].x, uvs[mesh->mFaces[j].mIndices[0]].y),
-                                                                        aiVector2D(uvs[mesh->mFaces[j].mIndices[1]].x, uvs[mesh->mFaces[j].mIndices[1]].y),
-                                                                        aiVector2D(uvs[mesh->mFaces[j].mIndices[2]].x, uvs[mesh->mFaces[j].mIndices[2]].y),
-                                                                        norms[mesh->mFaces[j].mIndices[0]],
-                                                                        norms[mesh->mFaces[j].mIndices[1]],
-                                                                        norms[mesh->mFaces[j].mIndices[2]]));
+            const aiFace &face = mesh->mFaces[j];
+            if (face.mNumIndices != 3)
+            {
+                continue; // Points and lines are left over by aiProcess_Triangulate.
+            }
+            tmp->_indices.emplace_back(face.mIndices[0], face.mIndices[1], face.mIndices[2]);
         }
-        INFO << "Mesh " << i << " has " << mesh->mNumFaces << " faces. Now constructing BVH." << std::endl;
+        INFO << "Mesh " << i << " has " << tmp->_indices.size() << " faces and " << mesh->mNumVertices << " vertices. Now constructing BVH." << std::endl;
         auto aabb = mesh->mAABB;
         tmp->_bbox = BBox(glm::vec3(aabb.mMin.x, aabb.mMin.y, aabb.mMin.z), glm::vec3(aabb.mMax.x, aabb.mMax.y, aabb.mMax.z));
-        tmp->_triangles.Construct();
+        tmp->ConstructBVH(bvh_config);
+        const MeshLayoutStats &stats = tmp->layout_stats();
+        if (stats.leaf_count > 0)
+        {
+            INFO << "Mesh " << i << " cache lines per leaf (file order -> leaf order): indices " << static_cast<float>(stats.index_lines_file) / stats.leaf_count << " -> " << static_cast<float>(stats.index_lines_leaf) / stats.leaf_count
+                 << ", vertices " << static_cast<float>(stats.vertex_lines_file) / stats.leaf_count << " -> " << static_cast<float>(stats.vertex_lines_leaf) / stats.leaf_count << std::endl;
+        }
         ret.push_back(std::move(tmp));
     }
 
+    if (use_cache && !ret.empty())
+    {
+        SaveMeshCache(cache_path, cache_key, ret);
+    }
     return ret;
 }
 
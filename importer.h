@@ -5,10 +5,11 @@
 #include <memory>
 
 #include "rendertoy_internal.h"
+#include "accelerate.h"
 
 namespace rendertoy
 {
-    const std::vector<std::shared_ptr<TriangleMesh>> ImportMeshFromFile(const std::string &path);
+    const std::vector<std::shared_ptr<TriangleMesh>> ImportMeshFromFile(const std::string &path, const BVHConfig &bvh_config = {});
 
     const Image ImportImageFromFile(const std::string &path);
 }
\ No newline at end of file
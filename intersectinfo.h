@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <limits>
 
 #include "rendertoy_internal.h"
 
@@ -14,13 +15,21 @@ namespace rendertoy
         glm::float32 _t;
         glm::vec3 _geometry_normal;
         glm::vec3 _shading_normal;
-        std::shared_ptr<IMaterial> _mat;
+        int _mat_id = -1; // Index into the material table of the scene, resolved with Scene::material at shading time.
         Primitive *_primitive;
         glm::float32 _time = 0.0f;
 
         const glm::mat3 GenerateSurfaceCoordinates() const;
     };
 
+    /// @brief Minimal closest-hit record kept during traversal, surface attributes are only computed for the final hit.
+    struct PrimitiveHit
+    {
+        glm::float32 _t = std::numeric_limits<float>::infinity();
+        glm::vec2 _barycentric = glm::vec2(0.0f); // (u, v) weights of the second and third vertex for triangles.
+        int _index = -1;                          // Sub-primitive index, e.g. the triangle of a mesh.
+    };
+
     struct VolumeInteraction
     {
         glm::vec3 _wo;
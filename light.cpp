@@ -1,6 +1,8 @@
 #include <cmath>
 #include <numeric>
 #include <span>
+#include <bit>
+#include <tbb/tbb.h>
 
 #include "light.h"
 #include "primitive.h"
@@ -10,6 +12,9 @@
 #include "color.h"
 #include "importer.h"
 
+// Shadow rays towards area lights stop this far before the sampled point.
+constexpr float SHADOW_RAY_EPSILON = 1e-4f;
+
 const glm::vec3 rendertoy::SurfaceLight::Sample_Ld(const Scene &scene, const IntersectInfo &intersect_info, float &pdf, glm::vec3 &direction, const bool consider_normal, bool &do_heuristic) const
 {
     do_heuristic = true;
@@ -17,19 +22,18 @@ const glm::vec3 rendertoy::SurfaceLight::Sample_Ld(const Scene &scene, const Int
     glm::vec3 coord;
     glm::vec3 dir;
     glm::vec3 light_normal;
-    _surface_primitive->GenerateSamplePointOnSurface(uv, coord, light_normal);
+    if (!_surface_primitive->SampleSolidAngle(intersect_info._coord, uv, coord, light_normal, pdf))
+    {
+        return glm::vec3(0.0f);
+    }
     dir = coord - intersect_info._coord;
-    float projected_area = std::abs(glm::dot(light_normal, dir) * _surface_primitive->GetArea());
-    if ((consider_normal && glm::dot(dir, intersect_info._geometry_normal) < 0.0f) || std::abs(projected_area) < 1e-4)
+    if (consider_normal && glm::dot(dir, intersect_info._geometry_normal) < 0.0f)
     {
         return glm::vec3(0.0f);
     }
-    pdf = glm::dot(dir, dir) / projected_area;
     glm::vec3 normalized_dir = glm::normalize(dir);
-    IntersectInfo shadow_ray_intersect_info;
-    shadow_ray_intersect_info._time = intersect_info._time;
-    scene.Intersect(intersect_info._coord, normalized_dir, shadow_ray_intersect_info);
-    if (std::abs(shadow_ray_intersect_info._t - glm::length(dir)) > 1e-4f)
+    // Stop just short of the light, otherwise the light surface itself would count as an occluder.
+    if (scene.Occluded(intersect_info._coord, normalized_dir, glm::length(dir) - SHADOW_RAY_EPSILON, intersect_info._time))
     {
         return glm::vec3(0.0f);
     }
@@ -45,18 +49,14 @@ const glm::vec3 rendertoy::SurfaceLight::Sample_Ld(const Scene &scene, const glm
     glm::vec3 coord;
     glm::vec3 dir;
     glm::vec3 light_normal;
-    _surface_primitive->GenerateSamplePointOnSurface(uv, coord, light_normal);
-    dir = coord - view_point;
-    float projected_area = std::abs(glm::dot(light_normal, dir) * _surface_primitive->GetArea());
-    if (std::abs(projected_area) < 1e-4f)
+    if (!_surface_primitive->SampleSolidAngle(view_point, uv, coord, light_normal, pdf))
     {
         return glm::vec3(0.0f);
     }
-    pdf = glm::dot(dir, dir) / projected_area;
+    dir = coord - view_point;
     glm::vec3 normalized_dir = glm::normalize(dir);
-    IntersectInfo shadow_ray_intersect_info; // TODO: 时间同步
-    scene.Intersect(view_point, normalized_dir, shadow_ray_intersect_info);
-    if (std::abs(shadow_ray_intersect_info._t - glm::length(dir)) > 1e-4f)
+    // TODO: 时间同步
+    if (scene.Occluded(view_point, normalized_dir, glm::length(dir) - SHADOW_RAY_EPSILON))
     {
         return glm::vec3(0.0f);
     }
@@ -78,16 +78,80 @@ const float rendertoy::SurfaceLight::Phi() const
 
 rendertoy::LightSampler::LightSampler(const std::vector<std::shared_ptr<Light>> &dls_lights)
 {
-    std::vector<float> light_power(dls_lights.size());
-    for (size_t i = 0; i < dls_lights.size(); ++i)
+    _size = static_cast<int>(dls_lights.size());
+    _capacity = static_cast<int>(std::bit_ceil(std::max<size_t>(dls_lights.size(), 1)));
+    _tree.assign(2 * static_cast<size_t>(_capacity), 0.0f);
+    tbb::parallel_for(0, _size, [&](const int i)
+                      { _tree[_capacity + i] = dls_lights[i]->Phi(); });
+    for (int node = _capacity - 1; node > 0; --node)
+    {
+        _tree[node] = _tree[2 * node] + _tree[2 * node + 1];
+    }
+}
+
+void rendertoy::LightSampler::SetLeaf(const int index, const float power)
+{
+    int node = _capacity + index;
+    _tree[node] = power;
+    // 由子节点重新求和而不是累加差值, 多次更新后也不会积累误差.
+    for (node /= 2; node > 0; node /= 2)
+    {
+        _tree[node] = _tree[2 * node] + _tree[2 * node + 1];
+    }
+}
+
+const int rendertoy::LightSampler::Sample(float *pmf) const
+{
+    if (_size == 0)
     {
-        light_power[i] = dls_lights[i]->Phi();
+        return 0;
     }
-    if (std::accumulate(light_power.begin(), light_power.end(), 0.f) == 0.f)
+    const float total = _tree[1];
+    if (!(total > 0.0f))
     {
-        std::fill(light_power.begin(), light_power.end(), 1.f);
+        *pmf = 1.0f / _size;
+        return std::min(static_cast<int>(glm::linearRand<float>(0.0f, 1.0f) * _size), _size - 1);
     }
-    alias_table = AliasTable(light_power);
+    float u = glm::linearRand<float>(0.0f, 1.0f) * total;
+    int node = 1;
+    while (node < _capacity)
+    {
+        const int left = 2 * node;
+        // Rounding may leave u past the left sum with nothing on the right, never descend into a zero-power subtree.
+        if (u < _tree[left] || _tree[left + 1] <= 0.0f)
+        {
+            node = left;
+        }
+        else
+        {
+            u -= _tree[left];
+            node = left + 1;
+        }
+    }
+    *pmf = _tree[node] / total;
+    return node - _capacity;
+}
+
+void rendertoy::LightSampler::Push(const float power)
+{
+    if (_size == _capacity)
+    {
+        // 容量翻倍, 旧叶节点整体搬到新的叶层再重建内部节点.
+        std::vector<float> tree(4 * static_cast<size_t>(_capacity), 0.0f);
+        std::copy(_tree.begin() + _capacity, _tree.begin() + _capacity + _size, tree.begin() + 2 * _capacity);
+        _capacity *= 2;
+        _tree.swap(tree);
+        for (int node = _capacity - 1; node > 0; --node)
+        {
+            _tree[node] = _tree[2 * node] + _tree[2 * node + 1];
+        }
+    }
+    SetLeaf(_size++, power);
+}
+
+void rendertoy::LightSampler::Pop()
+{
+    SetLeaf(--_size, 0.0f);
 }
 
 const glm::vec3 rendertoy::DeltaLight::Sample_Ld(const Scene &scene, const IntersectInfo &intersect_info, float &pdf, glm::vec3 &direction, const bool consider_normal, bool &do_heuristic) const
@@ -102,10 +166,7 @@ const glm::vec3 rendertoy::DeltaLight::Sample_Ld(const Scene &scene, const Inter
     }
     const glm::vec3 normalized_dir = glm::normalize(dir);
     direction = normalized_dir;
-    IntersectInfo shadow_ray_intersect_info;
-    shadow_ray_intersect_info._time = intersect_info._time;
-    bool intersected = scene.Intersect(intersect_info._coord, normalized_dir, shadow_ray_intersect_info);
-    if (!intersected || (shadow_ray_intersect_info._t - glm::length(dir) > 1e-4f))
+    if (!scene.Occluded(intersect_info._coord, normalized_dir, glm::length(dir), intersect_info._time))
     {
         return _color * _strength / glm::dot(dir, dir);
     }
@@ -120,9 +181,7 @@ const glm::vec3 rendertoy::DeltaLight::Sample_Ld(const Scene &scene, const glm::
     // pdf = glm::dot(dir, dir);
     const glm::vec3 normalized_dir = glm::normalize(dir);
     direction = normalized_dir;
-    IntersectInfo shadow_ray_intersect_info;
-    bool intersected = scene.Intersect(view_point, normalized_dir, shadow_ray_intersect_info);
-    if (!intersected || (shadow_ray_intersect_info._t - glm::length(dir) > 1e-4f))
+    if (!scene.Occluded(view_point, normalized_dir, glm::length(dir)))
     {
         return _color * _strength / glm::dot(dir, dir);
     }
@@ -178,10 +237,7 @@ const glm::vec3 rendertoy::HDRILight::Sample_Ld(const Scene &scene, const Inters
         return glm::vec3(0.0f);
     }
 
-    IntersectInfo shadow_ray_intersect_info;
-    shadow_ray_intersect_info._time = intersect_info._time;
-    bool intersected = scene.Intersect(intersect_info._coord, direction, shadow_ray_intersect_info);
-    if (!intersected)
+    if (!scene.Occluded(intersect_info._coord, direction, std::numeric_limits<float>::infinity(), intersect_info._time))
     {
         return _hdri_map->operator()(int(uv.x * _hdri_map->width()), int(uv.y * _hdri_map->height()));
     }
@@ -204,10 +260,7 @@ const glm::vec3 rendertoy::DirectionalLight::Sample_Ld(const Scene &scene, const
         return glm::vec3(0.0f);
     }
     direction = _direction;
-    IntersectInfo shadow_ray_intersect_info;
-    shadow_ray_intersect_info._time = intersect_info._time;
-    bool intersected = scene.Intersect(intersect_info._coord, _direction, shadow_ray_intersect_info);
-    if (!intersected)
+    if (!scene.Occluded(intersect_info._coord, _direction, std::numeric_limits<float>::infinity(), intersect_info._time))
     {
         return _color * _strength;
     }
@@ -219,9 +272,8 @@ const glm::vec3 rendertoy::DirectionalLight::Sample_Ld(const Scene &scene, const
     do_heuristic = false;
     pdf = 1.0f;
     direction = _direction;
-    IntersectInfo shadow_ray_intersect_info; // TODO: 这一部分代码有bug。
-    bool intersected = scene.Intersect(view_point, _direction, shadow_ray_intersect_info);
-    if (!intersected)
+    // TODO: 这一部分代码有bug。
+    if (!scene.Occluded(view_point, _direction))
     {
         return _color * _strength;
     }
@@ -106,23 +106,37 @@ namespace rendertoy
         }
     };
 
+    /// @brief Picks lights by power from a sum tree, so that single lights can be added, removed or changed in O(log n).
+    /// @note Lights are uniformly picked while the total power is zero.
     class LightSampler
     {
     private:
-        // std::map<std::shared_ptr<Light>, size_t> light_to_index;
-        AliasTable alias_table;
+        int _size = 0;
+        int _capacity = 1;
+        std::vector<float> _tree; // Heap layout, root 1, leaf i at _capacity + i.
+
+        void SetLeaf(const int index, const float power);
 
     public:
         LightSampler(const std::vector<std::shared_ptr<Light>> &dls_lights);
 
-        const int Sample(float *pmf) const
+        const int Sample(float *pmf) const;
+        /// @brief Power of light index changed, e.g. since Phi() of its material changed.
+        void Update(const int index, const float power)
+        {
+            SetLeaf(index, power);
+        }
+        /// @brief Append a light as the next index.
+        void Push(const float power);
+        /// @brief Drop the last index.
+        void Pop();
+        const float power(const int index) const
+        {
+            return _tree[_capacity + index];
+        }
+        const int size() const
         {
-            if (!alias_table.size())
-            {
-                return 0;
-            }
-            int ret = alias_table.Sample(glm::linearRand<float>(0.0f, 1.0f), pmf);
-            return ret;
+            return _size;
         }
     };
 }
\ No newline at end of file
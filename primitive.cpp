@@ -1,313 +1,1650 @@
+#include <bit>
+#include <atomic>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/random.hpp>
+#include <tbb/tbb.h>
 
 #include "primitive.h"
 #include "logger.h"
 #include "material.h"
 #include "texture.h"
+#include "sampler.h"
 
 void rendertoy::TriangleMesh::GetCurrentAnimationState(const float time, glm::quat &rot, glm::vec3 &tran) const
 {
-    float time_factor = (time - _time_from) / (_time_to - _time_from);
-    rot = glm::slerp(_rot_from, _rot_to, time_factor);
-    tran = glm::mix(_tran_from, _tran_to, time_factor);
-}
-
-const bool rendertoy::TriangleMesh::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo &intersect_info) const
-{
-    bool ret;
-    if (_is_animated)
+    if (_motion_keys.empty())
     {
-        glm::quat rot;
-        glm::vec3 tran;
-        GetCurrentAnimationState(intersect_info._time, rot, tran);
-        glm::mat3 _rot = glm::toMat3(rot);
-        glm::vec3 local_origin = glm::transpose(_rot) * origin - glm::transpose(_rot) * tran;
-        glm::vec3 local_dir = glm::transpose(_rot) * direction;
-        ret = _triangles.Intersect(local_origin, local_dir, intersect_info);
+        rot = glm::quat(glm::mat3(1.0f));
+        tran = glm::vec3(0.0f);
+        return;
     }
-    else
+    auto next_key = std::upper_bound(_motion_keys.begin(), _motion_keys.end(), time, [](const float t, const MotionKey &key)
+                                     { return t < key.time; });
+    if (next_key == _motion_keys.begin() || next_key == _motion_keys.end())
     {
-        ret = _triangles.Intersect(origin, direction, intersect_info);
+        const MotionKey &key = next_key == _motion_keys.begin() ? _motion_keys.front() : _motion_keys.back();
+        rot = key.rot;
+        tran = key.tran;
+        return;
     }
-    if (intersect_info._mat == nullptr)
+    const MotionKey &key_from = *(next_key - 1);
+    const MotionKey &key_to = *next_key;
+    float time_factor = (time - key_from.time) / (key_to.time - key_from.time);
+    rot = glm::slerp(key_from.rot, key_to.rot, time_factor);
+    tran = glm::mix(key_from.tran, key_to.tran, time_factor);
+}
+
+void rendertoy::TriangleMesh::GetLocalRay(const float time, const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 &local_origin, glm::vec3 &local_direction) const
+{
+    if (_motion_keys.empty())
     {
-        intersect_info._mat = _mat;
+        local_origin = origin;
+        local_direction = direction;
+        return;
     }
-    if (_mat->bump())
+    glm::quat rot;
+    glm::vec3 tran;
+    GetCurrentAnimationState(time, rot, tran);
+    glm::mat3 _rot = glm::toMat3(rot);
+    local_origin = glm::transpose(_rot) * origin - glm::transpose(_rot) * tran;
+    local_direction = glm::transpose(_rot) * direction;
+}
+
+const bool rendertoy::TriangleMesh::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo &intersect_info) const
+{
+    PrimitiveHit hit;
+    if (!IntersectHit(origin, direction, intersect_info._time, hit))
     {
-        intersect_info._shading_normal += glm::vec3(_mat->bump()->Sample(intersect_info._uv));
-        intersect_info._shading_normal = glm::normalize(intersect_info._shading_normal);
+        return false;
     }
-    return ret;
+    FillIntersectInfo(origin, direction, hit, intersect_info);
+    return true;
 }
 
-void rendertoy::TriangleMesh::Animate(const glm::quat &rot_to, const glm::vec3 &tran_to, const glm::float32 time_from, const glm::float32 time_to)
+const bool rendertoy::TriangleMesh::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const
 {
-    _rot_to = rot_to;
-    _tran_to = tran_to;
-    _time_from = time_from;
-    _time_to = time_to;
-    _is_animated = true;
-
-    // Expand current BVH to contain any rotations
-    float radius = glm::length(_bbox.Diagonal()) / 2.0f;
-    glm::vec3 new_pmin = _bbox.GetCenter() - glm::vec3(radius);
-    glm::vec3 new_pmax = _bbox.GetCenter() + glm::vec3(radius);
-    _bbox = BBox(new_pmin, new_pmax);
+    return IntersectHit(origin, direction, time, hit, _mat.get());
+}
 
-    // Translate the BBox
-    glm::vec3 new_new_pmin = new_pmin + tran_to;
-    glm::vec3 new_new_pmax = new_pmax + tran_to;
+const bool rendertoy::TriangleMesh::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit, const IMaterial *alpha_mat) const
+{
+    glm::vec3 local_origin, local_dir;
+    GetLocalRay(time, origin, direction, local_origin, local_dir);
+    // The local ray keeps the length of the direction, so hit._t bounds the traversal in both spaces.
+    return _triangle_bvh.Traverse(local_origin, local_dir, hit._t, [&](const int triangle_index) -> bool
+                                  { return IntersectTriangleFiltered(triangle_index, local_origin, local_dir, alpha_mat, hit); });
+}
 
-    // Union two BBox
-    _bbox.Union(BBox(new_new_pmin, new_new_pmax));
+const uint32_t rendertoy::TriangleMesh::IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits) const
+{
+    return IntersectHitPacket(packet, mask, hits, _mat.get());
 }
 
-const rendertoy::BBox rendertoy::TriangleMesh::GetBoundingBox() const
+const uint32_t rendertoy::TriangleMesh::IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits, const IMaterial *alpha_mat) const
 {
-    return _bbox;
+    if (!_motion_keys.empty())
+    {
+        // Every ray of the packet may see the mesh at a different pose.
+        uint32_t hit_mask = 0;
+        for (uint32_t lanes = mask; lanes != 0; lanes &= lanes - 1)
+        {
+            const int lane = std::countr_zero(lanes);
+            if (IntersectHit(packet.origins[lane], packet.directions[lane], packet.times[lane], hits[lane], alpha_mat))
+            {
+                hit_mask |= 1u << lane;
+            }
+        }
+        return hit_mask;
+    }
+    float t_max[MAX_RAY_PACKET_SIZE];
+    for (int lane = 0; lane < MAX_RAY_PACKET_SIZE; ++lane)
+    {
+        t_max[lane] = lane < packet.size ? hits[lane]._t : 0.0f;
+    }
+    uint32_t hit_mask = 0;
+    _triangle_bvh.TraversePacket(packet, mask, t_max, [&](const int triangle_index, const uint32_t lane_mask)
+                                 {
+        for (uint32_t lanes = lane_mask; lanes != 0; lanes &= lanes - 1)
+        {
+            const int lane = std::countr_zero(lanes);
+            if (IntersectTriangleFiltered(triangle_index, packet.origins[lane], packet.directions[lane], alpha_mat, hits[lane]))
+            {
+                t_max[lane] = hits[lane]._t;
+                hit_mask |= 1u << lane;
+            }
+        } });
+    return hit_mask;
 }
 
-const glm::vec3 rendertoy::TriangleMesh::GetCenter() const
+void rendertoy::TriangleMesh::FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo &intersect_info) const
 {
-    return _bbox.GetCenter();
+    FillAnimatedIntersectInfo(hit, origin, direction, intersect_info);
+
+    // Emissive meshes report the hit face, so that its SurfaceLight can be found.
+    intersect_info._primitive = _triangles.empty() ? (Primitive *)this : (Primitive *)_triangles[_slot_faces.empty() ? hit._index : _slot_faces[hit._index]].get();
+    intersect_info._mat_id = _mat_id;
+    if (_mat->bump())
+    {
+        intersect_info._shading_normal += glm::vec3(_mat->bump()->Sample(intersect_info._uv));
+        intersect_info._shading_normal = glm::normalize(intersect_info._shading_normal);
+    }
 }
 
-const float rendertoy::TriangleMesh::GetArea() const
+const bool rendertoy::TriangleMesh::Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time) const
 {
-    CRIT << "Not implemented." << std::endl;
-    return 0.0f;
+    return Occluded(origin, direction, t_max, time, _mat.get());
 }
 
-const void rendertoy::TriangleMesh::GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
+const bool rendertoy::TriangleMesh::Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time, const IMaterial *alpha_mat) const
 {
-    int idx = glm::linearRand<int>(0, static_cast<int>(this->triangles().size()) - 1);
-    this->triangles()[idx]->GenerateSamplePointOnSurface(uv, coord, normal);
+    glm::vec3 local_origin, local_dir;
+    GetLocalRay(time, origin, direction, local_origin, local_dir);
+    float t_cull = t_max;
+    return _triangle_bvh.Traverse<true>(local_origin, local_dir, t_cull, [&](const int triangle_index) -> bool
+                                        {
+        PrimitiveHit hit;
+        hit._t = t_max;
+        return IntersectTriangleFiltered(triangle_index, local_origin, local_dir, alpha_mat, hit); });
 }
 
-const bool rendertoy::Triangle::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+const bool rendertoy::TriangleMesh::IntersectTriangleFiltered(const int index, const glm::vec3 &origin, const glm::vec3 &direction, const IMaterial *alpha_mat, PrimitiveHit &hit) const
 {
-    glm::vec3 v0v1 = _vert[1] - _vert[0];
-    glm::vec3 v0v2 = _vert[2] - _vert[0];
-    glm::vec3 pvec = glm::cross(direction, v0v2);
-    glm::float32 det = glm::dot(v0v1, pvec);
-    if (std::abs(det) < 1e-6f)
-        return false;
-    glm::float32 invDet = 1.0f / det;
-    glm::vec3 tvec = origin - _vert[0];
-    glm::float32 u = glm::dot(tvec, pvec) * invDet;
-    if (u < 0.0f || u > 1.0f)
-        return false;
-    glm::vec3 qvec = glm::cross(tvec, v0v1);
-    glm::float32 v = glm::dot(direction, qvec) * invDet;
-    if (v < 0.0f || u + v > 1.0f)
-        return false;
-    glm::float32 t = glm::dot(v0v2, qvec) * invDet;
-    if (t < 1e-3f)
+#ifdef ALPHA_TEST
+    PrimitiveHit candidate = hit;
+    if (!IntersectTriangle(index, origin, direction, candidate))
+    {
         return false;
-    intersect_info._uv = u * _uv[1] + v * _uv[2] + (1 - u - v) * _uv[0];
-    intersect_info._coord = origin + t * direction;
-    intersect_info._t = t;
-    // intersect_info._geometry_normal = glm::normalize(glm::cross(v0v1, v0v2));
-    intersect_info._geometry_normal = u * _norm[1] + v * _norm[2] + (1 - u - v) * _norm[0];
-    intersect_info._shading_normal = intersect_info._geometry_normal;
-    intersect_info._mat = _mat;
-    intersect_info._wo = -direction;
-    intersect_info._primitive = (Primitive *)this;
-    if (glm::dot(intersect_info._geometry_normal, direction) > 0.0f)
+    }
+    const int face = _slot_faces.empty() ? index : _slot_faces[index];
+    if (alpha_mat == _micromap_mat)
     {
-        intersect_info._geometry_normal = -intersect_info._geometry_normal;
+        const MicroOpacity opacity = _micromaps.empty() ? _mesh_opacity : _micromaps[face].Get(OpacityMicromap::MicroTriangleIndex(candidate._barycentric));
+        if (opacity == MicroOpacity::FULLY_TRANSPARENT)
+        {
+            return false;
+        }
+        if (opacity == MicroOpacity::FULLY_OPAQUE)
+        {
+            hit = candidate;
+            return true;
+        }
+    }
+    if (!AlphaTest(alpha_mat, GetTriangleUV(candidate), AlphaTestSample(this, face, origin, direction)))
+    {
+        return false;
     }
+    hit = candidate;
     return true;
+#else
+    return IntersectTriangle(index, origin, direction, hit);
+#endif // ALPHA_TEST
 }
 
-const rendertoy::BBox rendertoy::Triangle::GetBoundingBox() const
+void rendertoy::TriangleMesh::Animate(const glm::quat &rot_to, const glm::vec3 &tran_to, const glm::float32 time_from, const glm::float32 time_to)
 {
-    glm::vec3 pmin = _vert[0], pmax = _vert[0];
-    for (int i = 1; i < 3; ++i)
+    _motion_keys.clear();
+    AddMotionKey(time_from, glm::quat(glm::mat3(1.0f)), glm::vec3(0.0f));
+    AddMotionKey(time_to, rot_to, tran_to);
+}
+
+void rendertoy::TriangleMesh::AddMotionKey(const float time, const glm::quat &rot, const glm::vec3 &tran)
+{
+    auto position = std::lower_bound(_motion_keys.begin(), _motion_keys.end(), time, [](const MotionKey &key, const float t)
+                                     { return key.time < t; });
+    // A key at the time of an existing one replaces it, so that any two keys span a motion segment.
+    if (position != _motion_keys.end() && position->time == time)
     {
-        pmin.x = std::min(_vert[i].x, pmin.x);
-        pmin.y = std::min(_vert[i].y, pmin.y);
-        pmin.z = std::min(_vert[i].z, pmin.z);
+        *position = MotionKey{time, rot, tran};
+        return;
+    }
+    _motion_keys.insert(position, MotionKey{time, rot, tran});
+}
 
-        pmax.x = std::max(_vert[i].x, pmax.x);
-        pmax.y = std::max(_vert[i].y, pmax.y);
-        pmax.z = std::max(_vert[i].z, pmax.z);
+const rendertoy::BBox rendertoy::TriangleMesh::GetAnimatedBoundingBox(const float time) const
+{
+    if (_motion_keys.empty())
+    {
+        return _bbox;
     }
-    return BBox{pmin, pmax};
+    glm::quat rot;
+    glm::vec3 tran;
+    GetCurrentAnimationState(time, rot, tran);
+    const glm::mat3 rot_mat = glm::toMat3(rot);
+    BBox ret;
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        const glm::vec3 p((corner & 1) ? _bbox._pmax.x : _bbox._pmin.x,
+                          (corner & 2) ? _bbox._pmax.y : _bbox._pmin.y,
+                          (corner & 4) ? _bbox._pmax.z : _bbox._pmin.z);
+        const glm::vec3 world_p = rot_mat * p + tran;
+        if (corner == 0)
+        {
+            ret = BBox(world_p, world_p);
+        }
+        else
+        {
+            ret.Union(world_p);
+        }
+    }
+    return ret;
 }
 
-const float rendertoy::Triangle::GetArea() const
+const rendertoy::BBox rendertoy::TriangleMesh::GetBoundingBox() const
 {
-    return glm::length(glm::cross(_vert[1] - _vert[0], _vert[2] - _vert[0])) / 2.0f;
+    if (_motion_keys.size() < 2)
+    {
+        return GetAnimatedBoundingBox(0.0f);
+    }
+    BBox ret = GetAnimatedBoundingBox(_motion_keys.front().time);
+    for (size_t i = 0; i + 1 < _motion_keys.size(); ++i)
+    {
+        BBox bbox_from, bbox_to;
+        GetMotionBoundingBoxes(_motion_keys[i].time, _motion_keys[i + 1].time, bbox_from, bbox_to);
+        ret.Union(bbox_from);
+        ret.Union(bbox_to);
+    }
+    return ret;
 }
 
-const rendertoy::SurfaceLight *rendertoy::Triangle::GetSurfaceLight() const
+const bool rendertoy::TriangleMesh::IsAnimated() const
 {
-    return _surface_light;
+    return _motion_keys.size() >= 2;
 }
 
-const void rendertoy::Triangle::GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
+void rendertoy::TriangleMesh::GetMotionKeyTimes(std::vector<float> &times) const
 {
-    float u = glm::linearRand<float>(0.0f, 1.0f);
-    float v = glm::linearRand<float>(0.0f, 1.0f);
-    if (u + v > 1.0f)
+    for (const MotionKey &key : _motion_keys)
     {
-        u = 1.0f - u;
-        v = 1.0f - v;
+        times.push_back(key.time);
     }
-    coord = u * _vert[1] + v * _vert[2] + (1.0f - u - v) * _vert[0];
-    uv = glm::vec2(u, v);
-    normal = u * _norm[1] + v * _norm[2] + (1.0f - u - v) * _norm[0];
 }
 
-const float rendertoy::Triangle::Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const
+void rendertoy::TriangleMesh::GetMotionBoundingBoxes(const float time_from, const float time_to, BBox &bbox_from, BBox &bbox_to) const
 {
-    float projected_area = std::abs(glm::dot(this->GetNormal(uv), glm::normalize(observation_to_primitive))) * GetArea();
-    if (std::abs(projected_area) < 1e-4)
+    bbox_from = GetAnimatedBoundingBox(time_from);
+    bbox_to = GetAnimatedBoundingBox(time_to);
+    if (!IsAnimated() || time_to <= time_from)
     {
-        return 0.0f;
+        bbox_from.Union(bbox_to);
+        bbox_to = bbox_from;
+        return;
+    }
+
+    // 在区间内均匀采样（并加入区间内的关键帧），扩张两端的包围盒，直到其线性插值覆盖所有采样时刻的包围盒。
+    constexpr int MOTION_BOUNDS_SAMPLES = 16;
+    std::vector<float> sample_times;
+    for (int i = 0; i <= MOTION_BOUNDS_SAMPLES; ++i)
+    {
+        sample_times.push_back(glm::mix(time_from, time_to, static_cast<float>(i) / MOTION_BOUNDS_SAMPLES));
+    }
+    for (const MotionKey &key : _motion_keys)
+    {
+        if (key.time > time_from && key.time < time_to)
+        {
+            sample_times.push_back(key.time);
+        }
+    }
+    std::sort(sample_times.begin(), sample_times.end());
+
+    float max_angle = 0.0f;
+    glm::quat prev_rot;
+    for (size_t i = 0; i < sample_times.size(); ++i)
+    {
+        const float time_factor = (sample_times[i] - time_from) / (time_to - time_from);
+        const BBox sample_bbox = GetAnimatedBoundingBox(sample_times[i]);
+        const glm::vec3 grow_min = glm::max(glm::mix(bbox_from._pmin, bbox_to._pmin, time_factor) - sample_bbox._pmin, glm::vec3(0.0f));
+        const glm::vec3 grow_max = glm::max(sample_bbox._pmax - glm::mix(bbox_from._pmax, bbox_to._pmax, time_factor), glm::vec3(0.0f));
+        bbox_from._pmin -= grow_min;
+        bbox_to._pmin -= grow_min;
+        bbox_from._pmax += grow_max;
+        bbox_to._pmax += grow_max;
+
+        glm::quat rot;
+        glm::vec3 tran;
+        GetCurrentAnimationState(sample_times[i], rot, tran);
+        if (i > 0)
+        {
+            max_angle = std::max(max_angle, 2.0f * std::acos(std::min(1.0f, std::abs(glm::dot(rot, prev_rot)))));
+        }
+        prev_rot = rot;
+    }
+
+    // Between two samples a point rotating around the mesh origin strays at most radius * angle from the interpolated one.
+    float radius = 0.0f;
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        const glm::vec3 p((corner & 1) ? _bbox._pmax.x : _bbox._pmin.x,
+                          (corner & 2) ? _bbox._pmax.y : _bbox._pmin.y,
+                          (corner & 4) ? _bbox._pmax.z : _bbox._pmin.z);
+        radius = std::max(radius, glm::length(p));
     }
-    return glm::dot(observation_to_primitive, observation_to_primitive) / projected_area;
+    const glm::vec3 padding(radius * max_angle);
+    bbox_from = BBox(bbox_from._pmin - padding, bbox_from._pmax + padding);
+    bbox_to = BBox(bbox_to._pmin - padding, bbox_to._pmax + padding);
 }
 
-const glm::vec3 rendertoy::Triangle::GetNormal(const glm::vec2 &uv) const
+const glm::vec3 rendertoy::TriangleMesh::GetCenter() const
 {
-    return uv.x * _norm[1] + uv.y * _norm[2] + (1.0f - uv.x - uv.y) * _norm[0];
+    return GetBoundingBox().GetCenter();
 }
 
-const rendertoy::SurfaceLight *rendertoy::Primitive::GetSurfaceLight() const
+const float rendertoy::TriangleMesh::GetArea() const
 {
-    return nullptr;
+    CRIT << "Not implemented." << std::endl;
+    return 0.0f;
 }
 
-const float rendertoy::Primitive::Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const
+const void rendertoy::TriangleMesh::GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
 {
-    return 0.0f;
+    // Faces are picked uniformly, whatever the number of slots they occupy.
+    int idx = glm::linearRand<int>(0, static_cast<int>(triangle_count()) - 1);
+    GenerateSamplePointOnTriangle(GetFaceSlot(idx), uv, coord, normal);
 }
 
-const glm::vec3 rendertoy::Primitive::GetNormal(const glm::vec2 &uv) const
+/// @brief Density w.r.t. solid angle of a point sampled uniformly on a surface of the given area, seen along observation_to_primitive.
+static const float AreaToSolidAnglePdf(const glm::vec3 &normal, const glm::vec3 &observation_to_primitive, const float area)
 {
-    return glm::vec3(0.0f);
+    const float dist2 = glm::dot(observation_to_primitive, observation_to_primitive);
+    if (dist2 == 0.0f || area <= 0.0f)
+    {
+        return 0.0f;
+    }
+    const float cos_theta = std::abs(glm::dot(normal, observation_to_primitive)) / std::sqrt(dist2);
+    if (cos_theta < 1e-4f)
+    {
+        return 0.0f;
+    }
+    return dist2 / (cos_theta * area);
 }
 
-const bool rendertoy::SDF::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo &intersect_info) const
+// Distinct cache lines touched by the faces of each leaf, summed over all leaves.
+// face_order maps a leaf slot to the face actually read, nullptr means the buffers are already in leaf order.
+static void CountLeafCacheLines(const std::vector<std::pair<int, int>> &leaf_ranges, const std::vector<glm::uvec3> &indices, const std::vector<int> *face_order, size_t &index_lines, size_t &vertex_lines)
 {
-    // Sphere tracing algorithm
+    std::vector<size_t> lines;
+    for (const auto &[first, last] : leaf_ranges)
+    {
+        lines.clear();
+        for (int i = first; i < last; ++i)
+        {
+            const int face = face_order ? (*face_order)[i] : i;
+            lines.push_back(face * sizeof(glm::uvec3) / rendertoy::CACHE_LINE_SIZE);
+        }
+        std::sort(lines.begin(), lines.end());
+        index_lines += std::unique(lines.begin(), lines.end()) - lines.begin();
 
-    float tmin, tmax;
-    if (!this->_bbox.Intersect(origin, direction, tmin, &tmax))
+        lines.clear();
+        for (int i = first; i < last; ++i)
+        {
+            const glm::uvec3 &idx = indices[face_order ? (*face_order)[i] : i];
+            for (int k = 0; k < 3; ++k)
+            {
+                lines.push_back(idx[k] * sizeof(glm::vec3) / rendertoy::CACHE_LINE_SIZE);
+            }
+        }
+        std::sort(lines.begin(), lines.end());
+        vertex_lines += std::unique(lines.begin(), lines.end()) - lines.begin();
+    }
+}
+
+void rendertoy::TriangleMesh::ConstructBVH(const BVHConfig &bvh_config)
+{
+    std::vector<BBox> bboxes(triangle_count());
+    std::vector<glm::vec3> centers(triangle_count());
+    for (int i = 0; i < static_cast<int>(triangle_count()); ++i)
     {
-        return false;
+        bboxes[i] = GetTriangleBoundingBox(i);
+        centers[i] = GetTriangleCenter(i);
     }
+    std::vector<int> leaf_order;
+    _triangle_bvh.Build(bboxes, centers, leaf_order, bvh_config, [this](const int face, const int axis, const float position, const BBox &bounds, BBox &left, BBox &right)
+                        { SplitTriangleBounds(face, axis, position, bounds, left, right); });
 
-    glm::vec3 current_point = origin;
-    float current_sdf = std::numeric_limits<float>::infinity();
-    float marched_distance = 0.0f;
+    const std::vector<std::pair<int, int>> leaf_ranges = _triangle_bvh.LeafRanges();
+    _layout_stats = MeshLayoutStats();
+    _layout_stats.leaf_count = leaf_ranges.size();
+    CountLeafCacheLines(leaf_ranges, _indices, &leaf_order, _layout_stats.index_lines_file, _layout_stats.vertex_lines_file);
 
-    while (true)
+    // Store faces in leaf order, so that each leaf reads a contiguous run of the index buffer.
+    // Faces split by spatial splits are stored once per slot, at the cost of a few duplicated indices.
+    std::vector<glm::uvec3> ordered_indices(leaf_order.size());
+    for (size_t i = 0; i < leaf_order.size(); ++i)
     {
-        current_sdf = _sdf_func(current_point);
-        if (current_sdf < 1e-6f)
+        ordered_indices[i] = _indices[leaf_order[i]];
+    }
+    _slot_faces.clear();
+    _face_slots.clear();
+    if (leaf_order.size() > _indices.size())
+    {
+        _face_slots.assign(_indices.size(), -1);
+        for (int slot = static_cast<int>(leaf_order.size()) - 1; slot >= 0; --slot)
+        {
+            _face_slots[leaf_order[slot]] = slot;
+        }
+        _slot_faces = std::move(leaf_order);
+    }
+    _indices = std::move(ordered_indices);
+    if (bvh_config.reorder_vertices)
+    {
+        ReorderVertices();
+    }
+
+    CountLeafCacheLines(leaf_ranges, _indices, nullptr, _layout_stats.index_lines_leaf, _layout_stats.vertex_lines_leaf);
+}
+
+void rendertoy::TriangleMesh::SaveCache(BVHCacheWriter &writer) const
+{
+    writer.Write(_bbox);
+    writer.Write(_layout_stats);
+    writer.WriteArray(_positions);
+    writer.WriteArray(_normals);
+    writer.WriteArray(_uvs);
+    writer.WriteArray(_indices);
+    writer.WriteArray(_slot_faces);
+    writer.WriteArray(_face_slots);
+    _triangle_bvh.SaveCache(writer);
+}
+
+const bool rendertoy::TriangleMesh::LoadCache(BVHCacheReader &reader)
+{
+    return reader.Read(_bbox) && reader.Read(_layout_stats) &&
+           reader.ReadArray(_positions) && reader.ReadArray(_normals) && reader.ReadArray(_uvs) && reader.ReadArray(_indices) &&
+           reader.ReadArray(_slot_faces) && reader.ReadArray(_face_slots) && _triangle_bvh.LoadCache(reader);
+}
+
+void rendertoy::TriangleMesh::ReorderVertices()
+{
+    // Renumber vertices in order of first use, vertices of neighbouring faces then share cache lines.
+    constexpr unsigned int UNASSIGNED = std::numeric_limits<unsigned int>::max();
+    std::vector<unsigned int> remap(_positions.size(), UNASSIGNED);
+    unsigned int next_vertex = 0;
+    for (glm::uvec3 &idx : _indices)
+    {
+        for (int k = 0; k < 3; ++k)
         {
-            intersect_info._uv = glm::vec2(0.0f);
-            intersect_info._coord = current_point;
-            intersect_info._mat = _mat;
-            intersect_info._wo = -direction;
-            intersect_info._primitive = (Primitive *)this;
-            intersect_info._t = marched_distance;
-            if (_sdf_grad)
-                intersect_info._shading_normal = _sdf_grad->operator()(current_point);
-            else
-                intersect_info._shading_normal = DifferentialGrad(current_point);
-            intersect_info._geometry_normal = intersect_info._shading_normal;
-            if (glm::dot(intersect_info._geometry_normal, direction) > 0.0f)
+            if (remap[idx[k]] == UNASSIGNED)
             {
-                intersect_info._geometry_normal = -intersect_info._geometry_normal;
+                remap[idx[k]] = next_vertex++;
             }
-            intersect_info._coord += 1e-4f * intersect_info._shading_normal;
-            return true;
+            idx[k] = remap[idx[k]];
         }
-        current_point += direction * current_sdf;
-        marched_distance += current_sdf;
-        if (marched_distance >= tmax)
+    }
+
+    // Vertices not referenced by any face are dropped.
+    std::vector<glm::vec3> positions(next_vertex), normals(next_vertex);
+    std::vector<glm::vec2> uvs(next_vertex);
+    for (size_t v = 0; v < remap.size(); ++v)
+    {
+        if (remap[v] != UNASSIGNED)
         {
-            return false;
+            positions[remap[v]] = _positions[v];
+            normals[remap[v]] = _normals[v];
+            uvs[remap[v]] = _uvs[v];
         }
     }
+    _positions = std::move(positions);
+    _normals = std::move(normals);
+    _uvs = std::move(uvs);
 }
 
-rendertoy::SDFFunction rendertoy::SDFUnion(const rendertoy::SDFFunction &a, const rendertoy::SDFFunction &b)
+const std::vector<std::shared_ptr<rendertoy::Triangle>> &rendertoy::TriangleMesh::MakeTriangles()
 {
-    return [=](glm::vec3 coord) -> float
-    {
-        return std::min(a(coord), b(coord));
-    };
+    _triangles.clear();
+    _triangles.resize(triangle_count());
+    tbb::parallel_for(0, static_cast<int>(triangle_count()), [&](const int i)
+                      {
+        _triangles[i] = std::make_shared<Triangle>(this, GetFaceSlot(i));
+        _triangles[i]->mat() = _mat; });
+    return _triangles;
 }
 
-rendertoy::SDFFunction rendertoy::SDFSmoothUnion(const rendertoy::SDFFunction &a, const rendertoy::SDFFunction &b, const float k)
+const bool rendertoy::TriangleMesh::IntersectTriangle(const int index, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const
 {
-    return [=](glm::vec3 coord) -> float
-    {
-        auto d2 = b(coord);
-        auto d1 = a(coord);
-        float h = glm::clamp( 0.5f + 0.5f*(d2-d1)/k, 0.0f, 1.0f );
-        return glm::mix( d2, d1, h ) - k*h*(1.0-h);
-    };
+    const glm::uvec3 &idx = _indices[index];
+    const glm::vec3 &p0 = _positions[idx[0]];
+    glm::vec3 v0v1 = _positions[idx[1]] - p0;
+    glm::vec3 v0v2 = _positions[idx[2]] - p0;
+    glm::vec3 pvec = glm::cross(direction, v0v2);
+    glm::float32 det = glm::dot(v0v1, pvec);
+    if (std::abs(det) < 1e-6f)
+        return false;
+    glm::float32 invDet = 1.0f / det;
+    glm::vec3 tvec = origin - p0;
+    glm::float32 u = glm::dot(tvec, pvec) * invDet;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+    glm::vec3 qvec = glm::cross(tvec, v0v1);
+    glm::float32 v = glm::dot(direction, qvec) * invDet;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+    glm::float32 t = glm::dot(v0v2, qvec) * invDet;
+    if (t < 1e-3f || t >= hit._t)
+        return false;
+    hit._t = t;
+    hit._barycentric = glm::vec2(u, v);
+    hit._index = index;
+    return true;
 }
 
-rendertoy::SDFFunction rendertoy::SDFIntersect(const rendertoy::SDFFunction &a, const rendertoy::SDFFunction &b)
+void rendertoy::TriangleMesh::FillAnimatedIntersectInfo(const PrimitiveHit &hit, const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
 {
-    return [=](glm::vec3 coord) -> float
+    glm::vec3 local_origin, local_dir;
+    GetLocalRay(intersect_info._time, origin, direction, local_origin, local_dir);
+    FillTriangleIntersectInfo(hit, local_origin, local_dir, intersect_info);
+    if (_motion_keys.empty())
     {
-        return std::max(a(coord), b(coord));
-    };
+        return;
+    }
+    // The local ray only differs by a rigid transform, so t is the same in both spaces.
+    glm::quat rot;
+    glm::vec3 tran;
+    GetCurrentAnimationState(intersect_info._time, rot, tran);
+    const glm::mat3 rot_mat = glm::toMat3(rot);
+    intersect_info._coord = origin + hit._t * direction;
+    intersect_info._geometry_normal = rot_mat * intersect_info._geometry_normal;
+    intersect_info._shading_normal = rot_mat * intersect_info._shading_normal;
+    intersect_info._wo = -direction;
 }
 
-rendertoy::SDFFunction rendertoy::SDFRound(const SDFFunction &a, const float rad)
+void rendertoy::TriangleMesh::FillTriangleIntersectInfo(const PrimitiveHit &hit, const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
 {
-    return [=](glm::vec3 coord) -> float
+    intersect_info._uv = GetTriangleUV(hit);
+    intersect_info._coord = origin + hit._t * direction;
+    intersect_info._t = hit._t;
+    // intersect_info._geometry_normal = glm::normalize(glm::cross(v0v1, v0v2));
+    intersect_info._geometry_normal = GetTriangleNormal(hit._index, hit._barycentric);
+    intersect_info._shading_normal = intersect_info._geometry_normal;
+    intersect_info._wo = -direction;
+    if (glm::dot(intersect_info._geometry_normal, direction) > 0.0f)
     {
-        return a(coord) - rad;
-    };
+        intersect_info._geometry_normal = -intersect_info._geometry_normal;
+    }
 }
 
-rendertoy::SDFFunction rendertoy::SDFTranslate(const SDFFunction &a, const glm::vec3 &p)
+const glm::vec2 rendertoy::TriangleMesh::GetTriangleUV(const PrimitiveHit &hit) const
 {
-    return [=](glm::vec3 coord) -> float
-    {
-        return a(coord - p);
-    };
+    const glm::uvec3 &idx = _indices[hit._index];
+    const float u = hit._barycentric.x, v = hit._barycentric.y;
+    return u * _uvs[idx[1]] + v * _uvs[idx[2]] + (1 - u - v) * _uvs[idx[0]];
 }
 
-rendertoy::SDFFunction rendertoy::operator-(const rendertoy::SDFFunction &a)
+void rendertoy::TriangleMesh::BuildOpacityMicromaps()
 {
-    return [=](glm::vec3 coord) -> float
+    _micromaps.clear();
+    _micromap_mat = _mat.get();
+    _mesh_opacity = MicroOpacity::UNKNOWN;
+    if (!_mat || !_mat->albedo())
     {
-        return -a(coord);
-    };
-}
+        // Without an albedo there is no alpha to test, IntersectTriangleFiltered must not reach AlphaTest.
+        _mesh_opacity = MicroOpacity::FULLY_OPAQUE;
+        return;
+    }
+    if (_uvs.empty())
+    {
+        return;
+    }
+    constexpr int n = 1 << OPACITY_MICROMAP_LEVEL;
+    const ISamplableColor &albedo = *_mat->albedo();
+    const int face_count = static_cast<int>(triangle_count());
+    _micromaps.resize(face_count);
+    std::atomic<bool> all_opaque = true;
+    std::atomic<bool> any_known = false;
+    tbb::parallel_for(0, face_count, [&](const int face)
+                      {
+        const glm::uvec3 &idx = _indices[GetFaceSlot(face)];
+        auto corner_uv = [&](const int i, const int j)
+        {
+            const float u = static_cast<float>(i) / n, v = static_cast<float>(j) / n;
+            return u * _uvs[idx[1]] + v * _uvs[idx[2]] + (1 - u - v) * _uvs[idx[0]];
+        };
+        OpacityMicromap &micromap = _micromaps[face];
+        bool face_opaque = true;
+        for (int j = 0; j < n; ++j)
+        {
+            for (int i = 0; i + j < n; ++i)
+            {
+                for (int inverted = 0; inverted < (i + j < n - 1 ? 2 : 1); ++inverted)
+                {
+                    // uv is affine over the face, so the rectangle around the corners holds every uv of the micro-triangle.
+                    const glm::vec2 a = inverted ? corner_uv(i + 1, j + 1) : corner_uv(i, j);
+                    const glm::vec2 b = corner_uv(i + 1, j), c = corner_uv(i, j + 1);
+                    glm::vec4 lo, hi;
+                    MicroOpacity opacity = MicroOpacity::UNKNOWN;
+                    if (albedo.SampleRange(glm::min(a, glm::min(b, c)), glm::max(a, glm::max(b, c)), lo, hi))
+                    {
+                        // Same thresholds as AlphaTest, whose random number lies in [0, 1).
+                        opacity = lo.w >= 1.0f ? MicroOpacity::FULLY_OPAQUE : (hi.w <= 0.0f ? MicroOpacity::FULLY_TRANSPARENT : MicroOpacity::UNKNOWN);
+                    }
+                    micromap.Set(j * (2 * n - j) + 2 * i + inverted, opacity);
+                    face_opaque &= opacity == MicroOpacity::FULLY_OPAQUE;
+                    if (opacity != MicroOpacity::UNKNOWN)
+                    {
+                        any_known = true;
+                    }
+                }
+            }
+        }
+        if (!face_opaque)
+        {
+            all_opaque = false;
+        } });
 
-rendertoy::SDFFunction rendertoy::operator-(const rendertoy::SDFFunction &a, const rendertoy::SDFFunction &b)
-{
-    return SDFIntersect(a, -b);
+    // Meshes that are opaque everywhere skip the alpha test altogether, meshes with nothing known keep sampling the texture.
+    if (all_opaque || !any_known)
+    {
+        _mesh_opacity = all_opaque ? MicroOpacity::FULLY_OPAQUE : MicroOpacity::UNKNOWN;
+        _micromaps.clear();
+        _micromaps.shrink_to_fit();
+    }
 }
 
-rendertoy::SDFFunction rendertoy::operator+(const rendertoy::SDFFunction &a, const rendertoy::SDFFunction &b)
+const rendertoy::BBox rendertoy::TriangleMesh::GetTriangleBoundingBox(const int index) const
 {
-    return SDFUnion(a, b);
+    const glm::uvec3 &idx = _indices[index];
+    glm::vec3 pmin = _positions[idx[0]], pmax = _positions[idx[0]];
+    for (int i = 1; i < 3; ++i)
+    {
+        pmin = glm::min(pmin, _positions[idx[i]]);
+        pmax = glm::max(pmax, _positions[idx[i]]);
+    }
+    return BBox{pmin, pmax};
 }
 
-// https://iquilezles.org/articles/distfunctions/
-rendertoy::SDFFunction rendertoy::SDFTwist(const rendertoy::SDFFunction &a, const glm::vec3 &p, const float k)
+void rendertoy::TriangleMesh::SplitTriangleBounds(const int face, const int axis, const float position, const BBox &bounds, BBox &left, BBox &right) const
 {
-    return [=](glm::vec3 coord) -> float
+    const glm::uvec3 &idx = _indices[face];
+    left = BBox(glm::vec3(std::numeric_limits<float>::max()), glm::vec3(-std::numeric_limits<float>::max()));
+    right = left;
+    auto grow = [](BBox &bbox, const glm::vec3 &p)
     {
-        float c = std::cos(k * p.y);
-        float s = std::sin(k * p.y);
-        glm::mat2 m(c, -s, s, c);
-        glm::vec3 q(m * glm::vec2(p.x, p.z), p.y);
-        return a(q);
+        bbox._pmin = glm::min(bbox._pmin, p);
+        bbox._pmax = glm::max(bbox._pmax, p);
     };
+    // Vertices go to their side, edges crossing the plane add the crossing point to both sides.
+    for (int i = 0; i < 3; ++i)
+    {
+        const glm::vec3 &v0 = _positions[idx[i]];
+        const glm::vec3 &v1 = _positions[idx[(i + 1) % 3]];
+        if (v0[axis] <= position)
+        {
+            grow(left, v0);
+        }
+        if (v0[axis] >= position)
+        {
+            grow(right, v0);
+        }
+        if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position))
+        {
+            const float t = (position - v0[axis]) / (v1[axis] - v0[axis]);
+            glm::vec3 p = v0 + t * (v1 - v0);
+            p[axis] = position;
+            grow(left, p);
+            grow(right, p);
+        }
+    }
+    left = BBox(glm::max(left._pmin, bounds._pmin), glm::min(left._pmax, bounds._pmax));
+    right = BBox(glm::max(right._pmin, bounds._pmin), glm::min(right._pmax, bounds._pmax));
+}
+
+const glm::vec3 rendertoy::TriangleMesh::GetTriangleCenter(const int index) const
+{
+    const glm::uvec3 &idx = _indices[index];
+    return (_positions[idx[0]] + _positions[idx[1]] + _positions[idx[2]]) / 3.0f;
+}
+
+const float rendertoy::TriangleMesh::GetTriangleArea(const int index) const
+{
+    const glm::uvec3 &idx = _indices[index];
+    return glm::length(glm::cross(_positions[idx[1]] - _positions[idx[0]], _positions[idx[2]] - _positions[idx[0]])) / 2.0f;
+}
+
+const float rendertoy::TriangleMesh::GetTriangleArea(const int index, const glm::mat3 &linear) const
+{
+    const glm::uvec3 &idx = _indices[index];
+    return glm::length(glm::cross(linear * (_positions[idx[1]] - _positions[idx[0]]), linear * (_positions[idx[2]] - _positions[idx[0]]))) / 2.0f;
+}
+
+const glm::vec3 rendertoy::TriangleMesh::GetTriangleNormal(const int index, const glm::vec2 &uv) const
+{
+    const glm::uvec3 &idx = _indices[index];
+    return uv.x * _normals[idx[1]] + uv.y * _normals[idx[2]] + (1.0f - uv.x - uv.y) * _normals[idx[0]];
+}
+
+void rendertoy::TriangleMesh::GenerateSamplePointOnTriangle(const int index, glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
+{
+    float u = glm::linearRand<float>(0.0f, 1.0f);
+    float v = glm::linearRand<float>(0.0f, 1.0f);
+    if (u + v > 1.0f)
+    {
+        u = 1.0f - u;
+        v = 1.0f - v;
+    }
+    const glm::uvec3 &idx = _indices[index];
+    coord = u * _positions[idx[1]] + v * _positions[idx[2]] + (1.0f - u - v) * _positions[idx[0]];
+    uv = glm::vec2(u, v);
+    normal = GetTriangleNormal(index, uv);
+}
+
+const bool rendertoy::Triangle::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    PrimitiveHit hit;
+    if (!IntersectHit(origin, direction, intersect_info._time, hit))
+    {
+        return false;
+    }
+    FillIntersectInfo(origin, direction, hit, intersect_info);
+    return true;
+}
+
+const bool rendertoy::Triangle::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float, PrimitiveHit &hit) const
+{
+    return _mesh->IntersectTriangleFiltered(_index, origin, direction, _mat ? _mat.get() : _mesh->mat().get(), hit);
+}
+
+void rendertoy::Triangle::FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    _mesh->FillTriangleIntersectInfo(hit, origin, direction, intersect_info);
+    intersect_info._mat_id = _mat_id;
+    intersect_info._primitive = (Primitive *)this;
+}
+
+const rendertoy::BBox rendertoy::Triangle::GetBoundingBox() const
+{
+    return _mesh->GetTriangleBoundingBox(_index);
+}
+
+const float rendertoy::Triangle::GetArea() const
+{
+    return _mesh->GetTriangleArea(_index);
+}
+
+const rendertoy::SurfaceLight *rendertoy::Triangle::GetSurfaceLight() const
+{
+    return _surface_light;
+}
+
+const void rendertoy::Triangle::GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
+{
+    _mesh->GenerateSamplePointOnTriangle(_index, uv, coord, normal);
+}
+
+const float rendertoy::Triangle::Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const
+{
+    return AreaToSolidAnglePdf(GetNormal(uv), observation_to_primitive, GetArea());
+}
+
+const glm::vec3 rendertoy::Triangle::GetNormal(const glm::vec2 &uv) const
+{
+    return _mesh->GetTriangleNormal(_index, uv);
+}
+
+const glm::vec3 rendertoy::Triangle::GetCenter() const
+{
+    return _mesh->GetTriangleCenter(_index);
+}
+
+rendertoy::Instance::Instance(const std::shared_ptr<const TriangleMesh> &mesh, const glm::mat4 &object_to_world)
+    : _mesh(mesh)
+{
+    SetTransform(object_to_world);
+}
+
+void rendertoy::Instance::SetTransform(const glm::mat4 &object_to_world)
+{
+    _object_to_world = object_to_world;
+    _world_to_object = glm::inverse(object_to_world);
+    const BBox mesh_bbox = _mesh->GetBoundingBox();
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        const glm::vec3 p((corner & 1) ? mesh_bbox._pmax.x : mesh_bbox._pmin.x,
+                          (corner & 2) ? mesh_bbox._pmax.y : mesh_bbox._pmin.y,
+                          (corner & 4) ? mesh_bbox._pmax.z : mesh_bbox._pmin.z);
+        const glm::vec3 world_p = glm::vec3(_object_to_world * glm::vec4(p, 1.0f));
+        if (corner == 0)
+        {
+            _bbox = BBox(world_p, world_p);
+        }
+        else
+        {
+            _bbox.Union(world_p);
+        }
+    }
+    const glm::mat3 linear(_object_to_world);
+    _area = 0.0f;
+    for (int face = 0; face < static_cast<int>(_mesh->triangle_count()); ++face)
+    {
+        _area += _mesh->GetTriangleArea(_mesh->GetFaceSlot(face), linear);
+    }
+}
+
+void rendertoy::Instance::ToObjectSpace(const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 &object_origin, glm::vec3 &object_direction) const
+{
+    // The direction is not renormalized, so that t stays comparable with hits on other objects.
+    object_origin = glm::vec3(_world_to_object * glm::vec4(origin, 1.0f));
+    object_direction = glm::vec3(_world_to_object * glm::vec4(direction, 0.0f));
+}
+
+const rendertoy::IMaterial *rendertoy::Instance::GetMaterial() const
+{
+    return _mat ? _mat.get() : _mesh->mat().get();
+}
+
+const bool rendertoy::Instance::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    PrimitiveHit hit;
+    if (!IntersectHit(origin, direction, intersect_info._time, hit))
+    {
+        return false;
+    }
+    FillIntersectInfo(origin, direction, hit, intersect_info);
+    return true;
+}
+
+const bool rendertoy::Instance::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const
+{
+    glm::vec3 object_origin, object_direction;
+    ToObjectSpace(origin, direction, object_origin, object_direction);
+    return _mesh->IntersectHit(object_origin, object_direction, time, hit, GetMaterial());
+}
+
+const uint32_t rendertoy::Instance::IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits) const
+{
+    // An affine transform keeps the packet coherent.
+    RayPacket object_packet;
+    object_packet.size = packet.size;
+    for (int lane = 0; lane < packet.size; ++lane)
+    {
+        ToObjectSpace(packet.origins[lane], packet.directions[lane], object_packet.origins[lane], object_packet.directions[lane]);
+        object_packet.times[lane] = packet.times[lane];
+    }
+    return _mesh->IntersectHitPacket(object_packet, mask, hits, GetMaterial());
+}
+
+void rendertoy::Instance::FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    glm::vec3 object_origin, object_direction;
+    ToObjectSpace(origin, direction, object_origin, object_direction);
+    _mesh->FillAnimatedIntersectInfo(hit, object_origin, object_direction, intersect_info);
+
+    const glm::mat3 normal_to_world = glm::transpose(glm::mat3(_world_to_object));
+    intersect_info._coord = origin + hit._t * direction;
+    intersect_info._geometry_normal = glm::normalize(normal_to_world * intersect_info._geometry_normal);
+    intersect_info._shading_normal = glm::normalize(normal_to_world * intersect_info._shading_normal);
+    intersect_info._wo = -direction;
+    intersect_info._primitive = (Primitive *)this;
+    intersect_info._mat_id = _mat_id;
+    const IMaterial *mat = GetMaterial();
+    if (mat->bump())
+    {
+        intersect_info._shading_normal += glm::vec3(mat->bump()->Sample(intersect_info._uv));
+        intersect_info._shading_normal = glm::normalize(intersect_info._shading_normal);
+    }
+}
+
+const bool rendertoy::Instance::Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time) const
+{
+    glm::vec3 object_origin, object_direction;
+    ToObjectSpace(origin, direction, object_origin, object_direction);
+    return _mesh->Occluded(object_origin, object_direction, t_max, time, GetMaterial());
+}
+
+const float rendertoy::Instance::GetArea() const
+{
+    return _area;
+}
+
+const void rendertoy::Instance::GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
+{
+    _mesh->GenerateSamplePointOnSurface(uv, coord, normal);
+    coord = glm::vec3(_object_to_world * glm::vec4(coord, 1.0f));
+    normal = glm::normalize(glm::transpose(glm::mat3(_world_to_object)) * normal);
+}
+
+const bool rendertoy::Primitive::IsAnimated() const
+{
+    return false;
+}
+
+void rendertoy::Primitive::GetMotionKeyTimes(std::vector<float> &) const
+{
+}
+
+void rendertoy::Primitive::GetMotionBoundingBoxes(const float, const float, BBox &bbox_from, BBox &bbox_to) const
+{
+    bbox_from = GetBoundingBox();
+    bbox_to = bbox_from;
+}
+
+const rendertoy::SurfaceLight *rendertoy::Primitive::GetSurfaceLight() const
+{
+    return nullptr;
+}
+
+void rendertoy::PrimitiveTable::Build(const std::vector<std::shared_ptr<Primitive>> &objects)
+{
+    _refs.clear();
+    _triangles.clear();
+    _meshes.clear();
+    _instances.clear();
+    _sdfs.clear();
+    _spheres.clear();
+    _disks.clear();
+    _quads.clear();
+    _others.clear();
+    _refs.reserve(objects.size());
+    for (const std::shared_ptr<Primitive> &object : objects)
+    {
+        Add(object);
+    }
+}
+
+void rendertoy::PrimitiveTable::Add(const std::shared_ptr<Primitive> &object)
+{
+    auto add = [&](auto &array, const auto *object, const PrimitiveKind kind)
+    {
+        _refs.push_back({kind, static_cast<uint32_t>(array.size())});
+        array.push_back(object);
+    };
+    if (const TriangleMesh *mesh = dynamic_cast<const TriangleMesh *>(object.get()))
+        add(_meshes, mesh, PrimitiveKind::TRIANGLE_MESH);
+    else if (const Instance *instance = dynamic_cast<const Instance *>(object.get()))
+        add(_instances, instance, PrimitiveKind::INSTANCE);
+    else if (const Triangle *triangle = dynamic_cast<const Triangle *>(object.get()))
+        add(_triangles, triangle, PrimitiveKind::TRIANGLE);
+    else if (const SDF *sdf = dynamic_cast<const SDF *>(object.get()))
+        add(_sdfs, sdf, PrimitiveKind::SDF);
+    else if (const Sphere *sphere = dynamic_cast<const Sphere *>(object.get()))
+        add(_spheres, sphere, PrimitiveKind::SPHERE);
+    else if (const Disk *disk = dynamic_cast<const Disk *>(object.get()))
+        add(_disks, disk, PrimitiveKind::DISK);
+    else if (const Quad *quad = dynamic_cast<const Quad *>(object.get()))
+        add(_quads, quad, PrimitiveKind::QUAD);
+    else
+        add(_others, static_cast<const Primitive *>(object.get()), PrimitiveKind::OTHER);
+}
+
+const bool rendertoy::Primitive::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const
+{
+    IntersectInfo intersect_info;
+    intersect_info._time = time;
+    if (!Intersect(origin, direction, intersect_info) || intersect_info._t >= hit._t)
+    {
+        return false;
+    }
+#ifdef ALPHA_TEST
+    // Only the nearest surface is known here, a transparent one lets the ray pass the whole primitive.
+    if (!AlphaTest(_mat.get(), intersect_info._uv, AlphaTestSample(this, 0, origin, direction)))
+    {
+        return false;
+    }
+#endif // ALPHA_TEST
+    hit._t = intersect_info._t;
+    hit._barycentric = intersect_info._uv;
+    hit._index = 0;
+    return true;
+}
+
+void rendertoy::Primitive::FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    // Primitives without a cheaper path simply run the full intersection again for the final hit.
+    Intersect(origin, direction, intersect_info);
+}
+
+const uint32_t rendertoy::Primitive::IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits) const
+{
+    uint32_t hit_mask = 0;
+    for (uint32_t lanes = mask; lanes != 0; lanes &= lanes - 1)
+    {
+        const int lane = std::countr_zero(lanes);
+        if (IntersectHit(packet.origins[lane], packet.directions[lane], packet.times[lane], hits[lane]))
+        {
+            hit_mask |= 1u << lane;
+        }
+    }
+    return hit_mask;
+}
+
+const bool rendertoy::Primitive::Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time) const
+{
+    // IntersectHit runs the alpha test, so any hit it records within t_max is opaque.
+    PrimitiveHit hit;
+    hit._t = t_max;
+    return IntersectHit(origin, direction, time, hit);
+}
+
+const bool rendertoy::Primitive::AlphaTest(const IMaterial *mat, const glm::vec2 &uv, const float u)
+{
+    // Nothing to test against, the surface is opaque.
+    if (!mat || !mat->albedo())
+    {
+        return true;
+    }
+    return u < mat->albedo()->Sample(uv).w;
+}
+
+const float rendertoy::Primitive::AlphaTestSample(const void *object, const int index, const glm::vec3 &origin, const glm::vec3 &direction)
+{
+    // Murmur3-style mixing of the object, the index and the bits of the ray.
+    uint64_t h = reinterpret_cast<uintptr_t>(object) ^ (static_cast<uint64_t>(static_cast<uint32_t>(index)) << 32);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        h = (h ^ std::bit_cast<uint32_t>(origin[axis])) * 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h = (h ^ std::bit_cast<uint32_t>(direction[axis])) * 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+    }
+    return static_cast<float>(h >> 40) * 0x1p-24f;
+}
+
+const float rendertoy::Primitive::Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const
+{
+    return 0.0f;
+}
+
+const glm::vec3 rendertoy::Primitive::GetNormal(const glm::vec2 &uv) const
+{
+    return glm::vec3(0.0f);
+}
+
+const bool rendertoy::SDF::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo &intersect_info) const
+{
+    PrimitiveHit hit;
+    if (!IntersectHit(origin, direction, intersect_info._time, hit))
+    {
+        return false;
+    }
+    FillIntersectInfo(origin, direction, hit, intersect_info);
+    return true;
+}
+
+void rendertoy::SDF::Bake(const int resolution)
+{
+    _bricks = std::make_unique<SDFBrickMap>(_sdf_tape, _bbox, resolution);
+}
+
+const bool rendertoy::SDF::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float, PrimitiveHit &hit) const
+{
+    // Sphere tracing algorithm
+
+    float tmin, tmax;
+    if (!this->_bbox.Intersect(origin, direction, tmin, &tmax))
+    {
+        return false;
+    }
+    // Marching past the closest hit so far cannot produce a closer one.
+    tmax = std::min(tmax, hit._t);
+
+    glm::vec3 current_point = origin;
+    float current_sdf = std::numeric_limits<float>::infinity();
+    float marched_distance = 0.0f;
+
+    while (true)
+    {
+        // 烘焙的下界足够大时直接前进, 只在表面附近精确求值.
+        if (_bricks)
+        {
+            const float bound = _bricks->Bound(current_point);
+            if (bound > 0.5f * _bricks->cell_size())
+            {
+                current_point += direction * bound;
+                marched_distance += bound;
+                if (marched_distance >= tmax)
+                {
+                    return false;
+                }
+                continue;
+            }
+        }
+        current_sdf = _sdf_tape.Evaluate(current_point);
+        if (current_sdf < 1e-6f)
+        {
+#ifdef ALPHA_TEST
+            // SDFs are shaded with uv = (0, 0), a transparent surface lets the ray pass the whole SDF.
+            if (!AlphaTest(_mat.get(), glm::vec2(0.0f), AlphaTestSample(this, 0, origin, direction)))
+            {
+                return false;
+            }
+#endif // ALPHA_TEST
+            hit._t = marched_distance;
+            hit._barycentric = glm::vec2(0.0f);
+            hit._index = 0;
+            return true;
+        }
+        current_point += direction * current_sdf;
+        marched_distance += current_sdf;
+        if (marched_distance >= tmax)
+        {
+            return false;
+        }
+    }
+}
+
+const uint32_t rendertoy::SDF::IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits) const
+{
+    // Sphere tracing of all rays in lockstep, the lanes still marching are gathered into batches for the tape.
+    glm::vec3 current_point[MAX_RAY_PACKET_SIZE];
+    float marched_distance[MAX_RAY_PACKET_SIZE];
+    float tmax[MAX_RAY_PACKET_SIZE];
+    uint32_t active = 0;
+    for (uint32_t lanes = mask; lanes != 0; lanes &= lanes - 1)
+    {
+        const int lane = std::countr_zero(lanes);
+        float tmin;
+        if (_bbox.Intersect(packet.origins[lane], packet.directions[lane], tmin, &tmax[lane]))
+        {
+            tmax[lane] = std::min(tmax[lane], hits[lane]._t);
+            current_point[lane] = packet.origins[lane];
+            marched_distance[lane] = 0.0f;
+            active |= 1u << lane;
+        }
+    }
+
+    uint32_t hit_mask = 0;
+    int batch_lane[SDF_BATCH_SIZE];
+    float x[SDF_BATCH_SIZE], y[SDF_BATCH_SIZE], z[SDF_BATCH_SIZE], dist[SDF_BATCH_SIZE];
+    int count = 0;
+    auto flush = [&]()
+    {
+        _sdf_tape.EvaluateBatch(count, x, y, z, dist);
+        for (int i = 0; i < count; ++i)
+        {
+            const int lane = batch_lane[i];
+            if (dist[i] < 1e-6f)
+            {
+                active &= ~(1u << lane);
+#ifdef ALPHA_TEST
+                if (!AlphaTest(_mat.get(), glm::vec2(0.0f), AlphaTestSample(this, 0, packet.origins[lane], packet.directions[lane])))
+                {
+                    continue;
+                }
+#endif // ALPHA_TEST
+                hits[lane]._t = marched_distance[lane];
+                hits[lane]._barycentric = glm::vec2(0.0f);
+                hits[lane]._index = 0;
+                hit_mask |= 1u << lane;
+                continue;
+            }
+            current_point[lane] += packet.directions[lane] * dist[i];
+            marched_distance[lane] += dist[i];
+            if (marched_distance[lane] >= tmax[lane])
+            {
+                active &= ~(1u << lane);
+            }
+        }
+        count = 0;
+    };
+    while (active != 0)
+    {
+        for (uint32_t lanes = active; lanes != 0; lanes &= lanes - 1)
+        {
+            const int lane = std::countr_zero(lanes);
+            if (_bricks)
+            {
+                const float bound = _bricks->Bound(current_point[lane]);
+                if (bound > 0.5f * _bricks->cell_size())
+                {
+                    current_point[lane] += packet.directions[lane] * bound;
+                    marched_distance[lane] += bound;
+                    if (marched_distance[lane] >= tmax[lane])
+                    {
+                        active &= ~(1u << lane);
+                    }
+                    continue;
+                }
+            }
+            batch_lane[count] = lane;
+            x[count] = current_point[lane].x;
+            y[count] = current_point[lane].y;
+            z[count] = current_point[lane].z;
+            if (++count == SDF_BATCH_SIZE)
+            {
+                flush();
+            }
+        }
+        if (count > 0)
+        {
+            flush();
+        }
+    }
+    return hit_mask;
+}
+
+void rendertoy::SDF::FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo &intersect_info) const
+{
+    const glm::vec3 current_point = origin + hit._t * direction;
+    intersect_info._uv = glm::vec2(0.0f);
+    intersect_info._coord = current_point;
+    intersect_info._mat_id = _mat_id;
+    intersect_info._wo = -direction;
+    intersect_info._primitive = (Primitive *)this;
+    intersect_info._t = hit._t;
+    if (_sdf_grad)
+    {
+        intersect_info._shading_normal = _sdf_grad->operator()(current_point);
+    }
+    else
+    {
+        glm::vec3 grad;
+        _sdf_tape.EvaluateGrad(current_point, grad);
+        intersect_info._shading_normal = glm::normalize(grad);
+    }
+    intersect_info._geometry_normal = intersect_info._shading_normal;
+    if (glm::dot(intersect_info._geometry_normal, direction) > 0.0f)
+    {
+        intersect_info._geometry_normal = -intersect_info._geometry_normal;
+    }
+    intersect_info._coord += 1e-4f * intersect_info._shading_normal;
+}
+
+const bool rendertoy::Primitive::SampleSolidAngle(const glm::vec3 &ref, glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal, float &pdf) const
+{
+    GenerateSamplePointOnSurface(uv, coord, normal);
+    pdf = AreaToSolidAnglePdf(normal, coord - ref, GetArea());
+    return pdf > 0.0f;
+}
+
+const glm::vec2 rendertoy::Sphere::GetUV(const glm::vec3 &normal) const
+{
+    return glm::vec2(SphericalPhi(normal) * glm::one_over_two_pi<float>(), SphericalTheta(normal) * glm::one_over_pi<float>());
+}
+
+const bool rendertoy::Sphere::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    PrimitiveHit hit;
+    if (!IntersectHit(origin, direction, intersect_info._time, hit))
+    {
+        return false;
+    }
+    FillIntersectInfo(origin, direction, hit, intersect_info);
+    return true;
+}
+
+const bool rendertoy::Sphere::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float, PrimitiveHit &hit) const
+{
+    const glm::vec3 oc = origin - _center;
+    const float a = glm::dot(direction, direction);
+    const float half_b = glm::dot(oc, direction);
+    const float c = glm::dot(oc, oc) - _radius * _radius;
+    const float discriminant = half_b * half_b - a * c;
+    if (discriminant < 0.0f)
+    {
+        return false;
+    }
+    // 避免 -b + sqrt(...) 的抵消误差.
+    const float q = -(half_b + std::copysign(std::sqrt(discriminant), half_b));
+    float t0 = q / a, t1 = c / q;
+    if (t0 > t1)
+    {
+        std::swap(t0, t1);
+    }
+    for (const float t : {t0, t1})
+    {
+        if (!(t >= 1e-3f))
+        {
+            continue;
+        }
+        if (t >= hit._t)
+        {
+            return false;
+        }
+#ifdef ALPHA_TEST
+        // A transparent near side lets the ray on to the far side.
+        if (!AlphaTest(_mat.get(), GetUV(glm::normalize(origin + t * direction - _center)), AlphaTestSample(this, t == t0 ? 0 : 1, origin, direction)))
+        {
+            continue;
+        }
+#endif // ALPHA_TEST
+        hit._t = t;
+        hit._barycentric = glm::vec2(0.0f);
+        hit._index = 0;
+        return true;
+    }
+    return false;
+}
+
+void rendertoy::Sphere::FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    const glm::vec3 normal = glm::normalize(origin + hit._t * direction - _center);
+    intersect_info._uv = GetUV(normal);
+    // 投影回球面, 减小 t 的误差.
+    intersect_info._coord = _center + _radius * normal;
+    intersect_info._t = hit._t;
+    intersect_info._mat_id = _mat_id;
+    intersect_info._wo = -direction;
+    intersect_info._primitive = (Primitive *)this;
+    intersect_info._shading_normal = normal;
+    intersect_info._geometry_normal = normal;
+    if (glm::dot(intersect_info._geometry_normal, direction) > 0.0f)
+    {
+        intersect_info._geometry_normal = -intersect_info._geometry_normal;
+    }
+}
+
+const void rendertoy::Sphere::GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
+{
+    const float z = 1.0f - 2.0f * glm::linearRand(0.0f, 1.0f);
+    const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    const float phi = glm::two_pi<float>() * glm::linearRand(0.0f, 1.0f);
+    normal = glm::vec3(r * std::cos(phi), z, r * std::sin(phi));
+    coord = _center + _radius * normal;
+    uv = GetUV(normal);
+}
+
+const bool rendertoy::Sphere::SampleSolidAngle(const glm::vec3 &ref, glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal, float &pdf) const
+{
+    const glm::vec3 to_center = _center - ref;
+    const float dist2 = glm::dot(to_center, to_center);
+    const float sin2_theta_max = _radius * _radius / dist2;
+    if (sin2_theta_max >= 1.0f - 1e-4f)
+    {
+        // Points on or inside the sphere see all of it, sample by area instead.
+        return Primitive::SampleSolidAngle(ref, uv, coord, normal, pdf);
+    }
+    // 在球所张的圆锥内均匀采样方向, 1 - cos 写成 sin^2 / (1 + cos) 以免远处小球的抵消误差.
+    const float cos_theta_max = std::sqrt(1.0f - sin2_theta_max);
+    const float one_minus_cos_theta_max = sin2_theta_max / (1.0f + cos_theta_max);
+    const float one_minus_cos_theta = glm::linearRand(0.0f, 1.0f) * one_minus_cos_theta_max;
+    const float cos_theta = 1.0f - one_minus_cos_theta;
+    const float sin2_theta = one_minus_cos_theta * (1.0f + cos_theta);
+    const float phi = glm::two_pi<float>() * glm::linearRand(0.0f, 1.0f);
+
+    const float dist = std::sqrt(dist2);
+    const glm::vec3 w = to_center / dist;
+    glm::vec3 tangent, bitangent;
+    CoordinateSystem(w, &tangent, &bitangent);
+    const float sin_theta = std::sqrt(sin2_theta);
+    const glm::vec3 dir = sin_theta * std::cos(phi) * tangent + sin_theta * std::sin(phi) * bitangent + cos_theta * w;
+    // Nearest intersection of the sampled direction with the sphere.
+    const float t = dist * cos_theta - std::sqrt(std::max(0.0f, _radius * _radius - dist2 * sin2_theta));
+    normal = glm::normalize(ref + t * dir - _center);
+    coord = _center + _radius * normal;
+    uv = GetUV(normal);
+    pdf = 1.0f / (glm::two_pi<float>() * one_minus_cos_theta_max);
+    return true;
+}
+
+const float rendertoy::Sphere::Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const
+{
+    const glm::vec3 normal = GetNormal(uv);
+    const glm::vec3 ref = _center + _radius * normal - observation_to_primitive;
+    const glm::vec3 to_center = _center - ref;
+    const float sin2_theta_max = _radius * _radius / glm::dot(to_center, to_center);
+    if (sin2_theta_max >= 1.0f - 1e-4f)
+    {
+        return AreaToSolidAnglePdf(normal, observation_to_primitive, GetArea());
+    }
+    const float one_minus_cos_theta_max = sin2_theta_max / (1.0f + std::sqrt(1.0f - sin2_theta_max));
+    return 1.0f / (glm::two_pi<float>() * one_minus_cos_theta_max);
+}
+
+const glm::vec3 rendertoy::Sphere::GetNormal(const glm::vec2 &uv) const
+{
+    const float theta = uv.y * glm::pi<float>();
+    const float phi = uv.x * glm::two_pi<float>();
+    return glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+}
+
+rendertoy::Disk::Disk(const glm::vec3 &center, const glm::vec3 &normal, const float radius)
+    : _center(center), _normal(glm::normalize(normal)), _radius(radius)
+{
+    glm::vec3 tangent, bitangent;
+    CoordinateSystem(_normal, &tangent, &bitangent);
+    _frame = glm::mat3(tangent, bitangent, _normal);
+}
+
+const bool rendertoy::Disk::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    PrimitiveHit hit;
+    if (!IntersectHit(origin, direction, intersect_info._time, hit))
+    {
+        return false;
+    }
+    FillIntersectInfo(origin, direction, hit, intersect_info);
+    return true;
+}
+
+const bool rendertoy::Disk::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float, PrimitiveHit &hit) const
+{
+    const float denom = glm::dot(_normal, direction);
+    if (std::abs(denom) < 1e-8f)
+    {
+        return false;
+    }
+    const float t = glm::dot(_center - origin, _normal) / denom;
+    if (t < 1e-3f || t >= hit._t)
+    {
+        return false;
+    }
+    // 圆盘局部坐标.
+    const glm::vec3 local = glm::transpose(_frame) * (origin + t * direction - _center);
+    const float r2 = local.x * local.x + local.y * local.y;
+    if (r2 > _radius * _radius)
+    {
+        return false;
+    }
+    float phi = std::atan2(local.y, local.x);
+    phi = phi < 0.0f ? phi + glm::two_pi<float>() : phi;
+    const glm::vec2 uv(std::sqrt(r2) / _radius, phi * glm::one_over_two_pi<float>());
+#ifdef ALPHA_TEST
+    if (!AlphaTest(_mat.get(), uv, AlphaTestSample(this, 0, origin, direction)))
+    {
+        return false;
+    }
+#endif // ALPHA_TEST
+    hit._t = t;
+    hit._barycentric = uv;
+    hit._index = 0;
+    return true;
+}
+
+void rendertoy::Disk::FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    intersect_info._uv = hit._barycentric;
+    intersect_info._coord = origin + hit._t * direction;
+    intersect_info._t = hit._t;
+    intersect_info._mat_id = _mat_id;
+    intersect_info._wo = -direction;
+    intersect_info._primitive = (Primitive *)this;
+    intersect_info._shading_normal = _normal;
+    intersect_info._geometry_normal = _normal;
+    if (glm::dot(intersect_info._geometry_normal, direction) > 0.0f)
+    {
+        intersect_info._geometry_normal = -intersect_info._geometry_normal;
+    }
+}
+
+const rendertoy::BBox rendertoy::Disk::GetBoundingBox() const
+{
+    // 圆盘在每个轴上的半宽为 r * sqrt(1 - n_i^2).
+    const glm::vec3 extent = _radius * glm::sqrt(glm::max(glm::vec3(0.0f), glm::vec3(1.0f) - _normal * _normal));
+    return BBox(_center - extent, _center + extent);
+}
+
+const void rendertoy::Disk::GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
+{
+    const glm::vec2 d = ConcentricSampleDisk();
+    coord = _center + _radius * (_frame * glm::vec3(d.x, d.y, 0.0f));
+    float phi = std::atan2(d.y, d.x);
+    phi = phi < 0.0f ? phi + glm::two_pi<float>() : phi;
+    uv = glm::vec2(glm::length(d), phi * glm::one_over_two_pi<float>());
+    normal = _normal;
+}
+
+const float rendertoy::Disk::Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &) const
+{
+    return AreaToSolidAnglePdf(_normal, observation_to_primitive, GetArea());
+}
+
+rendertoy::Quad::Quad(const glm::vec3 &corner, const glm::vec3 &edge0, const glm::vec3 &edge1)
+    : _corner(corner), _edge0(edge0), _edge1(edge1), _normal(glm::normalize(glm::cross(edge0, edge1)))
+{
+    _rectangle = std::abs(glm::dot(glm::normalize(edge0), glm::normalize(edge1))) < 1e-4f;
+}
+
+const glm::vec2 rendertoy::Quad::GetUV(const glm::vec3 &point) const
+{
+    // 以对偶基求 point - corner = u * edge0 + v * edge1 的系数.
+    const glm::vec3 n = glm::cross(_edge0, _edge1);
+    const glm::vec3 w = n / glm::dot(n, n);
+    const glm::vec3 local = point - _corner;
+    return glm::vec2(glm::dot(w, glm::cross(local, _edge1)), glm::dot(w, glm::cross(_edge0, local)));
+}
+
+const float rendertoy::Quad::SolidAngle(const glm::vec3 &ref, const glm::vec2 *u, glm::vec3 *point) const
+{
+    if (!_rectangle)
+    {
+        return 0.0f;
+    }
+    // Urena et al. 2013, "An Area-Preserving Parametrization for Spherical Rectangles".
+    const float ex_length = glm::length(_edge0), ey_length = glm::length(_edge1);
+    const glm::vec3 x = _edge0 / ex_length, y = _edge1 / ey_length;
+    glm::vec3 z = glm::cross(x, y);
+    const glm::vec3 d = _corner - ref;
+    float z0 = glm::dot(d, z);
+    if (std::abs(z0) < 1e-6f)
+    {
+        // ref 在矩形所在平面上.
+        return 0.0f;
+    }
+    if (z0 > 0.0f)
+    {
+        z = -z;
+        z0 = -z0;
+    }
+    const float x0 = glm::dot(d, x), y0 = glm::dot(d, y);
+    const float x1 = x0 + ex_length, y1 = y0 + ey_length;
+    const glm::vec3 v00(x0, y0, z0), v01(x0, y1, z0), v10(x1, y0, z0), v11(x1, y1, z0);
+    const glm::vec3 n0 = glm::normalize(glm::cross(v00, v10));
+    const glm::vec3 n1 = glm::normalize(glm::cross(v10, v11));
+    const glm::vec3 n2 = glm::normalize(glm::cross(v11, v01));
+    const glm::vec3 n3 = glm::normalize(glm::cross(v01, v00));
+    const float g0 = std::acos(glm::clamp(-glm::dot(n0, n1), -1.0f, 1.0f));
+    const float g1 = std::acos(glm::clamp(-glm::dot(n1, n2), -1.0f, 1.0f));
+    const float g2 = std::acos(glm::clamp(-glm::dot(n2, n3), -1.0f, 1.0f));
+    const float g3 = std::acos(glm::clamp(-glm::dot(n3, n0), -1.0f, 1.0f));
+    const float k = glm::two_pi<float>() - g2 - g3;
+    const float solid_angle = g0 + g1 - k;
+    if (!(solid_angle > 1e-4f))
+    {
+        // 立体角太小时参数化的精度不足.
+        return 0.0f;
+    }
+    if (u == nullptr)
+    {
+        return solid_angle;
+    }
+
+    const float b0 = n0.z, b1 = n2.z;
+    const float au = u->x * solid_angle + k;
+    const float fu = (std::cos(au) * b0 - b1) / std::sin(au);
+    float cu = std::copysign(1.0f, fu) / std::sqrt(fu * fu + b0 * b0);
+    cu = glm::clamp(cu, -1.0f, 1.0f);
+    float xu = -(cu * z0) / std::sqrt(std::max(1e-12f, 1.0f - cu * cu));
+    xu = glm::clamp(xu, x0, x1);
+    const float dist = std::sqrt(xu * xu + z0 * z0);
+    const float h0 = y0 / std::sqrt(dist * dist + y0 * y0);
+    const float h1 = y1 / std::sqrt(dist * dist + y1 * y1);
+    const float hv = h0 + u->y * (h1 - h0);
+    const float hv2 = hv * hv;
+    const float yv = hv2 < 1.0f - 1e-6f ? hv * dist / std::sqrt(1.0f - hv2) : y1;
+    *point = ref + xu * x + glm::clamp(yv, y0, y1) * y + z0 * z;
+    return solid_angle;
+}
+
+const bool rendertoy::Quad::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    PrimitiveHit hit;
+    if (!IntersectHit(origin, direction, intersect_info._time, hit))
+    {
+        return false;
+    }
+    FillIntersectInfo(origin, direction, hit, intersect_info);
+    return true;
+}
+
+const bool rendertoy::Quad::IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float, PrimitiveHit &hit) const
+{
+    const float denom = glm::dot(_normal, direction);
+    if (std::abs(denom) < 1e-8f)
+    {
+        return false;
+    }
+    const float t = glm::dot(_corner - origin, _normal) / denom;
+    if (t < 1e-3f || t >= hit._t)
+    {
+        return false;
+    }
+    const glm::vec2 uv = GetUV(origin + t * direction);
+    if (uv.x < 0.0f || uv.x > 1.0f || uv.y < 0.0f || uv.y > 1.0f)
+    {
+        return false;
+    }
+#ifdef ALPHA_TEST
+    if (!AlphaTest(_mat.get(), uv, AlphaTestSample(this, 0, origin, direction)))
+    {
+        return false;
+    }
+#endif // ALPHA_TEST
+    hit._t = t;
+    hit._barycentric = uv;
+    hit._index = 0;
+    return true;
+}
+
+void rendertoy::Quad::FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const
+{
+    intersect_info._uv = hit._barycentric;
+    intersect_info._coord = origin + hit._t * direction;
+    intersect_info._t = hit._t;
+    intersect_info._mat_id = _mat_id;
+    intersect_info._wo = -direction;
+    intersect_info._primitive = (Primitive *)this;
+    intersect_info._shading_normal = _normal;
+    intersect_info._geometry_normal = _normal;
+    if (glm::dot(intersect_info._geometry_normal, direction) > 0.0f)
+    {
+        intersect_info._geometry_normal = -intersect_info._geometry_normal;
+    }
+}
+
+const rendertoy::BBox rendertoy::Quad::GetBoundingBox() const
+{
+    BBox ret(_corner, _corner);
+    ret.Union(_corner + _edge0);
+    ret.Union(_corner + _edge1);
+    ret.Union(_corner + _edge0 + _edge1);
+    return ret;
+}
+
+const void rendertoy::Quad::GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const
+{
+    uv = glm::vec2(glm::linearRand(0.0f, 1.0f), glm::linearRand(0.0f, 1.0f));
+    coord = _corner + uv.x * _edge0 + uv.y * _edge1;
+    normal = _normal;
+}
+
+const bool rendertoy::Quad::SampleSolidAngle(const glm::vec3 &ref, glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal, float &pdf) const
+{
+    const glm::vec2 u(glm::linearRand(0.0f, 1.0f), glm::linearRand(0.0f, 1.0f));
+    const float solid_angle = SolidAngle(ref, &u, &coord);
+    if (solid_angle == 0.0f)
+    {
+        return Primitive::SampleSolidAngle(ref, uv, coord, normal, pdf);
+    }
+    uv = glm::clamp(GetUV(coord), glm::vec2(0.0f), glm::vec2(1.0f));
+    normal = _normal;
+    pdf = 1.0f / solid_angle;
+    return true;
+}
+
+const float rendertoy::Quad::Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const
+{
+    const glm::vec3 ref = _corner + uv.x * _edge0 + uv.y * _edge1 - observation_to_primitive;
+    const float solid_angle = SolidAngle(ref);
+    if (solid_angle == 0.0f)
+    {
+        return AreaToSolidAnglePdf(_normal, observation_to_primitive, GetArea());
+    }
+    return 1.0f / solid_angle;
 }
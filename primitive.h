@@ -1,11 +1,11 @@
 #pragma once
 
-#include <assimp/vector3.h>
-#include <assimp/vector2.h>
 #include <string>
+#include <optional>
 
 #include "rendertoy_internal.h"
 #include "accelerate.h"
+#include "sdf.h"
 
 #define PRIMITIVE_METADATA(type)                      \
 private:                                              \
@@ -24,8 +24,17 @@ namespace rendertoy
         PRIMITIVE_METADATA(FUNDAMENTAL_PRIMITIVE)
     protected:
         std::shared_ptr<IMaterial> _mat = nullptr;
+        int _mat_id = -1; // Assigned by Scene::Init.
         SurfaceLight *_surface_light = nullptr;
 
+        /// @brief Any-hit filter run on candidate hits inside traversal, so that a rejected hit lets the ray go on to the surfaces behind it.
+        /// A hit passes with the probability given by the albedo alpha of mat at uv, u being a uniform sample in [0, 1).
+        /// It always passes when mat or its albedo is missing.
+        static const bool AlphaTest(const IMaterial *mat, const glm::vec2 &uv, const float u);
+        /// @brief Uniform sample in [0, 1) hashed from the ray and a sub-primitive of object.
+        /// @note A candidate tested more than once by a query, e.g. a face in several leaves after spatial splits, always gets the same answer.
+        static const float AlphaTestSample(const void *object, const int index, const glm::vec3 &origin, const glm::vec3 &direction);
+
     public:
         const std::shared_ptr<IMaterial> &mat() const
         {
@@ -35,9 +44,34 @@ namespace rendertoy
         {
             return _mat;
         }
+        const int mat_id() const
+        {
+            return _mat_id;
+        }
         virtual const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const = 0;
+        /// @brief Traversal half of Intersect, only records a hit closer than hit._t.
+        /// @return Whether hit has been updated.
+        virtual const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const;
+        /// @brief IntersectHit for the rays of a packet in mask, hits[i] belongs to ray i. Tests ray by ray unless overridden.
+        /// @return Mask of the rays whose hit has been updated.
+        virtual const uint32_t IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits) const;
+        /// @brief Shading half of Intersect, computes surface attributes and material of a hit recorded by IntersectHit.
+        /// @note intersect_info._time must hold the time the hit has been recorded at.
+        virtual void FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const;
+        /// @brief Whether the primitive blocks the ray within (0, t_max). Any opaque hit is enough, no hit attributes are reported.
+        virtual const bool Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time) const;
         virtual const BBox GetBoundingBox() const = 0;
+        /// @brief Whether the primitive moves over time, animated primitives are kept in the motion BVH.
+        virtual const bool IsAnimated() const;
+        /// @brief Append the times at which the motion changes, the motion is linear between them.
+        virtual void GetMotionKeyTimes(std::vector<float> &times) const;
+        /// @brief Bounds at time_from and time_to, so that their linear interpolation contains the primitive at any time in between.
+        virtual void GetMotionBoundingBoxes(const float time_from, const float time_to, BBox &bbox_from, BBox &bbox_to) const;
         virtual const void GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const = 0;
+        /// @brief Samples a point of the surface as seen from ref, pdf receives the density w.r.t. solid angle at ref.
+        /// Falls back to GenerateSamplePointOnSurface unless overridden, Pdf must describe the same density.
+        /// @return Whether the sample is usable.
+        virtual const bool SampleSolidAngle(const glm::vec3 &ref, glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal, float &pdf) const;
         virtual const float GetArea() const = 0;
         virtual const SurfaceLight *GetSurfaceLight() const;
         virtual const float Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const;
@@ -48,40 +82,22 @@ namespace rendertoy
         friend class Scene;
     };
 
-    class Triangle : public Primitive
+    class TriangleMesh;
+
+    /// @brief A single face of a TriangleMesh, referencing the mesh buffers by index.
+    /// @note Meshes are not stored as individual triangles, views are only created for emissive meshes, where each face needs its own SurfaceLight.
+    class Triangle final : public Primitive
     {
         PRIMITIVE_METADATA(FUNDAMENTAL_PRIMITIVE)
     private:
-        glm::vec3 _vert[3]; // Relative coordinate to the nearest origin.
-        glm::vec2 _uv[3];
-        glm::vec3 _norm[3];
+        const TriangleMesh *_mesh;
+        int _index;
 
     public:
-        Triangle(const glm::vec3 &p0,
-                 const glm::vec3 &p1,
-                 const glm::vec3 &p2,
-                 const glm::vec2 &t0 = glm::vec2(0.0f),
-                 const glm::vec2 &t1 = glm::vec2(0.0f),
-                 const glm::vec2 &t2 = glm::vec2(0.0f),
-                 const glm::vec3 &n0 = glm::vec3(0.0f),
-                 const glm::vec3 &n1 = glm::vec3(0.0f),
-                 const glm::vec3 &n2 = glm::vec3(0.0f))
-            : _vert{p0, p1, p2}, _uv{t0, t1, t2}, _norm{n0, n1, n2} {}
-        Triangle(const aiVector3D &p0,
-                 const aiVector3D &p1,
-                 const aiVector3D &p2,
-                 const aiVector2D &t0,
-                 const aiVector2D &t1,
-                 const aiVector2D &t2,
-                 const aiVector3D &n0,
-                 const aiVector3D &n1,
-                 const aiVector3D &n2)
-            : _vert{glm::vec3(p0.x, p0.y, p0.z), glm::vec3(p1.x, p1.y, p1.z), glm::vec3(p2.x, p2.y, p2.z)},
-              _uv{glm::vec2(t0.x, t0.y), glm::vec2(t1.x, t1.y), glm::vec2(t2.x, t2.y)},
-              _norm{glm::vec3(n0.x, n0.y, n0.z), glm::vec3(n1.x, n1.y, n1.z), glm::vec3(n2.x, n2.y, n2.z)}
-        {
-        }
+        Triangle(const TriangleMesh *mesh, const int index) : _mesh(mesh), _index(index) {}
         virtual const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const final;
+        virtual void FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
         virtual const BBox GetBoundingBox() const;
         virtual const float GetArea() const;
         virtual const SurfaceLight *GetSurfaceLight() const;
@@ -92,83 +108,245 @@ namespace rendertoy
         /// @return
         virtual const float Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const;
         virtual const glm::vec3 GetNormal(const glm::vec2 &uv) const;
-        virtual const glm::vec3 GetCenter() const
+        virtual const glm::vec3 GetCenter() const;
+    };
+
+    constexpr int OPACITY_MICROMAP_LEVEL = 3; // Faces are split into 4^level micro-triangles.
+    constexpr int OPACITY_MICROMAP_SIZE = 1 << (2 * OPACITY_MICROMAP_LEVEL);
+
+    enum class MicroOpacity : uint8_t
+    {
+        UNKNOWN = 0, // The alpha texture has to be sampled.
+        FULLY_OPAQUE,
+        FULLY_TRANSPARENT,
+    };
+
+    /// @brief Opacity of the micro-triangles of a face, 2 bits each.
+    /// @note Micro-triangles come from splitting the barycentric domain into a regular grid of n = 2^level steps per edge.
+    /// Row j holds the cells i + j < n, upright and inverted ones interleaved.
+    struct OpacityMicromap
+    {
+        uint64_t bits[OPACITY_MICROMAP_SIZE / 32] = {};
+
+        const MicroOpacity Get(const int index) const
+        {
+            return static_cast<MicroOpacity>((bits[index >> 5] >> ((index & 31) * 2)) & 3);
+        }
+        void Set(const int index, const MicroOpacity opacity)
         {
-            return (_vert[0] + _vert[1] + _vert[2]) / 3.0f;
+            bits[index >> 5] |= static_cast<uint64_t>(opacity) << ((index & 31) * 2);
+        }
+        /// @brief Micro-triangle containing the barycentric coordinates (u, v) of the second and the third vertex.
+        static const int MicroTriangleIndex(const glm::vec2 &barycentric)
+        {
+            constexpr int n = 1 << OPACITY_MICROMAP_LEVEL;
+            const float x = barycentric.x * n, y = barycentric.y * n;
+            const int i = std::clamp(static_cast<int>(x), 0, n - 1);
+            const int j = std::clamp(static_cast<int>(y), 0, n - 1 - i);
+            const int inverted = (i + j < n - 1 && (x - i) + (y - j) > 1.0f) ? 1 : 0;
+            return j * (2 * n - j) + 2 * i + inverted;
         }
     };
 
-    class TriangleMesh : public Primitive
+    /// @brief Memory locality of a mesh BVH, counted as distinct cache lines touched by each leaf and summed over all leaves.
+    /// @note "file" counters describe the import order, "leaf" counters the leaf-ordered buffers actually used for traversal.
+    struct MeshLayoutStats
+    {
+        size_t leaf_count = 0;
+        size_t index_lines_file = 0;
+        size_t index_lines_leaf = 0;
+        size_t vertex_lines_file = 0;
+        size_t vertex_lines_leaf = 0;
+    };
+
+    /// @brief Rigid transform of an animated mesh at a given time.
+    struct MotionKey
+    {
+        float time;
+        glm::quat rot;
+        glm::vec3 tran;
+    };
+
+    class TriangleMesh final : public Primitive
     {
         PRIMITIVE_METADATA(COMBINED_PRIMITIVE)
     private:
-        BVH<Triangle> _triangles;
-        BBox _bbox;
-
-    public:
-        glm::quat _rot_from = glm::quat(glm::mat3(1.0f));
-        glm::vec3 _tran_from = glm::vec3(0.0f);
+        // Vertex attributes in structure-of-arrays form, shared by all faces through _indices.
+        std::vector<glm::vec3> _positions; // Relative coordinate to the nearest origin.
+        std::vector<glm::vec3> _normals;
+        std::vector<glm::vec2> _uvs;
+        std::vector<glm::uvec3> _indices; // In leaf order, indexed by leaf slot. A face may occupy several slots after spatial splits.
+        // Slot to face and face to its first slot, both empty when every face occupies exactly one slot.
+        std::vector<int> _slot_faces;
+        std::vector<int> _face_slots;
 
-        glm::quat _rot_to;
-        glm::vec3 _tran_to = glm::vec3(0.0f);
+        IndexedBVH _triangle_bvh;
+        std::vector<std::shared_ptr<Triangle>> _triangles;
+        BBox _bbox; // In mesh space, the motion is not included.
+        MeshLayoutStats _layout_stats;
+        // Opacity micromaps by face, only valid for hits alpha tested with _micromap_mat. Empty with _mesh_opacity telling whether every face is opaque.
+        std::vector<OpacityMicromap> _micromaps;
+        const IMaterial *_micromap_mat = nullptr;
+        MicroOpacity _mesh_opacity = MicroOpacity::UNKNOWN;
+        std::vector<MotionKey> _motion_keys; // Sorted by time, the mesh holds the first and the last pose outside of them.
 
-        glm::float32 _time_from, _time_to;
-        bool _is_animated;
+        void ConstructBVH(const BVHConfig &bvh_config);
+        void ReorderVertices();
+        const BBox GetAnimatedBoundingBox(const float time) const;
 
+    public:
         void GetCurrentAnimationState(const float time, glm::quat &rot, glm::vec3 &tran) const;
+        /// @brief Transform a world space ray into the mesh space at the given time.
+        void GetLocalRay(const float time, const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 &local_origin, glm::vec3 &local_direction) const;
+        /// @brief Move from the rest pose at time_from to (rot_to, tran_to) at time_to.
         void Animate(const glm::quat &rot_to, const glm::vec3 &tran_to, const glm::float32 time_from, const glm::float32 time_to);
+        /// @brief Add a key of a multi-segment motion, keys may be added in any order. A key at the time of an existing one replaces it.
+        void AddMotionKey(const float time, const glm::quat &rot, const glm::vec3 &tran);
+        const std::vector<MotionKey> &motion_keys() const
+        {
+            return _motion_keys;
+        }
 
         TriangleMesh() = default;
         TriangleMesh(const TriangleMesh &) = delete;
+        const size_t triangle_count() const
+        {
+            return _face_slots.empty() ? _indices.size() : _face_slots.size();
+        }
+        /// @brief Leaf slot holding the given face, the triangle index used by the per-triangle functions below.
+        const int GetFaceSlot(const int face) const
+        {
+            return _face_slots.empty() ? face : _face_slots[face];
+        }
+        /// @brief Clip a face against an axis-aligned plane, both halves are restricted to bounds. A half the face does not reach is returned with _pmin > _pmax.
+        /// @note Used as the PrimitiveSplitter of spatial splits, so face is the index before the BVH is built.
+        void SplitTriangleBounds(const int face, const int axis, const float position, const BBox &bounds, BBox &left, BBox &right) const;
+        /// @brief Store the built mesh (leaf-ordered buffers and BVH) in the on-disk cache.
+        void SaveCache(BVHCacheWriter &writer) const;
+        /// @brief Restore a mesh stored by SaveCache, no BVH is built.
+        const bool LoadCache(BVHCacheReader &reader);
+        const MeshLayoutStats &layout_stats() const
+        {
+            return _layout_stats;
+        }
+        /// @brief Classify the micro-triangles of every face as opaque, transparent or unknown from the albedo alpha of the mesh material,
+        /// so that the alpha test only samples the texture for hits in unknown micro-triangles.
+        /// @note Materials are assigned after import, so this is run by Scene::Init rather than cached with the mesh.
+        void BuildOpacityMicromaps();
+        /// @brief Per-face views, empty unless MakeTriangles() has been called.
         const std::vector<std::shared_ptr<Triangle>> &triangles() const
         {
-            return _triangles.objects;
+            return _triangles;
         }
-        friend const std::vector<std::shared_ptr<TriangleMesh>> ImportMeshFromFile(const std::string &path);
+        /// @brief (Re)create one Triangle view per face, referencing the first slot of the face.
+        const std::vector<std::shared_ptr<Triangle>> &MakeTriangles();
+
+        /// @brief Ray-triangle test of a leaf slot, only records a hit closer than hit._t.
+        const bool IntersectTriangle(const int index, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const;
+        /// @brief IntersectTriangle followed by the alpha test with alpha_mat, a transparent hit is not recorded.
+        const bool IntersectTriangleFiltered(const int index, const glm::vec3 &origin, const glm::vec3 &direction, const IMaterial *alpha_mat, PrimitiveHit &hit) const;
+        /// @brief Intersection and occlusion tests using the alpha of the given material, for instances overriding the mesh material.
+        const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit, const IMaterial *alpha_mat) const;
+        const uint32_t IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits, const IMaterial *alpha_mat) const;
+        const bool Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time, const IMaterial *alpha_mat) const;
+        /// @brief Geometric attributes (uv, coordinate, normals) of a triangle hit, material and primitive are left to the caller.
+        void FillTriangleIntersectInfo(const PrimitiveHit &hit, const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const;
+        /// @brief FillTriangleIntersectInfo for a ray outside of the mesh space, the attributes are moved back by the animation at intersect_info._time.
+        void FillAnimatedIntersectInfo(const PrimitiveHit &hit, const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const;
+        const glm::vec2 GetTriangleUV(const PrimitiveHit &hit) const;
+        const BBox GetTriangleBoundingBox(const int index) const;
+        const glm::vec3 GetTriangleCenter(const int index) const;
+        const float GetTriangleArea(const int index) const;
+        /// @brief Area of the triangle after applying the linear part of a transform to the mesh.
+        const float GetTriangleArea(const int index, const glm::mat3 &linear) const;
+        const glm::vec3 GetTriangleNormal(const int index, const glm::vec2 &uv) const;
+        void GenerateSamplePointOnTriangle(const int index, glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const;
+
+        friend const std::vector<std::shared_ptr<TriangleMesh>> ImportMeshFromFile(const std::string &path, const BVHConfig &bvh_config);
         virtual const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const final;
+        /// @brief Static meshes traverse their BVH with the whole packet, animated ones ray by ray.
+        virtual const uint32_t IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits) const final;
+        virtual void FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const bool Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time) const final;
+        /// @brief Bounds over the whole motion for animated meshes.
         virtual const BBox GetBoundingBox() const;
+        virtual const bool IsAnimated() const;
+        virtual void GetMotionKeyTimes(std::vector<float> &times) const;
+        virtual void GetMotionBoundingBoxes(const float time_from, const float time_to, BBox &bbox_from, BBox &bbox_to) const;
         virtual const glm::vec3 GetCenter() const;
         virtual const float GetArea() const;
         virtual const void GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const;
     };
 
-    SDFFunction SDFUnion(const SDFFunction &a, const SDFFunction &b);
-    SDFFunction SDFSmoothUnion(const SDFFunction &a, const SDFFunction &b, const float k = 0.2f);
-    SDFFunction SDFIntersect(const SDFFunction &a, const SDFFunction &b);
-    SDFFunction SDFRound(const SDFFunction &a, const float rad = 0.2f);
-    SDFFunction SDFTranslate(const SDFFunction &a, const glm::vec3 &p);
-    SDFFunction operator-(const SDFFunction &a);
-    SDFFunction operator-(const SDFFunction &a, const SDFFunction &b);
-    SDFFunction operator+(const SDFFunction &a, const SDFFunction &b);
-    SDFFunction SDFTwist(const SDFFunction &a, const glm::vec3 &p, const float k);
-
-    class SDF : public Primitive
+    /// @brief A placement of a shared TriangleMesh, the mesh and its BVH are referenced rather than copied.
+    class Instance final : public Primitive
     {
-        PRIMITIVE_METADATA(FUNDAMENTAL_PRIMITIVE)
-
+        PRIMITIVE_METADATA(COMBINED_PRIMITIVE)
     private:
-        SDFFunction _sdf_func;
-        std::optional<SDFGrad> _sdf_grad;
+        std::shared_ptr<const TriangleMesh> _mesh;
+        glm::mat4 _object_to_world;
+        glm::mat4 _world_to_object;
         BBox _bbox;
-        float _area;
+        float _area; // World space area of the rest pose, summed by SetTransform.
 
-        glm::vec3 DifferentialGrad(glm::vec3 point) const
+        void ToObjectSpace(const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 &object_origin, glm::vec3 &object_direction) const;
+        const IMaterial *GetMaterial() const;
+
+    public:
+        Instance() = delete;
+        Instance(const Instance &) = delete;
+        /// @param mesh The shared mesh.
+        /// @param object_to_world Placement of the mesh. mat() of the instance overrides the mesh material when set.
+        Instance(const std::shared_ptr<const TriangleMesh> &mesh, const glm::mat4 &object_to_world);
+
+        const std::shared_ptr<const TriangleMesh> &mesh() const
+        {
+            return _mesh;
+        }
+        /// @brief Move the instance. Once the scene is initialized, follow with Scene::MarkDirty and Scene::Commit.
+        void SetTransform(const glm::mat4 &object_to_world);
+        virtual const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const final;
+        virtual const uint32_t IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits) const final;
+        virtual void FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const bool Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time) const final;
+        virtual const BBox GetBoundingBox() const
+        {
+            return _bbox;
+        }
+        virtual const glm::vec3 GetCenter() const
         {
-            float h = 0.001f;
+            return _bbox.GetCenter();
+        }
+        virtual const float GetArea() const;
+        virtual const void GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const;
+    };
 
-            float df_dx = (_sdf_func(glm::vec3(point.x + h, point.y, point.z)) - _sdf_func(point)) / h;
-            float df_dy = (_sdf_func(glm::vec3(point.x, point.y + h, point.z)) - _sdf_func(point)) / h;
-            float df_dz = (_sdf_func(glm::vec3(point.x, point.y, point.z + h)) - _sdf_func(point)) / h;
+    class SDF final : public Primitive
+    {
+        PRIMITIVE_METADATA(FUNDAMENTAL_PRIMITIVE)
 
-            return glm::normalize(glm::vec3(df_dx, df_dy, df_dz));
-        };
+    private:
+        SDFTape _sdf_tape;
+        std::unique_ptr<SDFBrickMap> _bricks = nullptr;
+        std::optional<SDFGrad> _sdf_grad;
+        BBox _bbox;
+        float _area;
 
     public:
         SDF() = delete;
         SDF(const SDF &) = delete;
-        SDF(SDFFunction sdf_func, BBox bbox, float area = 0.0f, std::optional<SDFGrad> sdf_grad = std::nullopt)
-            : _sdf_func(sdf_func), _bbox(bbox), _area(area), _sdf_grad(sdf_grad) {}
+        SDF(const SDFExpr &sdf, BBox bbox, float area = 0.0f, std::optional<SDFGrad> sdf_grad = std::nullopt)
+            : _sdf_tape(sdf), _sdf_grad(sdf_grad), _bbox(bbox), _area(area) {}
+        /// @brief Samples the SDF into a sparse brick map over its bounding box, after which sphere tracing takes baked steps away from the surface.
+        /// @param resolution Cells along the longest edge of the bounding box.
+        void Bake(const int resolution = 128);
         virtual const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo &intersect_info) const final;
+        virtual const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const final;
+        /// @brief Sphere-traces the rays of the packet together, evaluating the SDF for up to SDF_BATCH_SIZE of them per pass over the tape.
+        virtual const uint32_t IntersectHitPacket(const RayPacket &packet, const uint32_t mask, PrimitiveHit *hits) const final;
+        virtual void FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo &intersect_info) const final;
         virtual const BBox GetBoundingBox() const
         {
             return _bbox;
@@ -188,4 +366,187 @@ namespace rendertoy
             throw;
         }
     };
-}
\ No newline at end of file
+
+    /// @brief Analytic sphere, uv = (phi / 2pi, theta / pi) around the y axis as in SphericalPhi and SphericalTheta.
+    /// @note Light samples seen from outside are drawn uniformly in the cone subtended by the sphere.
+    class Sphere final : public Primitive
+    {
+        PRIMITIVE_METADATA(FUNDAMENTAL_PRIMITIVE)
+    private:
+        glm::vec3 _center;
+        float _radius;
+
+        const glm::vec2 GetUV(const glm::vec3 &normal) const;
+
+    public:
+        Sphere() = delete;
+        Sphere(const glm::vec3 &center, const float radius) : _center(center), _radius(radius) {}
+        virtual const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const final;
+        virtual void FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const BBox GetBoundingBox() const
+        {
+            return BBox(_center - glm::vec3(_radius), _center + glm::vec3(_radius));
+        }
+        virtual const glm::vec3 GetCenter() const
+        {
+            return _center;
+        }
+        virtual const float GetArea() const
+        {
+            return 4.0f * glm::pi<float>() * _radius * _radius;
+        }
+        virtual const SurfaceLight *GetSurfaceLight() const
+        {
+            return _surface_light;
+        }
+        virtual const void GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const;
+        virtual const bool SampleSolidAngle(const glm::vec3 &ref, glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal, float &pdf) const;
+        virtual const float Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const;
+        virtual const glm::vec3 GetNormal(const glm::vec2 &uv) const;
+    };
+
+    /// @brief Analytic disk, uv = (r / radius, phi / 2pi). Light samples are uniform in area.
+    class Disk final : public Primitive
+    {
+        PRIMITIVE_METADATA(FUNDAMENTAL_PRIMITIVE)
+    private:
+        glm::vec3 _center;
+        glm::vec3 _normal;
+        float _radius;
+        glm::mat3 _frame; // Columns: tangent, bitangent, normal.
+
+    public:
+        Disk() = delete;
+        Disk(const glm::vec3 &center, const glm::vec3 &normal, const float radius);
+        virtual const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const final;
+        virtual void FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const BBox GetBoundingBox() const;
+        virtual const glm::vec3 GetCenter() const
+        {
+            return _center;
+        }
+        virtual const float GetArea() const
+        {
+            return glm::pi<float>() * _radius * _radius;
+        }
+        virtual const SurfaceLight *GetSurfaceLight() const
+        {
+            return _surface_light;
+        }
+        virtual const void GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const;
+        virtual const float Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const;
+        virtual const glm::vec3 GetNormal(const glm::vec2 &) const
+        {
+            return _normal;
+        }
+    };
+
+    /// @brief Analytic parallelogram corner + u * edge0 + v * edge1, uv in [0, 1]^2.
+    /// @note Rectangles, i.e. perpendicular edges, are light sampled uniformly in solid angle (Urena et al. 2013), other parallelograms uniformly in area.
+    class Quad final : public Primitive
+    {
+        PRIMITIVE_METADATA(FUNDAMENTAL_PRIMITIVE)
+    private:
+        glm::vec3 _corner;
+        glm::vec3 _edge0;
+        glm::vec3 _edge1;
+        glm::vec3 _normal;
+        bool _rectangle;
+
+        const glm::vec2 GetUV(const glm::vec3 &point) const;
+        /// @brief Solid angle of the rectangle seen from ref, 0 when it has to be sampled by area instead.
+        const float SolidAngle(const glm::vec3 &ref, const glm::vec2 *u = nullptr, glm::vec3 *point = nullptr) const;
+
+    public:
+        Quad() = delete;
+        Quad(const glm::vec3 &corner, const glm::vec3 &edge0, const glm::vec3 &edge1);
+        virtual const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const bool IntersectHit(const glm::vec3 &origin, const glm::vec3 &direction, const float time, PrimitiveHit &hit) const final;
+        virtual void FillIntersectInfo(const glm::vec3 &origin, const glm::vec3 &direction, const PrimitiveHit &hit, IntersectInfo RENDERTOY_FUNC_ARGUMENT_OUT intersect_info) const final;
+        virtual const BBox GetBoundingBox() const;
+        virtual const glm::vec3 GetCenter() const
+        {
+            return _corner + 0.5f * (_edge0 + _edge1);
+        }
+        virtual const float GetArea() const
+        {
+            return glm::length(glm::cross(_edge0, _edge1));
+        }
+        virtual const SurfaceLight *GetSurfaceLight() const
+        {
+            return _surface_light;
+        }
+        virtual const void GenerateSamplePointOnSurface(glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal) const;
+        virtual const bool SampleSolidAngle(const glm::vec3 &ref, glm::vec2 &uv, glm::vec3 &coord, glm::vec3 &normal, float &pdf) const;
+        virtual const float Pdf(const glm::vec3 &observation_to_primitive, const glm::vec2 &uv) const;
+        virtual const glm::vec3 GetNormal(const glm::vec2 &) const
+        {
+            return _normal;
+        }
+    };
+
+    enum class PrimitiveKind : uint8_t
+    {
+        TRIANGLE,
+        TRIANGLE_MESH,
+        INSTANCE,
+        SDF,
+        SPHERE,
+        DISK,
+        QUAD,
+        OTHER
+    };
+
+    /// @brief Leaf dispatch of the scene BVH, per-type pointer arrays with tag dispatch. Add classifies every object once by a dynamic_cast chain,
+    /// since PRIMITIVE_METADATA only tells fundamental from combined primitives. Visit then calls the final intersection routines of the known types
+    /// directly, so they can be inlined, other subclasses of Primitive go through the vtable. The objects themselves stay where they were allocated.
+    class PrimitiveTable
+    {
+    private:
+        struct Ref
+        {
+            PrimitiveKind kind;
+            uint32_t index; // Into the array of kind.
+        };
+        std::vector<Ref> _refs;
+        std::vector<const Triangle *> _triangles;
+        std::vector<const TriangleMesh *> _meshes;
+        std::vector<const Instance *> _instances;
+        std::vector<const SDF *> _sdfs;
+        std::vector<const Sphere *> _spheres;
+        std::vector<const Disk *> _disks;
+        std::vector<const Quad *> _quads;
+        std::vector<const Primitive *> _others;
+
+    public:
+        void Build(const std::vector<std::shared_ptr<Primitive>> &objects);
+        /// @brief Append object as the next index.
+        void Add(const std::shared_ptr<Primitive> &object);
+        template <typename Fn>
+        decltype(auto) Visit(const int object, Fn &&fn) const
+        {
+            const Ref ref = _refs[object];
+            switch (ref.kind)
+            {
+            case PrimitiveKind::TRIANGLE:
+                return fn(*_triangles[ref.index]);
+            case PrimitiveKind::TRIANGLE_MESH:
+                return fn(*_meshes[ref.index]);
+            case PrimitiveKind::INSTANCE:
+                return fn(*_instances[ref.index]);
+            case PrimitiveKind::SDF:
+                return fn(*_sdfs[ref.index]);
+            case PrimitiveKind::SPHERE:
+                return fn(*_spheres[ref.index]);
+            case PrimitiveKind::DISK:
+                return fn(*_disks[ref.index]);
+            case PrimitiveKind::QUAD:
+                return fn(*_quads[ref.index]);
+            default:
+                return fn(*_others[ref.index]);
+            }
+        }
+    };
+}
@@ -2,6 +2,7 @@
 
 #include "rendertoy_internal.h"
 #include "primitive.h"
+#include "sdf.h"
 #include "intersectinfo.h"
 #include "accelerate.h"
 #include "scene.h"
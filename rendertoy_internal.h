@@ -10,6 +10,7 @@
 
 #define RENDERTOY_FUNC_ARGUMENT_OUT &
 #define USE_EXT_BVH
+#define ALPHA_TEST
 
 template <typename T>
 T RENDERTOY_DISCARD_VARIABLE;
@@ -60,7 +60,7 @@ const rendertoy::Image rendertoy::IRenderWork::GetResult(const bool print_verbos
         if (object_raw_ptr && typeid(*object_raw_ptr) == typeid(TriangleMesh))
         {
             TriangleMesh *tmptr = dynamic_cast<TriangleMesh *>(object.get());
-            triangle_count += static_cast<int>(tmptr->triangles().size());
+            triangle_count += static_cast<int>(tmptr->triangle_count());
         }
     }
     Image text = GenerateTextImage({std::string("RenderToy2 Build ") + std::to_string(BUILD_NUMBER) + std::string("+") + std::string(BUILD_DATE),
@@ -80,23 +80,42 @@ const rendertoy::Image rendertoy::IRenderWork::GetResult(const bool print_verbos
     return ret;
 }
 
+// Camera rays of a group of samples, traced together as one packet.
+struct CameraRayPacket
+{
+    glm::vec3 origins[rendertoy::RAY_PACKET_SIZE];
+    glm::vec3 directions[rendertoy::RAY_PACKET_SIZE];
+    rendertoy::IntersectInfo intersect_info[rendertoy::RAY_PACKET_SIZE];
+    uint32_t hit_mask;
+
+    CameraRayPacket(const rendertoy::RenderConfig &render_config, const int count, const glm::vec2 *screen_coords)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            render_config.camera->SpawnRay(screen_coords[i], origins[i], directions[i]);
+        }
+        hit_mask = render_config.scene->Intersect(count, origins, directions, intersect_info);
+    }
+    const bool hit(const int i) const
+    {
+        return (hit_mask >> i) & 1u;
+    }
+};
+
 void rendertoy::DepthBufferRenderWork::Render()
 {
     int width = _output.width();
     int height = _output.height();
-    PixelShaderSSAA shader = [&](const glm::vec2 &screen_coord) -> glm::vec4
+    PacketPixelShaderSSAA shader = [&](const int count, const glm::vec2 *screen_coords, glm::vec4 *colors)
     {
-        glm::vec3 origin, direction;
-        IntersectInfo intersect_info;
-        _render_config.camera->SpawnRay(screen_coord, origin, direction);
-        if (_render_config.scene->Intersect(origin, direction, intersect_info))
+        const CameraRayPacket packet(_render_config, count, screen_coords);
+        for (int i = 0; i < count; ++i)
         {
-            return glm::vec4(glm::vec3((intersect_info._t - _render_config._near) / (_render_config._far - _render_config._near)), 1.0f);
+            colors[i] = packet.hit(i) ? glm::vec4(glm::vec3((packet.intersect_info[i]._t - _render_config._near) / (_render_config._far - _render_config._near)), 1.0f) : glm::vec4(1.0f);
         }
-        return glm::vec4(1.0f);
     };
     auto start_time = std::chrono::high_resolution_clock::now();
-    _output.PixelShadeSSAA(shader, _render_config.x_sample, _render_config.y_sample);
+    _output.PixelShadeSSAA(shader, _render_config.x_sample, _render_config.y_sample, RAY_PACKET_SIZE);
     auto end_time = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed_time = end_time - start_time;
     _stat.time_elapsed = elapsed_time.count();
@@ -111,19 +130,16 @@ void rendertoy::NormalRenderWork::Render()
 {
     int width = _output.width();
     int height = _output.height();
-    PixelShaderSSAA shader = [&](const glm::vec2 &screen_coord) -> glm::vec4
+    PacketPixelShaderSSAA shader = [&](const int count, const glm::vec2 *screen_coords, glm::vec4 *colors)
     {
-        glm::vec3 origin, direction;
-        IntersectInfo intersect_info;
-        _render_config.camera->SpawnRay(screen_coord, origin, direction);
-        if (_render_config.scene->Intersect(origin, direction, intersect_info))
+        const CameraRayPacket packet(_render_config, count, screen_coords);
+        for (int i = 0; i < count; ++i)
         {
-            return glm::vec4(intersect_info._geometry_normal, 1.0f);
+            colors[i] = packet.hit(i) ? glm::vec4(packet.intersect_info[i]._geometry_normal, 1.0f) : glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
         }
-        return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
     };
     auto start_time = std::chrono::high_resolution_clock::now();
-    _output.PixelShadeSSAA(shader, _render_config.x_sample, _render_config.y_sample);
+    _output.PixelShadeSSAA(shader, _render_config.x_sample, _render_config.y_sample, RAY_PACKET_SIZE);
     auto end_time = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed_time = end_time - start_time;
     _stat.time_elapsed = elapsed_time.count();
@@ -151,22 +167,24 @@ void rendertoy::AlbedoRenderWork::Render()
 {
     int width = _output.width();
     int height = _output.height();
-    PixelShaderSSAA shader = [&](const glm::vec2 &screen_coord) -> glm::vec4
+    PacketPixelShaderSSAA shader = [&](const int count, const glm::vec2 *screen_coords, glm::vec4 *colors)
     {
-        glm::vec3 origin, direction;
-        IntersectInfo intersect_info;
-        _render_config.camera->SpawnRay(screen_coord, origin, direction);
-        if (_render_config.scene->Intersect(origin, direction, intersect_info))
+        const CameraRayPacket packet(_render_config, count, screen_coords);
+        for (int i = 0; i < count; ++i)
         {
-            if (intersect_info._mat != nullptr)
+            const IMaterial *mat = packet.hit(i) ? _render_config.scene->material(packet.intersect_info[i]._mat_id) : nullptr;
+            if (mat != nullptr)
             {
-                return intersect_info._mat->albedo()->Sample(intersect_info._uv);
+                colors[i] = mat->albedo()->Sample(packet.intersect_info[i]._uv);
+            }
+            else
+            {
+                colors[i] = _render_config.scene->hdr_background()->Sample(GetUVOnSkySphere(packet.directions[i]));
             }
         }
-        return _render_config.scene->hdr_background()->Sample(GetUVOnSkySphere(direction));
     };
     auto start_time = std::chrono::high_resolution_clock::now();
-    _output.PixelShadeSSAA(shader, _render_config.x_sample, _render_config.y_sample);
+    _output.PixelShadeSSAA(shader, _render_config.x_sample, _render_config.y_sample, RAY_PACKET_SIZE);
     auto end_time = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed_time = end_time - start_time;
     _stat.time_elapsed = elapsed_time.count();
@@ -181,27 +199,22 @@ void rendertoy::PathTracingRenderWork::Render()
 {
     int width = _output.width();
     int height = _output.height();
-    RayTracingShader shader = [&](const glm::vec2 &screen_coord) -> glm::vec3
+    // 路径追踪，首次求交的结果由光线包给出
+    auto trace_path = [&](glm::vec3 origin, glm::vec3 direction, IntersectInfo &intersect_info, const bool first_intersected) -> glm::vec3
     {
         glm::vec3 factor = glm::vec3(1.0f);
         glm::vec3 L = glm::vec3(0.0f);
-        glm::vec3 origin, direction;
-        IntersectInfo intersect_info;
-        // 生成采样时间用于实现动态模糊
-        // intersect_info._time = -0.1f;
-        intersect_info._time = glm::linearRand(-0.5f, 0.5f) * _render_config.exposure + _render_config.time;
         BxDFType sampled_flag;
         glm::vec3 spectrum;
         float pdf_next, pdf_light, pdf_scattering;
         bool specular_bounce = false;
         float eta = 1.0f;
-        _render_config.camera->SpawnRay(screen_coord, origin, direction);
         // std::shared_ptr<Medium> medium = std::make_shared<HomogeneousMedium>(glm::vec3(0.0f), glm::vec3(0.1f), glm::vec3(0.0f), std::make_shared<HenyeyGreensteinPhaseFunction>(0.9f));
         std::shared_ptr<Medium> medium = _render_config.scene->_global_medium;
         int medium_depth = 0;
         for (int depth = 0; depth < 8; ++depth)
         {
-            bool intersected = _render_config.scene->Intersect(origin, direction, intersect_info);
+            bool intersected = depth == 0 ? first_intersected : _render_config.scene->Intersect(origin, direction, intersect_info);
             if (!intersected)
             {
                 intersect_info._t = 1e6f;
@@ -256,7 +269,7 @@ void rendertoy::PathTracingRenderWork::Render()
                     }
 
                     // 对当前材质的 BSDF 进行采样
-                    std::unique_ptr<BSDF> bsdf = intersect_info._mat->GetBSDF(intersect_info);
+                    std::unique_ptr<BSDF> bsdf = _render_config.scene->material(intersect_info._mat_id)->GetBSDF(intersect_info);
 
                     // 更新采样光线
                     origin = intersect_info._coord;
@@ -321,8 +334,26 @@ void rendertoy::PathTracingRenderWork::Render()
         }
         return L * _render_config.exposure;
     };
+    PacketRayTracingShader shader = [&](const glm::vec2 &screen_coord, const int count, glm::vec3 *radiance)
+    {
+        // 同一像素的样本组成光线包，一起完成首次求交
+        glm::vec3 origins[RAY_PACKET_SIZE], directions[RAY_PACKET_SIZE];
+        IntersectInfo intersect_info[RAY_PACKET_SIZE];
+        for (int i = 0; i < count; ++i)
+        {
+            // 生成采样时间用于实现动态模糊
+            // intersect_info[i]._time = -0.1f;
+            intersect_info[i]._time = glm::linearRand(-0.5f, 0.5f) * _render_config.exposure + _render_config.time;
+            _render_config.camera->SpawnRay(screen_coord, origins[i], directions[i]);
+        }
+        const uint32_t hit_mask = _render_config.scene->Intersect(count, origins, directions, intersect_info);
+        for (int i = 0; i < count; ++i)
+        {
+            radiance[i] = trace_path(origins[i], directions[i], intersect_info[i], (hit_mask >> i) & 1u);
+        }
+    };
     auto start_time = std::chrono::high_resolution_clock::now();
-    _output.RayTrace(shader, _render_config.x_sample, _render_config.y_sample, _render_config.spp, _render_config.max_noise_tolerance);
+    _output.RayTrace(shader, _render_config.x_sample, _render_config.y_sample, _render_config.spp, _render_config.max_noise_tolerance, RAY_PACKET_SIZE);
     auto end_time = std::chrono::high_resolution_clock::now();
     PixelShader tone_mapping = [&](const int x, const int y) -> glm::vec4
     {
@@ -1,5 +1,10 @@
 #include <memory>
 #include <stack>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <tbb/tbb.h>
 
 #include "scene.h"
 #include "material.h"
@@ -7,78 +12,386 @@
 #include "light.h"
 #include "texture.h"
 
-void rendertoy::Scene::Init()
+// 待处理的插入和删除超过对象数的这个比例时, Commit 整体重建顶层 BVH 而不是继续修补.
+constexpr float TLAS_REBUILD_FRACTION = 0.125f;
+constexpr int TLAS_REBUILD_MIN_PENDING = 64;
+
+static void BuildOpacityMicromaps(const std::shared_ptr<rendertoy::Primitive> &object)
 {
-    _objects.Construct();
-    _dls_lights.clear();
-    for (const auto &light : _lights)
+#ifdef ALPHA_TEST
+    // Instances share a const mesh and may override its material, their hits sample the alpha texture.
+    if (std::shared_ptr<rendertoy::TriangleMesh> triangle_mesh = std::dynamic_pointer_cast<rendertoy::TriangleMesh>(object))
+    {
+        triangle_mesh->BuildOpacityMicromaps();
+    }
+#endif // ALPHA_TEST
+}
+
+void rendertoy::Scene::RegisterMaterial(Primitive &object)
+{
+    // 命中记录只携带整数 ID, 渲染线程不再对共享的 material 控制块做原子引用计数.
+    Instance *instance = dynamic_cast<Instance *>(&object);
+    // Instances without their own material use the one of the shared mesh.
+    const std::shared_ptr<IMaterial> &mat = instance && !object._mat ? instance->mesh()->mat() : object._mat;
+    if (!mat)
     {
-        _dls_lights.push_back(light);
+        object._mat_id = -1;
+        return;
     }
-    for (const auto &light : _inf_lights)
+    auto [it, inserted] = _material_ids.try_emplace(mat.get(), static_cast<int>(_materials.size()));
+    if (inserted)
     {
-        _dls_lights.push_back(light);
+        _materials.push_back(mat);
     }
-    for (const std::shared_ptr<Primitive> object : _objects.objects)
+    object._mat_id = it->second;
+}
+
+void rendertoy::Scene::BuildMaterialTable()
+{
+    _materials.clear();
+    _material_ids.clear();
+    for (const std::shared_ptr<Primitive> &object : _objects.objects)
+    {
+        RegisterMaterial(*object);
+    }
+}
+
+void rendertoy::Scene::AddDLSLight(const std::shared_ptr<Light> &light)
+{
+    if (_dls_light_index_valid)
     {
-        std::shared_ptr<Emissive> emissive_mat = std::dynamic_pointer_cast<Emissive>(object->_mat);
-        if (!emissive_mat)
+        _dls_light_index[light.get()] = static_cast<int>(_dls_lights.size());
+    }
+    _dls_lights.push_back(light);
+    if (_light_sampler)
+    {
+        _light_sampler->Push(light->Phi());
+    }
+}
+
+std::unordered_map<const rendertoy::Light *, int> &rendertoy::Scene::DLSLightIndex()
+{
+    if (!_dls_light_index_valid)
+    {
+        _dls_light_index.clear();
+        _dls_light_index.reserve(_dls_lights.size());
+        for (int i = 0; i < static_cast<int>(_dls_lights.size()); ++i)
         {
-            continue;
+            _dls_light_index[_dls_lights[i].get()] = i;
         }
+        _dls_light_index_valid = true;
+    }
+    return _dls_light_index;
+}
+
+void rendertoy::Scene::RemoveDLSLight(const Light *light)
+{
+    std::unordered_map<const Light *, int> &light_index = DLSLightIndex();
+    auto it = light_index.find(light);
+    if (it == light_index.end())
+    {
+        return;
+    }
+    // 用最后一个光源填补空位, 采样树只需改两个叶节点.
+    const int index = it->second;
+    const int last = static_cast<int>(_dls_lights.size()) - 1;
+    light_index.erase(it);
+    if (index != last)
+    {
+        _dls_lights[index] = std::move(_dls_lights[last]);
+        light_index[_dls_lights[index].get()] = index;
+        _light_sampler->Update(index, _light_sampler->power(last));
+    }
+    _dls_lights.pop_back();
+    _light_sampler->Pop();
+}
 
-        if (object->PRIMITIVE_TYPE() == FUNDAMENTAL_PRIMITIVE)
+const size_t rendertoy::Scene::SurfaceLightCount(const Primitive &object)
+{
+    if (!dynamic_cast<const Emissive *>(object._mat.get()))
+    {
+        return 0;
+    }
+    if (object.PRIMITIVE_TYPE() == FUNDAMENTAL_PRIMITIVE)
+    {
+        return 1;
+    }
+    const TriangleMesh *triangle_mesh = dynamic_cast<const TriangleMesh *>(&object);
+    return triangle_mesh ? triangle_mesh->triangle_count() : 0;
+}
+
+void rendertoy::Scene::MakeSurfaceLights(const std::shared_ptr<Primitive> &object, std::shared_ptr<Light> *out)
+{
+    const std::shared_ptr<Emissive> emissive_mat = std::static_pointer_cast<Emissive>(object->_mat);
+    if (object->PRIMITIVE_TYPE() == FUNDAMENTAL_PRIMITIVE)
+    {
+        std::shared_ptr<SurfaceLight> light = std::make_shared<SurfaceLight>(object, emissive_mat);
+        object->_surface_light = light.get();
+        out[0] = std::move(light);
+        return;
+    }
+    const std::vector<std::shared_ptr<Triangle>> &triangles = std::static_pointer_cast<TriangleMesh>(object)->MakeTriangles();
+    // 大型发光网格每个三角形一个光源, 分配本身就是瓶颈, 按三角形并行.
+    tbb::parallel_for(0, static_cast<int>(triangles.size()), [&](const int i)
+                      {
+        const std::shared_ptr<Triangle> &triangle = triangles[i];
+        triangle->_mat_id = object->_mat_id;
+        std::shared_ptr<SurfaceLight> light = std::make_shared<SurfaceLight>(triangle, emissive_mat);
+        triangle->_surface_light = light.get();
+        out[i] = std::move(light); });
+}
+
+void rendertoy::Scene::AddSurfaceLights(const std::shared_ptr<Primitive> &object)
+{
+    const size_t count = SurfaceLightCount(*object);
+    if (count == 0)
+    {
+        if (dynamic_cast<const Emissive *>(object->_mat.get()) && std::dynamic_pointer_cast<Instance>(object))
         {
-            _dls_lights.push_back(std::make_shared<SurfaceLight>(object, emissive_mat));
-            object->_surface_light = (SurfaceLight *)(_dls_lights[_dls_lights.size() - 1].get());
+            WARN << "Emissive instances are not sampled as lights, they are only hit by chance." << std::endl;
         }
-        else // COMBINED_PRIMITIVE
+        return;
+    }
+    std::vector<std::shared_ptr<Light>> lights(count);
+    MakeSurfaceLights(object, lights.data());
+    for (const std::shared_ptr<Light> &light : lights)
+    {
+        AddDLSLight(light);
+    }
+}
+
+void rendertoy::Scene::RemoveSurfaceLights(Primitive &object)
+{
+    if (object._surface_light)
+    {
+        RemoveDLSLight(object._surface_light);
+        object._surface_light = nullptr;
+    }
+    if (TriangleMesh *triangle_mesh = dynamic_cast<TriangleMesh *>(&object))
+    {
+        for (const std::shared_ptr<Triangle> &triangle : triangle_mesh->triangles())
         {
-            std::shared_ptr<TriangleMesh> triangle_mesh = std::dynamic_pointer_cast<TriangleMesh>(object);
-            if (triangle_mesh)
+            if (triangle->_surface_light)
             {
-                for (const std::shared_ptr<Triangle> &triangle : triangle_mesh->triangles())
-                {
-                    _dls_lights.push_back(std::make_shared<SurfaceLight>(triangle, emissive_mat));
-                    triangle->_surface_light = (SurfaceLight *)(_dls_lights[_dls_lights.size() - 1].get());
-                }
+                RemoveDLSLight(triangle->_surface_light);
+                triangle->_surface_light = nullptr;
             }
         }
     }
+}
+
+void rendertoy::Scene::Init()
+{
+    _objects.Construct(_bvh_config);
+    BuildMaterialTable();
+    const std::vector<std::shared_ptr<Primitive>> &objects = _objects.objects;
+    tbb::parallel_for(size_t(0), objects.size(), [&](const size_t i)
+                      { BuildOpacityMicromaps(objects[i]); });
+
+    // 先并行统计每个对象的光源数, 前缀和得到各自在 _dls_lights 中的区间, 再并行填入.
+    std::vector<size_t> light_offset(objects.size() + 1, 0);
+    std::atomic<int> emissive_instance_count = 0;
+    tbb::parallel_for(size_t(0), objects.size(), [&](const size_t i)
+                      {
+        light_offset[i + 1] = SurfaceLightCount(*objects[i]);
+        if (light_offset[i + 1] == 0 && dynamic_cast<const Emissive *>(objects[i]->_mat.get()) && dynamic_cast<const Instance *>(objects[i].get()))
+        {
+            ++emissive_instance_count;
+        } });
+    if (emissive_instance_count > 0)
+    {
+        WARN << emissive_instance_count << " emissive instances are not sampled as lights, they are only hit by chance." << std::endl;
+    }
+    light_offset[0] = _lights.size() + _inf_lights.size();
+    std::inclusive_scan(light_offset.begin(), light_offset.end(), light_offset.begin());
+
+    _light_sampler = nullptr;
+    _dls_light_index.clear();
+    _dls_light_index_valid = false;
+    _dls_lights.clear();
+    _dls_lights.resize(light_offset.back());
+    std::copy(_lights.begin(), _lights.end(), _dls_lights.begin());
+    std::copy(_inf_lights.begin(), _inf_lights.end(), _dls_lights.begin() + _lights.size());
+    tbb::parallel_for(size_t(0), objects.size(), [&](const size_t i)
+                      {
+        if (light_offset[i + 1] > light_offset[i])
+        {
+            MakeSurfaceLights(objects[i], _dls_lights.data() + light_offset[i]);
+        } });
     _light_sampler = std::make_shared<LightSampler>(_dls_lights);
 }
 
-const bool rendertoy::Scene::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo &intersect_info) const
+void rendertoy::Scene::AddObject(const std::shared_ptr<Primitive> &object)
 {
-#define ALPHA_TEST
-#ifdef ALPHA_TEST
-    bool ret = _objects.Intersect(origin, direction, intersect_info);
-    if (!ret)
+    _added_objects.push_back(object);
+}
+
+void rendertoy::Scene::RemoveObject(const std::shared_ptr<Primitive> &object)
+{
+    // 尚未提交的对象直接撤销.
+    if (std::erase(_added_objects, object) == 0)
     {
-        return ret;
+        _removed_objects.push_back(object);
     }
-    else
+}
+
+void rendertoy::Scene::MarkDirty(const std::shared_ptr<Primitive> &object)
+{
+    _dirty_objects.push_back(object);
+}
+
+void rendertoy::Scene::AddLight(const std::shared_ptr<Light> &light, const bool infinite)
+{
+    _added_lights.emplace_back(light, infinite);
+}
+
+void rendertoy::Scene::RemoveLight(const std::shared_ptr<Light> &light)
+{
+    if (std::erase_if(_added_lights, [&](const std::pair<std::shared_ptr<Light>, bool> &added)
+                      { return added.first == light; }) == 0)
     {
-        float alpha = intersect_info._mat->albedo()->Sample(intersect_info._uv).w;
-        if (glm::linearRand(0.0f, ONE_MINUS_EPSILON) > alpha)
+        _removed_lights.push_back(light);
+    }
+}
+
+void rendertoy::Scene::MarkDirty(const std::shared_ptr<Light> &light)
+{
+    _dirty_lights.insert(light.get());
+}
+
+void rendertoy::Scene::Commit()
+{
+    if (!_light_sampler)
+    {
+        // Nothing has been built yet, the edits simply go into the lists built by Init.
+        _objects.objects.insert(_objects.objects.end(), _added_objects.begin(), _added_objects.end());
+        for (const std::shared_ptr<Primitive> &object : _removed_objects)
+        {
+            std::erase(_objects.objects, object);
+        }
+        for (const auto &[light, infinite] : _added_lights)
         {
-            return Intersect(intersect_info._coord, direction, intersect_info);
+            (infinite ? _inf_lights : _lights).push_back(light);
         }
-        else
+        for (const std::shared_ptr<Light> &light : _removed_lights)
         {
-            return true;
+            std::erase(_lights, light);
+            std::erase(_inf_lights, light);
         }
+        _added_objects.clear();
+        _removed_objects.clear();
+        _dirty_objects.clear();
+        _added_lights.clear();
+        _removed_lights.clear();
+        _dirty_lights.clear();
+        Init();
+        return;
     }
-#else
+
+    for (const std::shared_ptr<Light> &light : _removed_lights)
+    {
+        RemoveDLSLight(light.get());
+        std::erase(_lights, light);
+        std::erase(_inf_lights, light);
+        _dirty_lights.erase(light.get());
+    }
+    for (const auto &[light, infinite] : _added_lights)
+    {
+        (infinite ? _inf_lights : _lights).push_back(light);
+        AddDLSLight(light);
+    }
+    for (const Light *light : _dirty_lights)
+    {
+        auto it = DLSLightIndex().find(light);
+        if (it != _dls_light_index.end())
+        {
+            _light_sampler->Update(it->second, light->Phi());
+        }
+    }
+
+    // Objects that could not be refit out of the BVH are still reached and skipped until it is rebuilt.
+    bool refit = true;
+    for (const std::shared_ptr<Primitive> &object : _removed_objects)
+    {
+        const int index = _objects.Find(object.get());
+        if (index == -1)
+        {
+            WARN << "Removing an object that is not in the scene." << std::endl;
+            continue;
+        }
+        RemoveSurfaceLights(*object);
+        refit &= _objects.Remove(index);
+    }
+    std::vector<int> dirty;
+    for (const std::shared_ptr<Primitive> &object : _dirty_objects)
+    {
+        const int index = _objects.Find(object.get());
+        if (index == -1)
+        {
+            // Removed, or added in this commit anyway.
+            continue;
+        }
+        // The material may have changed as well, the object is taken in again apart from the BVH.
+        RegisterMaterial(*object);
+        BuildOpacityMicromaps(object);
+        RemoveSurfaceLights(*object);
+        AddSurfaceLights(object);
+        dirty.push_back(index);
+    }
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+    for (const std::shared_ptr<Primitive> &object : _added_objects)
+    {
+        RegisterMaterial(*object);
+        BuildOpacityMicromaps(object);
+        AddSurfaceLights(object);
+    }
+
+    const int pending = _objects.PendingCount() + static_cast<int>(_added_objects.size());
+    const bool rebuild = pending > std::max(TLAS_REBUILD_MIN_PENDING, static_cast<int>(TLAS_REBUILD_FRACTION * _objects.objects.size())) || !refit || !_objects.Refit(dirty);
+    // Insert takes either all added objects or none.
+    if (rebuild || !_objects.Insert(_added_objects))
+    {
+        _objects.objects.insert(_objects.objects.end(), _added_objects.begin(), _added_objects.end());
+        _objects.Construct(_bvh_config);
+        INFO << "Scene::Commit rebuilt the top-level BVH over " << _objects.objects.size() << " object(s)." << std::endl;
+    }
+
+    _added_objects.clear();
+    _removed_objects.clear();
+    _dirty_objects.clear();
+    _added_lights.clear();
+    _removed_lights.clear();
+    _dirty_lights.clear();
+}
+
+const bool rendertoy::Scene::Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo &intersect_info) const
+{
+    // Transparent surfaces are skipped by the alpha test of the primitives during traversal.
     return _objects.Intersect(origin, direction, intersect_info);
-#endif
+}
+
+const uint32_t rendertoy::Scene::Intersect(const int count, const glm::vec3 *origins, const glm::vec3 *directions, IntersectInfo *intersect_info) const
+{
+    RayPacket packet;
+    packet.size = count;
+    for (int i = 0; i < count; ++i)
+    {
+        packet.origins[i] = origins[i];
+        packet.directions[i] = directions[i];
+        packet.times[i] = intersect_info[i]._time;
+    }
+    return _objects.Intersect(packet, intersect_info);
 }
 
 const bool rendertoy::Scene::Intersect(const glm::vec3 &p0, const glm::vec3 &p1) const
 {
-    auto direction = glm::normalize(p1 - p0);
-    IntersectInfo ii_discard;
-    return Intersect(p0, direction, ii_discard);
+    return Occluded(p0, glm::normalize(p1 - p0), glm::length(p1 - p0));
+}
+
+const bool rendertoy::Scene::Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max, const float time) const
+{
+    return _objects.Occluded(origin, direction, t_max, time);
 }
 
 const glm::vec3 rendertoy::Scene::SampleLights(const IntersectInfo &intersect_info, float &pdf, glm::vec3 &direction, const bool consider_normal, bool &do_heuristic) const
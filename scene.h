@@ -2,6 +2,8 @@
 
 #include <memory>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "rendertoy_internal.h"
 #include "accelerate.h"
@@ -12,12 +14,40 @@ namespace rendertoy
     class Scene
     {
     private:
-        BVH<Primitive> _objects;
+        BVH<Primitive, PrimitiveTable> _objects;
         std::vector<std::shared_ptr<Light>> _dls_lights;
         std::vector<std::shared_ptr<Light>> _lights;
         std::vector<std::shared_ptr<Light>> _inf_lights;
         std::shared_ptr<LightSampler> _light_sampler;
-        
+        BVHConfig _bvh_config;
+        /// @brief Materials of the objects, indexed by the material IDs carried in hit records.
+        std::vector<std::shared_ptr<IMaterial>> _materials;
+        std::unordered_map<const IMaterial *, int> _material_ids;
+        /// @brief Index of every light in _dls_lights, for patching the light sampler.
+        /// Built on the first Commit that needs it, Init does not pay for it.
+        std::unordered_map<const Light *, int> _dls_light_index;
+        bool _dls_light_index_valid = false;
+
+        // Changes waiting for Commit.
+        std::vector<std::shared_ptr<Primitive>> _added_objects;
+        std::vector<std::shared_ptr<Primitive>> _removed_objects;
+        std::vector<std::shared_ptr<Primitive>> _dirty_objects;
+        std::vector<std::pair<std::shared_ptr<Light>, bool>> _added_lights; // (light, infinite)
+        std::vector<std::shared_ptr<Light>> _removed_lights;
+        std::unordered_set<const Light *> _dirty_lights;
+
+        void BuildMaterialTable();
+        void RegisterMaterial(Primitive &object);
+        void AddDLSLight(const std::shared_ptr<Light> &light);
+        void RemoveDLSLight(const Light *light);
+        std::unordered_map<const Light *, int> &DLSLightIndex();
+        /// @brief Number of SurfaceLights an object gets, 0 unless its material is emissive.
+        static const size_t SurfaceLightCount(const Primitive &object);
+        /// @brief Writes the SurfaceLights of an emissive object to out[0, SurfaceLightCount(object)).
+        static void MakeSurfaceLights(const std::shared_ptr<Primitive> &object, std::shared_ptr<Light> *out);
+        /// @brief Create the SurfaceLights of an emissive object, or drop them again.
+        void AddSurfaceLights(const std::shared_ptr<Primitive> &object);
+        void RemoveSurfaceLights(Primitive &object);
 
         MATERIAL_SOCKET(hdr_background, Color);
 
@@ -54,9 +84,51 @@ namespace rendertoy
             return _inf_lights;
         }
 
+        const BVHConfig &bvh_config() const
+        {
+            return _bvh_config;
+        }
+        BVHConfig &bvh_config()
+        {
+            return _bvh_config;
+        }
+
+        /// @note Materials are collected into the material table here, set mat() of the objects before calling it.
         void Init();
+        /// @brief Incremental edits of an initialized scene, for interactive look development. They take effect at the next Commit.
+        /// @note Do not render while committing. Objects and lights are identified by pointer, objects() and lights() must not be edited directly after Init.
+        void AddObject(const std::shared_ptr<Primitive> &object);
+        void RemoveObject(const std::shared_ptr<Primitive> &object);
+        /// @brief The bounds, shape or material of object changed, e.g. by Instance::SetTransform.
+        void MarkDirty(const std::shared_ptr<Primitive> &object);
+        void AddLight(const std::shared_ptr<Light> &light, const bool infinite = false);
+        void RemoveLight(const std::shared_ptr<Light> &light);
+        /// @brief The power of light changed.
+        void MarkDirty(const std::shared_ptr<Light> &light);
+        /// @brief Apply the pending edits. Objects are refit or inserted into the top-level BVH and lights patched into the light sampler,
+        /// at a cost that follows the number of edits. Falls back to Init before the first one, and rebuilds the BVH once edits pile up.
+        void Commit();
+        /// @brief Material of a hit, nullptr for the ID of an object without material.
+        const IMaterial *material(const int mat_id) const
+        {
+            return mat_id < 0 ? nullptr : _materials[mat_id].get();
+        }
         const bool Intersect(const glm::vec3 &origin, const glm::vec3 &direction, IntersectInfo &intersect_info) const;
+        /// @brief Intersect for count <= MAX_RAY_PACKET_SIZE coherent rays, e.g. camera rays of neighbouring samples, traversed as one packet.
+        /// @return Bit i is set if ray i hit. intersect_info[i]._time is read as in Intersect.
+        const uint32_t Intersect(const int count, const glm::vec3 *origins, const glm::vec3 *directions, IntersectInfo *intersect_info) const;
+        const uint32_t Intersect8(const glm::vec3 (&origins)[8], const glm::vec3 (&directions)[8], IntersectInfo (&intersect_info)[8]) const
+        {
+            return Intersect(8, origins, directions, intersect_info);
+        }
+        const uint32_t Intersect16(const glm::vec3 (&origins)[16], const glm::vec3 (&directions)[16], IntersectInfo (&intersect_info)[16]) const
+        {
+            return Intersect(16, origins, directions, intersect_info);
+        }
+        /// @brief Whether the segment from p0 to p1 is blocked.
         const bool Intersect(const glm::vec3 &p0, const glm::vec3 &p1) const;
+        /// @brief Occlusion-only query for shadow rays, terminates at the first opaque hit within (0, t_max).
+        const bool Occluded(const glm::vec3 &origin, const glm::vec3 &direction, const float t_max = std::numeric_limits<float>::infinity(), const float time = 0.0f) const;
         const glm::vec3 SampleLights(const IntersectInfo &intersect_info, float &pdf, glm::vec3 &direction, const bool consider_normal, bool &do_heuristic) const;
         const glm::vec3 SampleLights(const VolumeInteraction &v_i, float &pdf, glm::vec3 &direction, bool &do_heuristic) const;
         const Light *SampleLights(float *pmf) const;
@@ -0,0 +1,488 @@
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <tbb/tbb.h>
+
+#include "sdf.h"
+#include "logger.h"
+
+static rendertoy::SDFExpr MakeExpr(const rendertoy::SDFOp op, const glm::vec4 &param, const rendertoy::SDFExpr *a = nullptr, const rendertoy::SDFExpr *b = nullptr)
+{
+    rendertoy::SDFNode node{op, param};
+    if (a)
+        node._a = a->node();
+    if (b)
+        node._b = b->node();
+    return rendertoy::SDFExpr(std::make_shared<const rendertoy::SDFNode>(std::move(node)));
+}
+
+rendertoy::SDFExpr rendertoy::SDFSphere(const float radius)
+{
+    return MakeExpr(SDFOp::SPHERE, glm::vec4(radius, 0.0f, 0.0f, 0.0f));
+}
+
+rendertoy::SDFExpr rendertoy::SDFBox(const glm::vec3 &half_extent)
+{
+    return MakeExpr(SDFOp::BOX, glm::vec4(half_extent, 0.0f));
+}
+
+rendertoy::SDFExpr rendertoy::SDFTorus(const glm::vec2 &radii)
+{
+    return MakeExpr(SDFOp::TORUS, glm::vec4(radii.x, radii.y, 0.0f, 0.0f));
+}
+
+rendertoy::SDFExpr rendertoy::SDFUnion(const SDFExpr &a, const SDFExpr &b)
+{
+    return MakeExpr(SDFOp::UNION, glm::vec4(0.0f), &a, &b);
+}
+
+rendertoy::SDFExpr rendertoy::SDFSmoothUnion(const SDFExpr &a, const SDFExpr &b, const float k)
+{
+    return MakeExpr(SDFOp::SMOOTH_UNION, glm::vec4(k, 0.0f, 0.0f, 0.0f), &a, &b);
+}
+
+rendertoy::SDFExpr rendertoy::SDFIntersect(const SDFExpr &a, const SDFExpr &b)
+{
+    return MakeExpr(SDFOp::INTERSECT, glm::vec4(0.0f), &a, &b);
+}
+
+rendertoy::SDFExpr rendertoy::SDFRound(const SDFExpr &a, const float rad)
+{
+    return MakeExpr(SDFOp::ROUND, glm::vec4(rad, 0.0f, 0.0f, 0.0f), &a);
+}
+
+rendertoy::SDFExpr rendertoy::SDFTranslate(const SDFExpr &a, const glm::vec3 &p)
+{
+    return MakeExpr(SDFOp::TRANSLATE, glm::vec4(p, 0.0f), &a);
+}
+
+rendertoy::SDFExpr rendertoy::operator-(const SDFExpr &a)
+{
+    return MakeExpr(SDFOp::NEGATE, glm::vec4(0.0f), &a);
+}
+
+rendertoy::SDFExpr rendertoy::operator-(const SDFExpr &a, const SDFExpr &b)
+{
+    return SDFIntersect(a, -b);
+}
+
+rendertoy::SDFExpr rendertoy::operator+(const SDFExpr &a, const SDFExpr &b)
+{
+    return SDFUnion(a, b);
+}
+
+// https://iquilezles.org/articles/distfunctions/
+rendertoy::SDFExpr rendertoy::SDFTwist(const SDFExpr &a, const glm::vec3 &p, const float k)
+{
+    return MakeExpr(SDFOp::TWIST, glm::vec4(p, k), &a);
+}
+
+/// @brief Forward-mode dual number, carries the gradient of a value with respect to the point the tape is evaluated at.
+struct SDFDual
+{
+    float v;
+    glm::vec3 d;
+
+    SDFDual(const float v = 0.0f, const glm::vec3 &d = glm::vec3(0.0f)) : v(v), d(d) {}
+};
+
+static inline SDFDual operator+(const SDFDual &a, const SDFDual &b) { return SDFDual(a.v + b.v, a.d + b.d); }
+static inline SDFDual operator-(const SDFDual &a, const SDFDual &b) { return SDFDual(a.v - b.v, a.d - b.d); }
+static inline SDFDual operator*(const SDFDual &a, const SDFDual &b) { return SDFDual(a.v * b.v, a.d * b.v + a.v * b.d); }
+static inline SDFDual operator/(const SDFDual &a, const float b) { return SDFDual(a.v / b, a.d / b); }
+static inline SDFDual operator-(const SDFDual &a) { return SDFDual(-a.v, -a.d); }
+
+static inline float Sqrt(const float a) { return std::sqrt(a); }
+static inline float Abs(const float a) { return std::abs(a); }
+static inline float Min(const float a, const float b) { return std::min(a, b); }
+static inline float Max(const float a, const float b) { return std::max(a, b); }
+static inline float Sin(const float a) { return std::sin(a); }
+static inline float Cos(const float a) { return std::cos(a); }
+
+static inline SDFDual Sqrt(const SDFDual &a)
+{
+    float s = std::sqrt(a.v);
+    // 在 0 处取次梯度 0, 而不是 inf.
+    return SDFDual(s, s > 0.0f ? a.d * (0.5f / s) : glm::vec3(0.0f));
+}
+static inline SDFDual Abs(const SDFDual &a) { return a.v < 0.0f ? -a : a; }
+static inline SDFDual Min(const SDFDual &a, const SDFDual &b) { return b.v < a.v ? b : a; }
+static inline SDFDual Max(const SDFDual &a, const SDFDual &b) { return b.v > a.v ? b : a; }
+static inline SDFDual Sin(const SDFDual &a) { return SDFDual(std::sin(a.v), a.d * std::cos(a.v)); }
+static inline SDFDual Cos(const SDFDual &a) { return SDFDual(std::cos(a.v), a.d * -std::sin(a.v)); }
+
+/// @brief SDF_BATCH_SIZE values evaluated in lockstep, every operation is a fixed-length loop the compiler turns into SIMD.
+struct SDFLanes
+{
+    float v[rendertoy::SDF_BATCH_SIZE];
+
+    SDFLanes() = default;
+    SDFLanes(const float a)
+    {
+        for (int i = 0; i < rendertoy::SDF_BATCH_SIZE; ++i)
+            v[i] = a;
+    }
+};
+
+#define SDF_LANES_MAP(expr)                             \
+    SDFLanes r;                                         \
+    for (int i = 0; i < rendertoy::SDF_BATCH_SIZE; ++i) \
+        r.v[i] = expr;                                  \
+    return r;
+
+static inline SDFLanes operator+(const SDFLanes &a, const SDFLanes &b) { SDF_LANES_MAP(a.v[i] + b.v[i]) }
+static inline SDFLanes operator-(const SDFLanes &a, const SDFLanes &b) { SDF_LANES_MAP(a.v[i] - b.v[i]) }
+static inline SDFLanes operator*(const SDFLanes &a, const SDFLanes &b) { SDF_LANES_MAP(a.v[i] * b.v[i]) }
+static inline SDFLanes operator/(const SDFLanes &a, const float b) { SDF_LANES_MAP(a.v[i] / b) }
+static inline SDFLanes operator-(const SDFLanes &a) { SDF_LANES_MAP(-a.v[i]) }
+static inline SDFLanes Sqrt(const SDFLanes &a) { SDF_LANES_MAP(std::sqrt(a.v[i])) }
+static inline SDFLanes Abs(const SDFLanes &a) { SDF_LANES_MAP(std::abs(a.v[i])) }
+static inline SDFLanes Min(const SDFLanes &a, const SDFLanes &b) { SDF_LANES_MAP(b.v[i] < a.v[i] ? b.v[i] : a.v[i]) }
+static inline SDFLanes Max(const SDFLanes &a, const SDFLanes &b) { SDF_LANES_MAP(b.v[i] > a.v[i] ? b.v[i] : a.v[i]) }
+static inline SDFLanes Sin(const SDFLanes &a) { SDF_LANES_MAP(std::sin(a.v[i])) }
+static inline SDFLanes Cos(const SDFLanes &a) { SDF_LANES_MAP(std::cos(a.v[i])) }
+
+#undef SDF_LANES_MAP
+
+template <typename T>
+struct SDFPoint
+{
+    T x, y, z;
+};
+
+template <typename T>
+static inline T SmoothMin(const T &d1, const T &d2, const float k)
+{
+    // 关于 d1, d2 对称, 编译时可以交换子树的顺序.
+    T h = Min(Max(T(0.5f) + (d2 - d1) / (2.0f * k), T(0.0f)), T(1.0f));
+    return d2 + (d1 - d2) * h - T(k) * h * (T(1.0f) - h);
+}
+
+template <typename T>
+static inline T EvaluateLeaf(const rendertoy::SDFOp op, const glm::vec4 &param, const SDFPoint<T> &p)
+{
+    using namespace rendertoy;
+    switch (op)
+    {
+    case SDFOp::SPHERE:
+        return Sqrt(p.x * p.x + p.y * p.y + p.z * p.z) - T(param.x);
+    case SDFOp::BOX:
+    {
+        T qx = Abs(p.x) - T(param.x);
+        T qy = Abs(p.y) - T(param.y);
+        T qz = Abs(p.z) - T(param.z);
+        T ox = Max(qx, T(0.0f));
+        T oy = Max(qy, T(0.0f));
+        T oz = Max(qz, T(0.0f));
+        return Sqrt(ox * ox + oy * oy + oz * oz) + Min(Max(qx, Max(qy, qz)), T(0.0f));
+    }
+    case SDFOp::TORUS:
+    {
+        T qx = Sqrt(p.x * p.x + p.y * p.y) - T(param.x);
+        return Sqrt(qx * qx + p.z * p.z) - T(param.y);
+    }
+    default:
+        return T(0.0f);
+    }
+}
+
+template <typename T>
+static inline SDFPoint<T> TwistCoord(const glm::vec4 &param, const SDFPoint<T> &p)
+{
+    T qx = p.x - T(param.x);
+    T qy = p.y - T(param.y);
+    T qz = p.z - T(param.z);
+    T c = Cos(T(param.w) * qy);
+    T s = Sin(T(param.w) * qy);
+    return {c * qx - s * qz + T(param.x), p.y, s * qx + c * qz + T(param.z)};
+}
+
+static inline float EvaluateFunction(const rendertoy::SDFFunction &func, const SDFPoint<float> &p)
+{
+    return func(glm::vec3(p.x, p.y, p.z));
+}
+
+static inline SDFDual EvaluateFunction(const rendertoy::SDFFunction &func, const SDFPoint<SDFDual> &p)
+{
+    // 不透明的函数只能差分, 再按链式法则乘上坐标的导数.
+    const float h = 0.001f;
+    glm::vec3 c(p.x.v, p.y.v, p.z.v);
+    float f = func(c);
+    glm::vec3 g((func(c + glm::vec3(h, 0.0f, 0.0f)) - f) / h,
+                (func(c + glm::vec3(0.0f, h, 0.0f)) - f) / h,
+                (func(c + glm::vec3(0.0f, 0.0f, h)) - f) / h);
+    return SDFDual(f, g.x * p.x.d + g.y * p.y.d + g.z * p.z.d);
+}
+
+static inline SDFLanes EvaluateFunction(const rendertoy::SDFFunction &func, const SDFPoint<SDFLanes> &p)
+{
+    SDFLanes r;
+    for (int i = 0; i < rendertoy::SDF_BATCH_SIZE; ++i)
+    {
+        r.v[i] = func(glm::vec3(p.x.v[i], p.y.v[i], p.z.v[i]));
+    }
+    return r;
+}
+
+template <typename T>
+static T RunTape(const std::vector<rendertoy::SDFInstruction> &code, const std::vector<rendertoy::SDFFunction> &funcs, const SDFPoint<T> &p)
+{
+    using namespace rendertoy;
+    std::array<T, SDF_TAPE_STACK_SIZE> values;
+    std::array<SDFPoint<T>, SDF_TAPE_STACK_SIZE> coords;
+    int sp = 0;
+    int cp = 0;
+    coords[0] = p;
+    for (const SDFInstruction &ins : code)
+    {
+        switch (ins._op)
+        {
+        case SDFOp::SPHERE:
+        case SDFOp::BOX:
+        case SDFOp::TORUS:
+            values[sp++] = EvaluateLeaf(ins._op, ins._param, coords[cp]);
+            break;
+        case SDFOp::FUNCTION:
+            values[sp++] = EvaluateFunction(funcs[ins._func], coords[cp]);
+            break;
+        case SDFOp::UNION:
+            --sp;
+            values[sp - 1] = Min(values[sp - 1], values[sp]);
+            break;
+        case SDFOp::SMOOTH_UNION:
+            --sp;
+            values[sp - 1] = SmoothMin(values[sp - 1], values[sp], ins._param.x);
+            break;
+        case SDFOp::INTERSECT:
+            --sp;
+            values[sp - 1] = Max(values[sp - 1], values[sp]);
+            break;
+        case SDFOp::NEGATE:
+            values[sp - 1] = -values[sp - 1];
+            break;
+        case SDFOp::ROUND:
+            values[sp - 1] = values[sp - 1] - T(ins._param.x);
+            break;
+        case SDFOp::TRANSLATE:
+            coords[cp + 1] = {coords[cp].x - T(ins._param.x), coords[cp].y - T(ins._param.y), coords[cp].z - T(ins._param.z)};
+            ++cp;
+            break;
+        case SDFOp::TWIST:
+            coords[cp + 1] = TwistCoord(ins._param, coords[cp]);
+            ++cp;
+            break;
+        case SDFOp::POP_COORD:
+            --cp;
+            break;
+        }
+    }
+    return values[0];
+}
+
+/// @brief Walks the graph recursively, used when an expression nests too deep for the tape stacks.
+static float EvaluateNode(const rendertoy::SDFNode *node, const SDFPoint<float> &p)
+{
+    using namespace rendertoy;
+    switch (node->_op)
+    {
+    case SDFOp::FUNCTION:
+        return EvaluateFunction(node->_func, p);
+    case SDFOp::UNION:
+        return std::min(EvaluateNode(node->_a.get(), p), EvaluateNode(node->_b.get(), p));
+    case SDFOp::SMOOTH_UNION:
+        return SmoothMin(EvaluateNode(node->_a.get(), p), EvaluateNode(node->_b.get(), p), node->_param.x);
+    case SDFOp::INTERSECT:
+        return std::max(EvaluateNode(node->_a.get(), p), EvaluateNode(node->_b.get(), p));
+    case SDFOp::NEGATE:
+        return -EvaluateNode(node->_a.get(), p);
+    case SDFOp::ROUND:
+        return EvaluateNode(node->_a.get(), p) - node->_param.x;
+    case SDFOp::TRANSLATE:
+        return EvaluateNode(node->_a.get(), {p.x - node->_param.x, p.y - node->_param.y, p.z - node->_param.z});
+    case SDFOp::TWIST:
+        return EvaluateNode(node->_a.get(), TwistCoord(node->_param, p));
+    default:
+        return EvaluateLeaf(node->_op, node->_param, p);
+    }
+}
+
+struct SDFTapeCode
+{
+    std::vector<rendertoy::SDFInstruction> code;
+    int value_depth = 0;
+    int coord_depth = 0;
+};
+
+/// @brief Emits node in postfix order. Binary operators are commutative, the child needing the deeper value stack is emitted first.
+static SDFTapeCode EmitNode(const rendertoy::SDFNode *node, std::vector<rendertoy::SDFFunction> &funcs)
+{
+    using namespace rendertoy;
+    SDFTapeCode out;
+    switch (node->_op)
+    {
+    case SDFOp::UNION:
+    case SDFOp::SMOOTH_UNION:
+    case SDFOp::INTERSECT:
+    {
+        SDFTapeCode a = EmitNode(node->_a.get(), funcs);
+        SDFTapeCode b = EmitNode(node->_b.get(), funcs);
+        if (a.value_depth < b.value_depth)
+        {
+            std::swap(a, b);
+        }
+        out.code = std::move(a.code);
+        out.code.insert(out.code.end(), b.code.begin(), b.code.end());
+        out.code.push_back({node->_op, 0, node->_param});
+        out.value_depth = std::max(a.value_depth, b.value_depth + 1);
+        out.coord_depth = std::max(a.coord_depth, b.coord_depth);
+        return out;
+    }
+    case SDFOp::NEGATE:
+    case SDFOp::ROUND:
+        out = EmitNode(node->_a.get(), funcs);
+        out.code.push_back({node->_op, 0, node->_param});
+        return out;
+    case SDFOp::TRANSLATE:
+    case SDFOp::TWIST:
+    {
+        glm::vec4 param = node->_param;
+        const SDFNode *child = node->_a.get();
+        // 连续的平移合并为一次.
+        while (node->_op == SDFOp::TRANSLATE && child->_op == SDFOp::TRANSLATE)
+        {
+            param += child->_param;
+            child = child->_a.get();
+        }
+        SDFTapeCode inner = EmitNode(child, funcs);
+        out.code.reserve(inner.code.size() + 2);
+        out.code.push_back({node->_op, 0, param});
+        out.code.insert(out.code.end(), inner.code.begin(), inner.code.end());
+        out.code.push_back({SDFOp::POP_COORD, 0, glm::vec4(0.0f)});
+        out.value_depth = inner.value_depth;
+        out.coord_depth = inner.coord_depth + 1;
+        return out;
+    }
+    case SDFOp::FUNCTION:
+        out.code.push_back({SDFOp::FUNCTION, static_cast<uint32_t>(funcs.size()), glm::vec4(0.0f)});
+        funcs.push_back(node->_func);
+        out.value_depth = 1;
+        return out;
+    default:
+        out.code.push_back({node->_op, 0, node->_param});
+        out.value_depth = 1;
+        return out;
+    }
+}
+
+rendertoy::SDFTape::SDFTape(const SDFExpr &expr)
+{
+    SDFTapeCode tape = EmitNode(expr.node().get(), _funcs);
+    if (tape.value_depth > SDF_TAPE_STACK_SIZE || tape.coord_depth >= SDF_TAPE_STACK_SIZE)
+    {
+        WARN << "SDF expression nests too deep for the tape, evaluating the graph recursively." << std::endl;
+        std::shared_ptr<const SDFNode> node = expr.node();
+        _funcs.clear();
+        _funcs.push_back([node](glm::vec3 p) -> float
+                         { return EvaluateNode(node.get(), {p.x, p.y, p.z}); });
+        _code = {{SDFOp::FUNCTION, 0, glm::vec4(0.0f)}};
+        return;
+    }
+    _code = std::move(tape.code);
+}
+
+const float rendertoy::SDFTape::Evaluate(const glm::vec3 &p) const
+{
+    return RunTape<float>(_code, _funcs, {p.x, p.y, p.z});
+}
+
+void rendertoy::SDFTape::EvaluateBatch(const int count, const float *x, const float *y, const float *z, float *dist) const
+{
+    // 空余的 lane 重复第一个点, 使不透明函数也只看到有效坐标.
+    SDFPoint<SDFLanes> p;
+    for (int i = 0; i < SDF_BATCH_SIZE; ++i)
+    {
+        const int src = i < count ? i : 0;
+        p.x.v[i] = x[src];
+        p.y.v[i] = y[src];
+        p.z.v[i] = z[src];
+    }
+    SDFLanes result = RunTape<SDFLanes>(_code, _funcs, p);
+    std::copy(result.v, result.v + count, dist);
+}
+
+const float rendertoy::SDFTape::EvaluateGrad(const glm::vec3 &p, glm::vec3 &grad) const
+{
+    SDFPoint<SDFDual> seed{SDFDual(p.x, glm::vec3(1.0f, 0.0f, 0.0f)), SDFDual(p.y, glm::vec3(0.0f, 1.0f, 0.0f)), SDFDual(p.z, glm::vec3(0.0f, 0.0f, 1.0f))};
+    SDFDual result = RunTape<SDFDual>(_code, _funcs, seed);
+    grad = result.d;
+    return result.v;
+}
+
+rendertoy::SDFBrickMap::SDFBrickMap(const SDFTape &tape, const BBox &bbox, const int resolution)
+    : _bbox(bbox)
+{
+    const glm::vec3 extent = bbox.Diagonal();
+    _cell_size = std::max(extent.x, std::max(extent.y, extent.z)) / static_cast<float>(std::max(resolution, 1));
+    const float brick_size = _cell_size * SDF_BRICK_SIZE;
+    _brick_count = glm::max(glm::ivec3(glm::ceil(extent / brick_size)), glm::ivec3(1));
+    const int brick_num = _brick_count.x * _brick_count.y * _brick_count.z;
+    const float brick_half_diag = 0.5f * std::sqrt(3.0f) * brick_size;
+    auto brick_origin = [&](const int b) -> glm::vec3
+    {
+        glm::ivec3 idx(b % _brick_count.x, (b / _brick_count.x) % _brick_count.y, b / (_brick_count.x * _brick_count.y));
+        return _bbox._pmin + glm::vec3(idx) * brick_size;
+    };
+
+    _brick_dist.resize(brick_num);
+    tbb::parallel_for(0, brick_num, [&](const int b)
+                      { _brick_dist[b] = tape.Evaluate(brick_origin(b) + 0.5f * brick_size); });
+
+    // 只为靠近表面的 brick 分配格子: 更远处中心距离给出的步长已不小于真实距离的一半, 完全在内部的 brick 不会被行进到.
+    _brick_offset.resize(brick_num);
+    int allocated = 0;
+    for (int b = 0; b < brick_num; ++b)
+    {
+        const bool near = _brick_dist[b] >= -brick_half_diag && _brick_dist[b] < 2.0f * brick_half_diag;
+        _brick_offset[b] = near ? allocated++ : -1;
+    }
+    constexpr int cells_per_brick = SDF_BRICK_SIZE * SDF_BRICK_SIZE * SDF_BRICK_SIZE;
+    _cells.resize(static_cast<size_t>(allocated) * cells_per_brick);
+    tbb::parallel_for(0, brick_num, [&](const int b)
+                      {
+        if (_brick_offset[b] < 0)
+        {
+            return;
+        }
+        const glm::vec3 origin = brick_origin(b);
+        float *cells = &_cells[static_cast<size_t>(_brick_offset[b]) * cells_per_brick];
+        for (int c = 0; c < cells_per_brick; ++c)
+        {
+            glm::vec3 idx(c % SDF_BRICK_SIZE, (c / SDF_BRICK_SIZE) % SDF_BRICK_SIZE, c / (SDF_BRICK_SIZE * SDF_BRICK_SIZE));
+            cells[c] = tape.Evaluate(origin + (idx + 0.5f) * _cell_size);
+        } });
+    INFO << "Baked SDF into " << allocated << " of " << brick_num << " bricks, " << bytes() / 1024 << " KiB." << std::endl;
+}
+
+const float rendertoy::SDFBrickMap::Bound(const glm::vec3 &p) const
+{
+    const glm::vec3 rel = (p - _bbox._pmin) / _cell_size;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (!(rel[axis] >= 0.0f && rel[axis] < static_cast<float>(_brick_count[axis] * SDF_BRICK_SIZE)))
+        {
+            return -std::numeric_limits<float>::infinity();
+        }
+    }
+    const glm::ivec3 cell = glm::min(glm::ivec3(rel), _brick_count * SDF_BRICK_SIZE - 1);
+    const glm::ivec3 brick = cell / SDF_BRICK_SIZE;
+    const int b = brick.x + _brick_count.x * (brick.y + _brick_count.y * brick.z);
+    if (_brick_offset[b] < 0)
+    {
+        const glm::vec3 center = (glm::vec3(brick) + 0.5f) * static_cast<float>(SDF_BRICK_SIZE);
+        return _brick_dist[b] - glm::length(rel - center) * _cell_size;
+    }
+    const glm::ivec3 local = cell - brick * SDF_BRICK_SIZE;
+    const int c = local.x + SDF_BRICK_SIZE * (local.y + SDF_BRICK_SIZE * local.z);
+    const float dist = _cells[static_cast<size_t>(_brick_offset[b]) * SDF_BRICK_SIZE * SDF_BRICK_SIZE * SDF_BRICK_SIZE + c];
+    return dist - glm::length(rel - (glm::vec3(cell) + 0.5f)) * _cell_size;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <concepts>
+#include <type_traits>
+
+#include "rendertoy_internal.h"
+#include "accelerate.h"
+
+namespace rendertoy
+{
+    enum class SDFOp : uint8_t
+    {
+        // 叶节点, 在当前坐标下求值并压入一个距离.
+        SPHERE,
+        BOX,
+        TORUS,
+        FUNCTION,
+        // 弹出两个距离, 压入一个.
+        UNION,
+        SMOOTH_UNION,
+        INTERSECT,
+        // 修改栈顶距离.
+        NEGATE,
+        ROUND,
+        // 为子树压入变换后的坐标, 直到对应的 POP_COORD.
+        TRANSLATE,
+        TWIST,
+        POP_COORD
+    };
+
+    /// @brief Node of an SDF expression graph. Subtrees are shared, never modified after construction.
+    struct SDFNode
+    {
+        SDFOp _op;
+        glm::vec4 _param = glm::vec4(0.0f);
+        std::shared_ptr<const SDFNode> _a = nullptr;
+        std::shared_ptr<const SDFNode> _b = nullptr;
+        SDFFunction _func = nullptr;
+    };
+
+    /// @brief Handle to an SDF expression graph, built by the SDF* combinators and compiled into an SDFTape by the SDF primitive.
+    /// @note Any callable float(glm::vec3) converts to an opaque FUNCTION leaf, prefer the built-in leaves where possible.
+    class SDFExpr
+    {
+    private:
+        std::shared_ptr<const SDFNode> _node;
+
+    public:
+        SDFExpr() = delete;
+        explicit SDFExpr(const std::shared_ptr<const SDFNode> &node) : _node(node) {}
+        template <typename F>
+            requires(!std::same_as<std::remove_cvref_t<F>, SDFExpr> && std::is_invocable_r_v<float, F, glm::vec3>)
+        SDFExpr(F &&func)
+            : _node(std::make_shared<const SDFNode>(SDFNode{SDFOp::FUNCTION, glm::vec4(0.0f), nullptr, nullptr, SDFFunction(std::forward<F>(func))})) {}
+        const std::shared_ptr<const SDFNode> &node() const
+        {
+            return _node;
+        }
+    };
+
+    SDFExpr SDFSphere(const float radius);
+    /// @brief Box centered at the origin.
+    SDFExpr SDFBox(const glm::vec3 &half_extent);
+    /// @brief Torus in the xy plane around the z axis, radii = (major, minor).
+    SDFExpr SDFTorus(const glm::vec2 &radii);
+
+    SDFExpr SDFUnion(const SDFExpr &a, const SDFExpr &b);
+    SDFExpr SDFSmoothUnion(const SDFExpr &a, const SDFExpr &b, const float k = 0.2f);
+    SDFExpr SDFIntersect(const SDFExpr &a, const SDFExpr &b);
+    SDFExpr SDFRound(const SDFExpr &a, const float rad = 0.2f);
+    SDFExpr SDFTranslate(const SDFExpr &a, const glm::vec3 &p);
+    SDFExpr operator-(const SDFExpr &a);
+    SDFExpr operator-(const SDFExpr &a, const SDFExpr &b);
+    SDFExpr operator+(const SDFExpr &a, const SDFExpr &b);
+    /// @brief Twists a around the vertical axis through p, by k radians per unit of height.
+    SDFExpr SDFTwist(const SDFExpr &a, const glm::vec3 &p, const float k);
+
+    struct SDFInstruction
+    {
+        SDFOp _op;
+        uint32_t _func;
+        glm::vec4 _param;
+    };
+
+    /// @brief Value and coordinate stack depth available to SDFTape::Evaluate.
+    constexpr int SDF_TAPE_STACK_SIZE = 32;
+    /// @brief Points evaluated together by SDFTape::EvaluateBatch.
+    constexpr int SDF_BATCH_SIZE = 8;
+
+    /// @brief An SDF expression flattened into a postfix instruction tape, evaluated by one loop over a fixed-size stack.
+    class SDFTape
+    {
+    private:
+        std::vector<SDFInstruction> _code;
+        std::vector<SDFFunction> _funcs;
+
+    public:
+        SDFTape() = delete;
+        SDFTape(const SDFExpr &expr);
+        const float Evaluate(const glm::vec3 &p) const;
+        /// @brief Evaluates the distance and its gradient at p in one forward-mode dual-number pass.
+        /// @note Opaque FUNCTION leaves are differentiated with forward differences.
+        const float EvaluateGrad(const glm::vec3 &p, glm::vec3 &grad) const;
+        /// @brief Evaluates count <= SDF_BATCH_SIZE points given as separate x, y and z arrays, one pass over the tape for all of them.
+        void EvaluateBatch(const int count, const float *x, const float *y, const float *z, float *dist) const;
+        const size_t size() const
+        {
+            return _code.size();
+        }
+    };
+
+    /// @brief Cells along each edge of a brick.
+    constexpr int SDF_BRICK_SIZE = 8;
+
+    /// @brief Sparse two-level grid of baked distances over a bounding box, giving conservative step sizes to the sphere tracer.
+    /// Bricks far from the surface keep only the distance at their center, bricks near it keep one distance per cell.
+    /// @note Bounds assume the SDF is 1-Lipschitz, as sphere tracing already does.
+    class SDFBrickMap
+    {
+    private:
+        BBox _bbox;
+        float _cell_size;
+        glm::ivec3 _brick_count;
+        std::vector<float> _brick_dist;
+        /// @brief Offset of each brick's cells in _cells, -1 for far bricks.
+        std::vector<int> _brick_offset;
+        std::vector<float> _cells;
+
+    public:
+        SDFBrickMap() = delete;
+        /// @param resolution Cells along the longest edge of bbox.
+        SDFBrickMap(const SDFTape &tape, const BBox &bbox, const int resolution);
+        /// @brief Lower bound of the distance at p, -inf outside of the baked box.
+        const float Bound(const glm::vec3 &p) const;
+        const float cell_size() const
+        {
+            return _cell_size;
+        }
+        const size_t bytes() const
+        {
+            return _brick_dist.size() * sizeof(float) + _brick_offset.size() * sizeof(int) + _cells.size() * sizeof(float);
+        }
+    };
+}
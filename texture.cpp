@@ -1,7 +1,36 @@
 #include "texture.h"
 #include "importer.h"
 
+#include <algorithm>
+#include <limits>
+
 rendertoy::ImageTexture::ImageTexture(const std::string &path)
 : _image(ImportImageFromFile(path))
 {
+}
+
+const bool rendertoy::ImageTexture::SampleRange(const glm::vec2 &uv_min, const glm::vec2 &uv_max, glm::vec4 &lo, glm::vec4 &hi) const
+{
+    // Sample reads out of the image for uv outside of [0, 1].
+    if (uv_min.x < 0.0f || uv_min.y < 0.0f || uv_max.x > 1.0f || uv_max.y > 1.0f)
+    {
+        return false;
+    }
+    // Same texel addressing as Sample, v is flipped. Bilinear samples are convex combinations of the texels they touch.
+    const int extra = _sample_method == SampleMethod::BILINEAR ? 1 : 0;
+    const int x_min = static_cast<int>(uv_min.x * (_image.width() - 1));
+    const int x_max = std::min(static_cast<int>(uv_max.x * (_image.width() - 1)) + extra, _image.width() - 1);
+    const int y_min = static_cast<int>((1.0f - uv_max.y) * (_image.height() - 1));
+    const int y_max = std::min(static_cast<int>((1.0f - uv_min.y) * (_image.height() - 1)) + extra, _image.height() - 1);
+    lo = glm::vec4(std::numeric_limits<float>::infinity());
+    hi = glm::vec4(-std::numeric_limits<float>::infinity());
+    for (int y = y_min; y <= y_max; ++y)
+    {
+        for (int x = x_min; x <= x_max; ++x)
+        {
+            lo = glm::min(lo, _image(x, y));
+            hi = glm::max(hi, _image(x, y));
+        }
+    }
+    return true;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <mutex>
 
 #include "rendertoy_internal.h"
 #include "composition.h"
@@ -32,8 +33,17 @@ namespace rendertoy
         }
 
         virtual const T Avg() const = 0;
+        /// @brief Bounds lo, hi of every value Sample returns inside the uv rectangle [uv_min, uv_max].
+        /// @return false if the bounds are not known, the default for textures that do not implement it.
+        virtual const bool SampleRange(const glm::vec2 &uv_min, const glm::vec2 &uv_max, T &lo, T &hi) const;
     };
 
+    template <typename T>
+    const bool ISamplable<T>::SampleRange(const glm::vec2 &, const glm::vec2 &, T &, T &) const
+    {
+        return false;
+    }
+
     typedef ISamplable<glm::vec4> ISamplableColor;
     typedef ISamplable<float> ISamplableNumerical;
 
@@ -54,6 +64,12 @@ namespace rendertoy
         {
             return _value;
         }
+
+        virtual const bool SampleRange(const glm::vec2 &, const glm::vec2 &, float &lo, float &hi) const
+        {
+            lo = hi = _value;
+            return true;
+        }
     };
 
     class Brightness : public ISamplable<float>
@@ -79,6 +95,9 @@ namespace rendertoy
     {
     private:
         Image _image;
+        // Avg() is asked for by every light using the texture, the image is only averaged once.
+        mutable std::once_flag _avg_once;
+        mutable glm::vec4 _avg;
 
     public:
         ImageTexture(const Image &image) : _image(image) {}
@@ -120,8 +139,12 @@ namespace rendertoy
 
         virtual const glm::vec4 Avg() const
         {
-            return _image.Avg();
+            std::call_once(_avg_once, [this]()
+                           { _avg = _image.Avg(); });
+            return _avg;
         }
+
+        virtual const bool SampleRange(const glm::vec2 &uv_min, const glm::vec2 &uv_max, glm::vec4 &lo, glm::vec4 &hi) const;
     };
 
     class ColorTexture : public ISamplable<glm::vec4>
@@ -141,5 +164,11 @@ namespace rendertoy
         {
             return _color;
         }
+
+        virtual const bool SampleRange(const glm::vec2 &, const glm::vec2 &, glm::vec4 &lo, glm::vec4 &hi) const
+        {
+            lo = hi = _color;
+            return true;
+        }
     };
 }